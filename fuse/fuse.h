@@ -11,6 +11,10 @@
 #define FUSE_MIN_DAEMON_TIMEOUT                    0      /* s */
 #define FUSE_MAX_DAEMON_TIMEOUT                    600    /* s */
 
+/* limits of outstanding background requests, unless set otherwise */
+#define FUSE_DEFAULT_MAX_BACKGROUND                12
+#define FUSE_DEFAULT_CONGESTION_THRESHOLD          9
+
 
 /* Mapping versions to features */
 
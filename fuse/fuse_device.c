@@ -24,21 +24,42 @@
 #include <sys/sysctl.h>
 #include <sys/poll.h>
 #include <sys/selinfo.h>
+#include <sys/ioccom.h>
+#include <sys/file.h>
+#include <sys/filedesc.h>
+#include <sys/vnode.h>
+#if __FreeBSD_version >= 900000
+#include <sys/capability.h>
+#endif
+
+#include <vm/vm.h>
+#include <vm/vm_object.h>
 
 #include "fuse.h"
 #include "fuse_ipc.h"
+#include "fuse_internal.h"
+#include "fuse_ioctl.h"
+#include "fuse_ring.h"
+#include "fuse_stats.h"
+#include "fuse_sdt.h"
 
 #define FUSE_DEBUG_MODULE DEVICE
 #include "fuse_debug.h"
 
 static __inline int fuse_ohead_audit(struct fuse_out_header *ohead,
                                      struct uio *uio);
+static int fuse_device_attach(struct cdev *dev, int fd, struct thread *td);
+static int fuse_device_ring_enter(struct cdev *dev,
+                                  struct fuse_ring_enter *fn);
 
 static d_open_t  fuse_device_open;
 static d_close_t fuse_device_close;
 static d_poll_t  fuse_device_poll;
+static d_kqfilter_t fuse_device_kqfilter;
 static d_read_t  fuse_device_read;
 static d_write_t fuse_device_write;
+static d_ioctl_t fuse_device_ioctl;
+static d_mmap_single_t fuse_device_mmap_single;
 
 void fuse_device_clone(void *arg, struct ucred *cred, char *name,
                           int namelen, struct cdev **dev);
@@ -48,8 +69,11 @@ static struct cdevsw fuse_device_cdevsw = {
 	.d_close = fuse_device_close,
 	.d_name = "fuse",
 	.d_poll = fuse_device_poll,
+	.d_kqfilter = fuse_device_kqfilter,
 	.d_read = fuse_device_read,
 	.d_write = fuse_device_write,
+	.d_ioctl = fuse_device_ioctl,
+	.d_mmap_single = fuse_device_mmap_single,
 	.d_version = D_VERSION,
 	.d_flags = D_NEEDMINOR,
 };
@@ -93,6 +117,7 @@ fuse_device_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
 	} else {
 		fdata->dataflags |= FSESS_OPENED;
 		dev->si_drv1 = fdata;
+		dev->si_drv2 = fdata->chans[0];
 	}	
 	FUSE_UNLOCK();
 
@@ -108,34 +133,45 @@ static int
 fuse_device_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
 {
 	struct fuse_data *data;
-	struct fuse_ticket *tick;
+	struct fuse_chan *chan;
 
 	data = fuse_get_devdata(dev);
 	if (!data)
 		panic("no fuse data upon fuse device close");
+
+	if (data->fdev != dev) {
+		/*
+		 * An extra channel is going away; the session lives on
+		 * as long as its primary device is open.
+		 */
+		chan = fuse_get_devchan(dev);
+		fchan_close(chan);
+
+		FUSE_LOCK();
+		chan->ch_dev = NULL;
+		dev->si_drv1 = NULL;
+		dev->si_drv2 = NULL;
+		fdata_trydestroy(data);
+		FUSE_UNLOCK();
+
+		DEBUG("%s: channel closed by thread %d.\n", dev->si_name,
+		    td->td_tid);
+		return(0);
+	}
+
 	KASSERT(data->dataflags | FSESS_OPENED,
 	        ("fuse device is already closed upon close"));
 	fdata_set_dead(data);
+	fring_teardown(fuse_get_devchan(dev), NULL);
+
+	/* Don't let syscall handlers wait in vain */
+	fdata_abort_answers(data, ENOTCONN);
 
 	FUSE_LOCK();
         data->dataflags &= ~FSESS_OPENED;
 
-	fuse_lck_mtx_lock(data->aw_mtx);
-	/* wakup poll()ers */
-	selwakeuppri(&data->ks_rsel, PZERO + 1);
-	/* Don't let syscall handlers wait in vain */
-	while ((tick = fuse_aw_pop(data))) {
-		fuse_lck_mtx_lock(tick->tk_aw_mtx);
-		fticket_set_answered(tick);
-		tick->tk_aw_errno = ENOTCONN;
-		wakeup(tick);
-		fuse_lck_mtx_unlock(tick->tk_aw_mtx);
-		FUSE_ASSERT_AW_DONE(tick);
-		fuse_ticket_drop(tick);
-	}
-	fuse_lck_mtx_unlock(data->aw_mtx);
-
 	dev->si_drv1 = NULL;
+	dev->si_drv2 = NULL;
 	fdata_trydestroy(data);
 	FUSE_UNLOCK();
 
@@ -143,21 +179,36 @@ fuse_device_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
 	return(0);
 }
 
+/*
+ * Number of messages waiting for the daemon on chan, be they queued or
+ * posted to the ring.
+ */
+static __inline int
+fuse_device_pending(struct fuse_chan *chan)
+{
+	mtx_assert(&chan->ms_mtx, MA_OWNED);
+
+	return (fuse_ms_count(chan) +
+	    (chan->ch_ring ? fring_sq_count(chan->ch_ring) : 0));
+}
+
 int
 fuse_device_poll(struct cdev *dev, int events, struct thread *td)
 {
 	struct fuse_data *data;
+	struct fuse_chan *chan;
 	int revents = 0;
 
 	data = fuse_get_devdata(dev);
+	chan = fuse_get_devchan(dev);
 
 	if (events & (POLLIN | POLLRDNORM)) {
-		fuse_lck_mtx_lock(data->ms_mtx);
-		if (fdata_get_dead(data) || STAILQ_FIRST(&data->ms_head))
+		fuse_lck_mtx_lock(chan->ms_mtx);
+		if (fdata_get_dead(data) || fuse_device_pending(chan) > 0)
 			revents |= events & (POLLIN | POLLRDNORM);
 		else
-			selrecord(td, &data->ks_rsel);
-		fuse_lck_mtx_unlock(data->ms_mtx);
+			selrecord(td, &chan->ks_rsel);
+		fuse_lck_mtx_unlock(chan->ms_mtx);
 	}
 
 	if (events & (POLLOUT | POLLWRNORM)) {
@@ -167,47 +218,345 @@ fuse_device_poll(struct cdev *dev, int events, struct thread *td)
 	return (revents);
 }
 
+static void
+fuse_device_filt_detach(struct knote *kn)
+{
+	struct fuse_chan *chan = kn->kn_hook;
+
+	knlist_remove(&chan->ks_rsel.si_note, kn, 0);
+}
+
+/*
+ * Ready if there are messages to read (kn_data tells how many), or if
+ * the session is gone, in which case EV_EOF is set too.
+ */
+static int
+fuse_device_filt_read(struct knote *kn, long hint)
+{
+	struct fuse_chan *chan = kn->kn_hook;
+
+	mtx_assert(&chan->ms_mtx, MA_OWNED);
+
+	if (fdata_get_dead(chan->ch_data)) {
+		kn->kn_flags |= EV_EOF;
+		kn->kn_data = 0;
+		return (1);
+	}
+	kn->kn_data = fuse_device_pending(chan);
+
+	return (kn->kn_data > 0);
+}
+
+static void
+fuse_device_filt_wdetach(struct knote *kn)
+{
+}
+
+/* answers are always taken, as in poll */
+static int
+fuse_device_filt_write(struct knote *kn, long hint)
+{
+	kn->kn_data = 0;
+	return (1);
+}
+
+static struct filterops fuse_device_rfiltops = {
+	.f_isfd = 1,
+	.f_detach = fuse_device_filt_detach,
+	.f_event = fuse_device_filt_read,
+};
+
+static struct filterops fuse_device_wfiltops = {
+	.f_isfd = 1,
+	.f_detach = fuse_device_filt_wdetach,
+	.f_event = fuse_device_filt_write,
+};
+
+static int
+fuse_device_kqfilter(struct cdev *dev, struct knote *kn)
+{
+	struct fuse_chan *chan;
+
+	chan = fuse_get_devchan(dev);
+
+	switch (kn->kn_filter) {
+	case EVFILT_READ:
+		kn->kn_fop = &fuse_device_rfiltops;
+		kn->kn_hook = chan;
+		knlist_add(&chan->ks_rsel.si_note, kn, 0);
+		break;
+	case EVFILT_WRITE:
+		kn->kn_fop = &fuse_device_wfiltops;
+		break;
+	default:
+		return (EINVAL);
+	}
+
+	return (0);
+}
+
+/*
+ * Histogram of the number of messages passed up per batched read;
+ * bucket i counts reads of [2^i, 2^(i+1)) messages.
+ */
+#define FUSE_BATCH_HISTSIZE 8
+static u_long fuse_batch_hist[FUSE_BATCH_HISTSIZE];
+
+static int
+fuse_batch_hist_sysctl(SYSCTL_HANDLER_ARGS)
+{
+	struct sbuf sb;
+	int err, i;
+
+	sbuf_new_for_sysctl(&sb, NULL, 128, req);
+	for (i = 0; i < FUSE_BATCH_HISTSIZE; i++) {
+		if (i == FUSE_BATCH_HISTSIZE - 1)
+			sbuf_printf(&sb, "%s%d-: %lu", i ? "\n" : "",
+			    1 << i, fuse_batch_hist[i]);
+		else
+			sbuf_printf(&sb, "%s%d-%d: %lu", i ? "\n" : "",
+			    1 << i, (1 << (i + 1)) - 1, fuse_batch_hist[i]);
+	}
+	err = sbuf_finish(&sb);
+	sbuf_delete(&sb);
+
+	return (err);
+}
+
+SYSCTL_DECL(_vfs_fuse);
+SYSCTL_PROC(_vfs_fuse, OID_AUTO, read_batch_hist,
+    CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, 0,
+    fuse_batch_hist_sysctl, "A",
+    "histogram of messages passed up per batched read");
+
+static __inline void
+fuse_batch_record(int nbatch)
+{
+	int i;
+
+	i = fls(nbatch) - 1;
+	if (i >= FUSE_BATCH_HISTSIZE)
+		i = FUSE_BATCH_HISTSIZE - 1;
+	atomic_add_long(&fuse_batch_hist[i], 1);
+}
+
+/*
+ * Throw away a message whose sender has given up on it. As nobody waits
+ * for the answer either, take the ticket off the answer list too.
+ */
+static void
+fuse_device_discard(struct fuse_data *data, struct fuse_ticket *tick)
+{
+	struct fuse_ticket *atick;
+
+	DEBUG("discarding abandoned message of ticket %p\n", tick);
+
+	if ((atick = fuse_aw_lookup(data, tick->tk_unique)) != NULL) {
+		MPASS(atick == tick);
+		FUSE_ASSERT_AW_DONE(atick);
+		fuse_ticket_drop(atick);
+	}
+	FUSE_ASSERT_MS_DONE(tick);
+	fuse_ticket_drop(tick);
+}
+
+/*
+ * Pop the next message of chan which can still be passed up, and claim it
+ * for copying out.
+ */
+static struct fuse_ticket *
+fuse_device_pop(struct fuse_data *data, struct fuse_chan *chan)
+{
+	struct fuse_ticket *tick;
+
+	while ((tick = fuse_ms_pop(chan)) != NULL) {
+		if (fticket_ms_claim(tick) == 0)
+			break;
+		fuse_device_discard(data, tick);
+	}
+
+	return (tick);
+}
+
+/*
+ * Put messages taken along for a batch but not passed up back to the
+ * head of the channel's queue, keeping their order. Returns their number.
+ */
+static int
+fuse_device_requeue(struct fuse_chan *chan, struct fuse_ms_head *batch)
+{
+	struct fuse_ticket *tick;
+	int n = 0;
+
+	STAILQ_FOREACH(tick, batch, tk_ms_link) {
+		fticket_ms_release(tick, 0);
+		n++;
+	}
+	if (n == 0)
+		return (0);
+
+	fuse_lck_mtx_lock(chan->ms_mtx);
+	fuse_ms_requeue(chan, batch);
+	fchan_notify(chan);
+	fuse_lck_mtx_unlock(chan->ms_mtx);
+
+	return (n);
+}
+
+/*
+ * Copy the message of tick out to the daemon. Messages are not split up
+ * among reads.
+ */
+static int
+fuse_device_copyout(struct fuse_data *data, struct fuse_ticket *tick,
+    struct uio *uio)
+{
+	int err = 0;
+	void *buf[] = { NULL, NULL, NULL };
+	int buflen[3];
+	int i;
+
+	KASSERT(tick->tk_ms_bufdata || tick->tk_ms_bufsize == 0,
+	        ("non-null buf pointer with positive size"));
+
+	switch (tick->tk_ms_type) {
+	case FT_M_FIOV:
+		buf[0] = tick->tk_ms_fiov.base;
+		buflen[0] =  tick->tk_ms_fiov.len;
+		break;
+	case FT_M_BUF:
+		buf[0] = tick->tk_ms_fiov.base;
+		buflen[0] =  tick->tk_ms_fiov.len;
+		buf[1] = tick->tk_ms_bufdata;
+		buflen[1] =  tick->tk_ms_bufsize;
+		break;
+	default:
+		panic("unknown message type for fuse_ticket %p", tick);
+	}
+
+	for (i = 0; buf[i]; i++) {
+		/*
+		 * Why not ban mercilessly stupid daemons who can't keep up
+		 * with us? (There is no much use of a partial read here...)
+		 */
+		/*
+		 * XXX note that in such cases Linux FUSE throws EIO at the
+		 * syscall invoker and stands back to the message queue. The
+		 * rationale should be made clear (and possibly adopt that
+		 * behaviour). Keeping the current scheme at least makes
+		 * fallacy as loud as possible...
+		 */
+		if (uio->uio_resid < buflen[i]) {
+			fdata_set_dead(data);
+			DEBUG2G("daemon is stupid, kick it off...\n");
+			err = ENODEV;
+			break;
+		}
+		err = uiomove(buf[i], buflen[i], uio);
+		if (err)
+			break;
+	}
+	if (err == 0) {
+		fuse_stats_sent(tick);
+		FUSE_TICKET_PROBE(device, read, tick, tick->tk_ms_lane);
+	}
+
+	return (err);
+}
+
+static int fuse_read_spin = 0;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, read_spin, CTLFLAG_RW, &fuse_read_spin, 0,
+    "usecs a reader of an empty queue spins for messages before sleeping");
+
+/*
+ * Wait a little for a message to come in on chan without going to sleep,
+ * so that under a steady flow of requests neither side needs to go
+ * through the scheduler. Only one reader spins at a time, the others go
+ * to sleep right away. Called and returns with the message list mutex
+ * held; returns non-zero if the wait is over.
+ */
+static int
+fuse_device_spin(struct fuse_data *data, struct fuse_chan *chan)
+{
+	volatile int *count = &chan->ms_count;
+	uint64_t until;
+
+	mtx_assert(&chan->ms_mtx, MA_OWNED);
+
+	if (fuse_read_spin <= 0 || chan->ch_spinning)
+		return (0);
+
+	chan->ch_spinning = 1;
+	fuse_lck_mtx_unlock(chan->ms_mtx);
+	until = fuse_stats_now() + fuse_read_spin;
+	while (*count == 0 && chan->ch_stage == NULL &&
+	    !fdata_get_dead(data) && fuse_stats_now() < until)
+		cpu_spinwait();
+	fuse_lck_mtx_lock(chan->ms_mtx);
+	chan->ch_spinning = 0;
+
+	return (fuse_ms_count(chan) > 0 || fdata_get_dead(data));
+}
+
 /*
  * fuse_device_read hangs on the queue of VFS messages.
  * When it's notified that there is a new one, it picks that and
- * passes up to the daemon
+ * passes up to the daemon.
+ *
+ * In batched mode (FUSE_DEVFEAT_BATCH_READ) it also takes along as many
+ * of the further queued messages as fit in the read buffer.
  */
 int
 fuse_device_read(struct cdev *dev, struct uio *uio, int ioflag)
 {
 	int err = 0;
 	struct fuse_data *data;
-	struct fuse_ticket *tick;
-	void *buf[] = { NULL, NULL, NULL };
-	int buflen[3];
-	int i;
+	struct fuse_chan *chan;
+	struct fuse_ticket *tick, *next;
+	struct fuse_ms_head batch;
+	struct uio *cuio;
+	ssize_t room, resid;
+	int nbatch;
 
 	data = fuse_get_devdata(dev);
+	chan = fuse_get_devchan(dev);
+	STAILQ_INIT(&batch);
+	nbatch = 0;
 
 	DEBUG("fuse device being read on thread %d\n", uio->uio_td->td_tid);
 
-	fuse_lck_mtx_lock(data->ms_mtx);
+	/* the daemon is looking for work, FORGETs needn't wait anymore */
+	if (data->forget_count > 0)
+		fuse_internal_forget_flush(data);
+
+	fuse_lck_mtx_lock(chan->ms_mtx);
 again:
 	if (fdata_get_dead(data)) {
 		DEBUG2G("we know early on that reader should be kicked so we don't wait for news\n");
-		fuse_lck_mtx_unlock(data->ms_mtx);
+		fuse_lck_mtx_unlock(chan->ms_mtx);
 		return (ENODEV);
 	}
 
-	if (!(tick = fuse_ms_pop(data))) {
+	if (!(tick = fuse_device_pop(data, chan))) {
 		/* check if we may block */
 		if (ioflag & O_NONBLOCK) {
 			/* get outa here soon */
-			fuse_lck_mtx_unlock(data->ms_mtx);
+			fuse_lck_mtx_unlock(chan->ms_mtx);
 			return (EAGAIN);
 		}
 		else {
-			err = msleep(data, &data->ms_mtx, PCATCH, "fu_msg", 0);
-			if (err != 0) {
-				fuse_lck_mtx_unlock(data->ms_mtx);
-				return (fdata_get_dead(data) ? ENODEV : err);
+			if (!fuse_device_spin(data, chan)) {
+				chan->ch_sleepers++;
+				err = msleep(chan, &chan->ms_mtx, PCATCH,
+				    "fu_msg", 0);
+				chan->ch_sleepers--;
+				if (err != 0) {
+					fuse_lck_mtx_unlock(chan->ms_mtx);
+					return (fdata_get_dead(data) ? ENODEV :
+					    err);
+				}
 			}
-			tick = fuse_ms_pop(data);
+			tick = fuse_device_pop(data, chan);
 		}
 	}
 	if (!tick) {
@@ -220,7 +569,22 @@ again:
 		DEBUG("no message on thread #%d\n", uio->uio_td->td_tid);
 		goto again;
 	}
-	fuse_lck_mtx_unlock(data->ms_mtx);
+	if (chan->ch_feat & FUSE_DEVFEAT_BATCH_READ) {
+		nbatch = 1;
+		room = uio->uio_resid - (ssize_t)fticket_ms_len(tick);
+		while ((next = fuse_ms_peek(chan)) &&
+		    (ssize_t)fticket_ms_len(next) <= room) {
+			fuse_ms_pop(chan);
+			if (fticket_ms_claim(next)) {
+				fuse_device_discard(data, next);
+				continue;
+			}
+			room -= fticket_ms_len(next);
+			STAILQ_INSERT_TAIL(&batch, next, tk_ms_link);
+			nbatch++;
+		}
+	}
+	fuse_lck_mtx_unlock(chan->ms_mtx);
 
 	if (fdata_get_dead(data)) {
 		/*
@@ -231,56 +595,58 @@ again:
 		if (tick) {
 			DEBUG2G("weird -- \"kick\" is set tho there is message\n");
 			FUSE_ASSERT_MS_DONE(tick);
+			fticket_ms_release(tick, 0);
+			fuse_ticket_drop(tick);
+		}
+		while ((tick = STAILQ_FIRST(&batch))) {
+			STAILQ_REMOVE_HEAD(&batch, tk_ms_link);
+			fticket_ms_release(tick, 0);
 			fuse_ticket_drop(tick);
 		}
 		return (ENODEV); /* This should make the daemon get off of us */
 	}
 	DEBUG("message got on thread #%d\n", uio->uio_td->td_tid);
 
-	KASSERT(tick->tk_ms_bufdata || tick->tk_ms_bufsize == 0,
-	        ("non-null buf pointer with positive size"));
-
-	switch (tick->tk_ms_type) {
-	case FT_M_FIOV:
-		buf[0] = tick->tk_ms_fiov.base;
-		buflen[0] =  tick->tk_ms_fiov.len;
-		break;
-	case FT_M_BUF:
-		buf[0] = tick->tk_ms_fiov.base;
-		buflen[0] =  tick->tk_ms_fiov.len;
-		buf[1] = tick->tk_ms_bufdata;
-		buflen[1] =  tick->tk_ms_bufsize;
-		break;
-	default:
-		panic("unknown message type for fuse_ticket %p", tick);
-	}
+	err = fuse_device_copyout(data, tick, uio);
+	fticket_ms_release(tick, err == 0);
+	FUSE_ASSERT_MS_DONE(tick);
+	fuse_ticket_drop(tick);
+	if (err)
+		goto requeue;
 
-	for (i = 0; buf[i]; i++) {
-		/*
-		 * Why not ban mercilessly stupid daemons who can't keep up
-		 * with us? (There is no much use of a partial read here...)
-		 */
-		/*
-		 * XXX note that in such cases Linux FUSE throws EIO at the
-		 * syscall invoker and stands back to the message queue. The
-		 * rationale should be made clear (and possibly adopt that
-		 * behaviour). Keeping the current scheme at least makes
-		 * fallacy as loud as possible...
-		 */
-		if (uio->uio_resid < buflen[i]) {
-			fdata_set_dead(data);
-			DEBUG2G("daemon is stupid, kick it off...\n");
-			err = ENODEV;
+	/*
+	 * The rest of the batch is copied out through a clone of uio, and
+	 * uio is moved on by whole messages only. So if copying out one of
+	 * them fails, what has been read so far is reported as is, and the
+	 * failed message and the ones behind it are left to the next read.
+	 */
+	cuio = STAILQ_EMPTY(&batch) ? NULL : cloneuio(uio);
+	while ((tick = STAILQ_FIRST(&batch))) {
+		resid = cuio->uio_resid;
+		err = fuse_device_copyout(data, tick, cuio);
+		if (err) {
+			err = 0;
+			nbatch -= fuse_device_requeue(chan, &batch);
 			break;
 		}
-		err = uiomove(buf[i], buflen[i], uio);
-		if (err)
-			break;
+		uio_skip(uio, resid - cuio->uio_resid);
+		STAILQ_REMOVE_HEAD(&batch, tk_ms_link);
+#ifdef INVARIANTS
+		tick->tk_ms_link.stqe_next = NULL;
+#endif
+		fticket_ms_release(tick, 1);
+		fuse_ticket_drop(tick);
 	}
+	if (cuio != NULL)
+		free(cuio, M_IOV);
 
-	FUSE_ASSERT_MS_DONE(tick);
-	fuse_ticket_drop(tick);
+	if (nbatch > 0)
+		fuse_batch_record(nbatch);
+
+	return (err);
 
+requeue:
+	fuse_device_requeue(chan, &batch);
 	return (err);
 }
 
@@ -308,63 +674,24 @@ fuse_ohead_audit(struct fuse_out_header *ohead, struct uio *uio)
 }	
 
 /*
- * fuse_device_write first reads the header sent by the daemon.
- * If that's OK, looks up ticket/callback node by the unique id seen in header.
- * If the callback node contains a handler function, the uio is passed over
- * that.
+ * Hand over the body of a reply to the ticket it belongs to.
  */
 static int
-fuse_device_write(struct cdev *dev, struct uio *uio, int ioflag)
+fuse_device_dispatch(struct fuse_data *data, struct fuse_out_header *ohead,
+    struct uio *uio)
 {
-	struct fuse_out_header ohead;
 	int err = 0;
-	struct fuse_data *data;
-	struct fuse_ticket *tick, *x_tick;
-	int found = 0;
-
-	DEBUG("resid: %zd, iovcnt: %d, thread: %d\n",
-		uio->uio_resid, uio->uio_iovcnt, uio->uio_td->td_tid);
-
-	data = fuse_get_devdata(dev);
-
-	if (uio->uio_resid < sizeof(struct fuse_out_header)) {
-		DEBUG("got less than a header!\n");
-		fdata_set_dead(data);
-		return (EINVAL);
-	}
-
-	if ((err = uiomove(&ohead, sizeof(struct fuse_out_header), uio)) != 0)
-		return (err);
+	struct fuse_ticket *tick;
 
-	/*	
-	 * We check header information (which is redundant) and compare it with
-	 * what we see. If we see some inconsistency we discard the whole
-	 * answer and proceed on as if it had never existed. In particular, no
-	 * pretender will be woken up, regardless the "unique" value in the
-	 * header.
-	 */
-	if ((err = fuse_ohead_audit(&ohead, uio))) {
-		fdata_set_dead(data);
-		return (err);
-	}
-	
 	/* Pass stuff over to callback if there is one installed */
 
+	SDT_PROBE3(fuse, , device, reply, ohead->unique, ohead->error,
+	    ohead->len);
+
 	/* Looking for ticket with the unique id of header */
-	fuse_lck_mtx_lock(data->aw_mtx);
-	TAILQ_FOREACH_SAFE(tick, &data->aw_head, tk_aw_link,
-	                   x_tick) {
-		DEBUG("bumped into callback #%llu\n",
-                         (unsigned long long)tick->tk_unique);
-		if (tick->tk_unique == ohead.unique) {
-			found = 1;
-			fuse_aw_remove(tick);
-			break;
-		}
-	}
-	fuse_lck_mtx_unlock(data->aw_mtx);
+	tick = fuse_aw_lookup(data, ohead->unique);
 
-	if (found) {
+	if (tick) {
 		if (tick->tk_aw_handler) {
 			/* We found a callback with proper handler.
 			 * In this case the out header will be 0wnd by
@@ -374,7 +701,9 @@ fuse_device_write(struct cdev *dev, struct uio *uio, int ioflag)
 			 * via ticket_drop(), so no manual mucking around...)
 			 */
 			DEBUG("pass ticket to a callback\n");
-			memcpy(&tick->tk_aw_ohead, &ohead, sizeof(ohead));
+			memcpy(&tick->tk_aw_ohead, ohead, sizeof(*ohead));
+			fuse_stats_answered(tick, ohead);
+			FUSE_TICKET_PROBE(ticket, dispatch, tick, ohead->error);
 			err = tick->tk_aw_handler(tick, uio);
 		} else {
 			/* pretender doesn't wanna do anything with answer */
@@ -391,6 +720,401 @@ fuse_device_write(struct cdev *dev, struct uio *uio, int ioflag)
 	return (err);
 }
 
+/*
+ * Handle a message the daemon sends on its own: it has a zero unique and
+ * the notification code in the error field of its header. A bad
+ * notification fails the write, but leaves the session alone.
+ *
+ * As we offer protocol 7.8 in INIT, libfuse refuses to send these (it wants
+ * 7.12, see FUSE_KERNEL_MINOR_VERSION); only daemons speaking the protocol
+ * on their own get here for now.
+ */
+static int
+fuse_device_notify(struct fuse_data *data, struct fuse_out_header *ohead,
+    struct uio *uio)
+{
+	struct fuse_notify_inval_inode_out fnii;
+	struct fuse_notify_inval_entry_out fnie;
+	char name[MAXNAMLEN + 1];
+	struct mount *mp;
+	int err;
+
+	if (ohead->len != uio->uio_resid + sizeof(*ohead))
+		return (EINVAL);
+
+	/* keep the mount from going away while we are at it */
+	FUSE_LOCK();
+	mp = data->mp;
+	err = mp == NULL ? ENODEV : vfs_busy(mp, MBF_NOWAIT);
+	FUSE_UNLOCK();
+	if (err)
+		return (err);
+
+	switch (ohead->error) {
+	case FUSE_NOTIFY_INVAL_INODE:
+		if (uio->uio_resid != sizeof(fnii)) {
+			err = EINVAL;
+			break;
+		}
+		if ((err = uiomove(&fnii, sizeof(fnii), uio)) != 0)
+			break;
+		err = fuse_internal_inval_inode(mp, fnii.ino, fnii.off,
+		    fnii.len);
+		break;
+	case FUSE_NOTIFY_INVAL_ENTRY:
+		if (uio->uio_resid < sizeof(fnie)) {
+			err = EINVAL;
+			break;
+		}
+		if ((err = uiomove(&fnie, sizeof(fnie), uio)) != 0)
+			break;
+		/* the name comes with a terminating nul */
+		if (fnie.namelen == 0 || fnie.namelen > MAXNAMLEN ||
+		    uio->uio_resid != fnie.namelen + 1) {
+			err = EINVAL;
+			break;
+		}
+		if ((err = uiomove(name, fnie.namelen + 1, uio)) != 0)
+			break;
+		if (name[fnie.namelen] != '\0') {
+			err = EINVAL;
+			break;
+		}
+		err = fuse_internal_inval_entry(mp, fnie.parent, name,
+		    fnie.namelen);
+		break;
+	default:
+		DEBUG("unsupported notification %d\n", ohead->error);
+		err = ENOSYS;
+		break;
+	}
+
+	vfs_unbusy(mp);
+	return (err);
+}
+
+/*
+ * fuse_device_write first reads the header sent by the daemon.
+ * If that's OK, looks up ticket/callback node by the unique id seen in header.
+ * If the callback node contains a handler function, the uio is passed over
+ * that. Replies with a zero unique are notifications, which are handled by
+ * fuse_device_notify.
+ *
+ * In batched mode (FUSE_DEVFEAT_BATCH_WRITE) the write is a sequence of
+ * replies, each framed by the len field of its header, which are processed
+ * in order. Processing stops at the first reply which fails. If that's the
+ * first one, its error is returned; else the write is reported short, up
+ * to the start of the failed reply. Framing errors are fatal as ever.
+ */
+static int
+fuse_device_write(struct cdev *dev, struct uio *uio, int ioflag)
+{
+	struct fuse_out_header ohead;
+	int err = 0;
+	struct fuse_data *data;
+	struct fuse_chan *chan;
+	ssize_t total, start, rest;
+	int batch;
+
+	DEBUG("resid: %zd, iovcnt: %d, thread: %d\n",
+		uio->uio_resid, uio->uio_iovcnt, uio->uio_td->td_tid);
+
+	data = fuse_get_devdata(dev);
+	chan = fuse_get_devchan(dev);
+	batch = chan->ch_feat & FUSE_DEVFEAT_BATCH_WRITE;
+	total = uio->uio_resid;
+
+	do {
+		start = uio->uio_resid;
+
+		if (uio->uio_resid < sizeof(struct fuse_out_header)) {
+			DEBUG("got less than a header!\n");
+			fdata_set_dead(data);
+			return (EINVAL);
+		}
+
+		if ((err = uiomove(&ohead, sizeof(struct fuse_out_header),
+		    uio)) != 0)
+			break;
+
+		rest = 0;
+		if (batch) {
+			if (ohead.len < sizeof(struct fuse_out_header) ||
+			    ohead.len - sizeof(struct fuse_out_header) >
+			    uio->uio_resid) {
+				DEBUG("Format error: reply overruns the write\n");
+				fdata_set_dead(data);
+				return (EINVAL);
+			}
+			rest = uio->uio_resid -
+			    (ohead.len - sizeof(struct fuse_out_header));
+			uio->uio_resid -= rest;
+		}
+
+		/*	
+		 * We check header information (which is redundant) and compare
+		 * it with what we see. If we see some inconsistency we discard
+		 * the whole answer and proceed on as if it had never existed.
+		 * In particular, no pretender will be woken up, regardless the
+		 * "unique" value in the header.
+		 */
+		if (ohead.unique == 0) {
+			/* not an answer, but a notification */
+			err = fuse_device_notify(data, &ohead, uio);
+		} else {
+			if ((err = fuse_ohead_audit(&ohead, uio))) {
+				fdata_set_dead(data);
+				return (err);
+			}
+
+			err = fuse_device_dispatch(data, &ohead, uio);
+		}
+
+		if (batch) {
+			/* step over what the handler left unread */
+			if (uio->uio_resid)
+				uio_skip(uio, uio->uio_resid);
+			uio->uio_resid = rest;
+		}
+	} while (err == 0 && batch && uio->uio_resid > 0);
+
+	if (err && start != total) {
+		uio->uio_resid = start;
+		err = 0;
+	}
+
+	return (err);
+}
+
+static int
+fuse_device_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
+    struct thread *td)
+{
+	struct fuse_chan *chan;
+	int err = 0;
+
+	switch (cmd) {
+	case FUSEDEVIOCATTACH:
+		err = fuse_device_attach(dev, *(int *)data, td);
+		break;
+	case FUSEDEVIOCSETFEAT:
+		chan = fuse_get_devchan(dev);
+		fuse_lck_mtx_lock(chan->ms_mtx);
+		chan->ch_feat = *(int *)data & FUSE_DEVFEAT_ALL;
+		*(int *)data = chan->ch_feat;
+		fuse_lck_mtx_unlock(chan->ms_mtx);
+		break;
+	case FUSEDEVIOCRINGSETUP:
+		err = fring_setup(fuse_get_devchan(dev),
+		    (struct fuse_ring_setup *)data, td->td_ucred);
+		break;
+	case FUSEDEVIOCRINGENTER:
+		err = fuse_device_ring_enter(dev, (struct fuse_ring_enter *)data);
+		break;
+	default:
+		err = ENOTTY;
+		break;
+	}
+
+	return (err);
+}
+
+/*
+ * Process the replies the daemon posted to the completion queue of the
+ * ring, the same way as if they were written to the device; then, if
+ * asked so, wait for new requests.
+ */
+static int
+fuse_device_ring_enter(struct cdev *dev, struct fuse_ring_enter *fn)
+{
+	struct fuse_out_header ohead;
+	struct fuse_data *data;
+	struct fuse_chan *chan;
+	struct fuse_ring *ring;
+	struct fuse_ticket *tick;
+	struct iovec iov;
+	struct uio uio;
+	uint32_t slot, len;
+	char *p;
+	int err;
+
+	data = fuse_get_devdata(dev);
+	chan = fuse_get_devchan(dev);
+	fn->fn_reaped = 0;
+
+	fuse_lck_mtx_lock(chan->ms_mtx);
+	ring = chan->ch_ring;
+	fuse_lck_mtx_unlock(chan->ms_mtx);
+	if (ring == NULL)
+		return (ENXIO);
+
+	for (;;) {
+		fuse_lck_mtx_lock(chan->ms_mtx);
+		err = fring_cq_pop(ring, &slot, &len, &tick);
+		fuse_lck_mtx_unlock(chan->ms_mtx);
+		if (err == ENOENT)
+			break;
+		if (err) {
+			DEBUG("bogus completion on ring %p\n", ring);
+			fdata_set_dead(data);
+			return (err);
+		}
+
+		if (len > 0) {
+			p = fring_slot(ring, slot);
+			if (len < sizeof(ohead)) {
+				DEBUG("got less than a header!\n");
+				err = EINVAL;
+			} else {
+				memcpy(&ohead, p, sizeof(ohead));
+				iov.iov_base = p + sizeof(ohead);
+				iov.iov_len = len - sizeof(ohead);
+				uio.uio_iov = &iov;
+				uio.uio_iovcnt = 1;
+				uio.uio_offset = 0;
+				uio.uio_resid = iov.iov_len;
+				uio.uio_segflg = UIO_SYSSPACE;
+				uio.uio_rw = UIO_WRITE;
+				uio.uio_td = curthread;
+				err = fuse_ohead_audit(&ohead, &uio);
+			}
+			if (err) {
+				fdata_set_dead(data);
+			} else if (fuse_device_dispatch(data, &ohead, &uio)) {
+				/* as with write(2), not fatal */
+				DEBUG("reply in slot %u not taken\n", slot);
+			}
+		}
+
+		fuse_lck_mtx_lock(chan->ms_mtx);
+		fring_slot_free(ring, slot);
+		fuse_lck_mtx_unlock(chan->ms_mtx);
+		FUSE_ASSERT_MS_DONE(tick);
+		fuse_ticket_drop(tick);
+		if (err)
+			return (err);
+		fn->fn_reaped++;
+	}
+
+	if (!(fn->fn_flags & FUSE_RING_ENTER_GETEVENTS))
+		return (0);
+
+	fuse_lck_mtx_lock(chan->ms_mtx);
+	while (!fdata_get_dead(data) && !fring_sq_pending(ring) &&
+	    fuse_ms_count(chan) == 0) {
+		chan->ch_sleepers++;
+		err = msleep(chan, &chan->ms_mtx, PCATCH, "fu_ring", 0);
+		chan->ch_sleepers--;
+		if (err)
+			break;
+	}
+	fuse_lck_mtx_unlock(chan->ms_mtx);
+
+	if (fdata_get_dead(data))
+		err = ENODEV;
+
+	return (err);
+}
+
+static int
+fuse_device_mmap_single(struct cdev *dev, vm_ooffset_t *offset,
+    vm_size_t size, struct vm_object **object, int nprot)
+{
+	struct fuse_chan *chan;
+	struct fuse_ring *ring;
+	int err = 0;
+
+	chan = fuse_get_devchan(dev);
+
+	fuse_lck_mtx_lock(chan->ms_mtx);
+	ring = chan->ch_ring;
+	if (ring == NULL)
+		err = ENXIO;
+	else if (*offset + size > ring->fr_mapsize || *offset + size < size)
+		err = EINVAL;
+	else {
+		vm_object_reference(ring->fr_obj);
+		*object = ring->fr_obj;
+	}
+	fuse_lck_mtx_unlock(chan->ms_mtx);
+
+	return (err);
+}
+
+/*
+ * Make dev an extra channel of the session of the fuse device open on fd.
+ * dev gives up the (yet unused) session it got upon open.
+ */
+static int
+fuse_device_attach(struct cdev *dev, int fd, struct thread *td)
+{
+	struct file *fp;
+	struct vnode *vp;
+	struct cdev *sdev = NULL;
+	struct fuse_data *data, *sdata;
+	struct fuse_chan *chan;
+#if __FreeBSD_version >= 1000000
+	cap_rights_t rights;
+#endif
+	int err;
+
+#if __FreeBSD_version >= 1000000
+	err = fget(td, fd, cap_rights_init(&rights, CAP_READ), &fp);
+#elif __FreeBSD_version >= 900000
+	err = fget(td, fd, CAP_READ, &fp);
+#else
+	err = fget(td, fd, &fp);
+#endif
+	if (err)
+		return (err);
+
+	if (fp->f_type == DTYPE_VNODE && (vp = fp->f_vnode) != NULL) {
+		VI_LOCK(vp);
+		if (vp->v_type == VCHR && vp->v_rdev != NULL &&
+		    vp->v_rdev->si_devsw == &fuse_device_cdevsw)
+			sdev = vp->v_rdev;
+		VI_UNLOCK(vp);
+	}
+	if (sdev == NULL || sdev == dev) {
+		err = EINVAL;
+		goto out;
+	}
+
+	chan = fchan_alloc(NULL, dev);
+
+	FUSE_LOCK();
+	data = fuse_get_devdata(dev);
+	sdata = fuse_get_devdata(sdev);
+	if (sdata == NULL) {
+		err = ENXIO;
+	} else if (data->fdev != dev || data->mp ||
+	    (data->dataflags & FSESS_INIT_SENT) ||
+	    data->nchans > 1 || data->chans[0]->ch_ring) {
+		/* dev is a channel already or has been put to use */
+		err = EBUSY;
+	} else {
+		err = fdata_attach_chan(sdata, chan);
+	}
+	if (err) {
+		FUSE_UNLOCK();
+		fchan_destroy(chan);
+		goto out;
+	}
+
+	data->dataflags &= ~FSESS_OPENED;
+	dev->si_drv1 = sdata;
+	dev->si_drv2 = chan;
+	fdata_trydestroy(data);
+	FUSE_UNLOCK();
+
+	DEBUG("%s: attached to session of %s as channel %p\n", dev->si_name,
+	    sdev->si_name, chan);
+
+out:
+	fdrop(fp, td);
+	return (err);
+}
+
 /*
  * Modeled after tunclone() of net/if_tun.c ...
  * boosted with a hack so that devices can be reused.
@@ -99,6 +99,14 @@ out:
     return err;
 }
 
+static void
+fuse_filehandle_release_done(struct fuse_ticket *tick, void *arg, int err)
+{
+    if (err)
+        debug_printf("RELEASE (unique %ju) failed, err = %d\n",
+                     (uintmax_t)tick->tk_unique, err);
+}
+
 int
 fuse_filehandle_close(struct vnode *vp,
                       fufh_type_t fufh_type,
@@ -139,7 +147,13 @@ fuse_filehandle_close(struct vnode *vp,
     fri->fh = fufh->fh_id;
     fri->flags = fuse_filehandle_xlate_to_oflags(fufh_type);
 
-    err = fdisp_wait_answ(&fdi);
+    /*
+     * Nothing is to be done upon the answer, so don't wait for it: the
+     * handle is gone for us either way. Nor is it throttled as a
+     * background request, close(2) and reclaim are not to wait for
+     * write-out to make room.
+     */
+    fuse_ticket_submit_async(fdi.tick, fuse_filehandle_release_done, NULL);
     fdisp_destroy(&fdi);
 
 out:
@@ -31,11 +31,13 @@
 #include <sys/bio.h>
 #include <sys/buf.h>
 #include <sys/sysctl.h>
+#include <sys/taskqueue.h>
 #include <sys/priv.h>
 
 #include "fuse.h"
 #include "fuse_file.h"
 #include "fuse_internal.h"
+#include "fuse_io.h"
 #include "fuse_ipc.h"
 #include "fuse_node.h"
 #include "fuse_file.h"
@@ -157,16 +159,14 @@ fuse_internal_access(struct vnode *vp,
 
 /* fsync */
 
-int
-fuse_internal_fsync_callback(struct fuse_ticket *tick, struct uio *uio)
+void
+fuse_internal_fsync_done(struct fuse_ticket *tick, void *arg, int err)
 {
     fuse_trace_printf_func();
 
-    if (tick->tk_aw_ohead.error == ENOSYS) {
+    if (err == ENOSYS) {
         fsess_set_notimpl(tick->tk_data->mp, fticket_opcode(tick));
     }
-
-    return 0;
 }
 
 int
@@ -192,8 +192,7 @@ fuse_internal_fsync(struct vnode           *vp,
 
     ffsi->fsync_flags = 1; /* datasync */
   
-    fuse_insert_callback(fdi.tick, fuse_internal_fsync_callback);
-    fuse_insert_message(fdi.tick);
+    fuse_ticket_submit_background(fdi.tick, fuse_internal_fsync_done, NULL);
 
     fdisp_destroy(&fdi);
 
@@ -303,6 +302,7 @@ fuse_internal_readdir_processdata(struct uio *uio,
 
         fiov_refresh(cookediov);
         fiov_adjust(cookediov, bytesavail);
+        bzero(cookediov->base, bytesavail);
 
         de = (struct dirent *)cookediov->base;
         de->d_fileno = fudge->ino; /* XXX: truncation */
@@ -522,6 +522,21 @@ fuse_internal_newentry(struct vnode *dvp,
 
 /* entity destruction */
 
+static void fuse_internal_forget_flush_locked(struct fuse_data *data,
+                                              struct thread *td,
+                                              struct ucred *cred);
+static void fuse_internal_forget_timeout(void *arg);
+
+static int fuse_batch_forget = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, batch_forget, CTLFLAG_RW,
+           &fuse_batch_forget, 0,
+           "batch FORGETs for daemons of 7.16 and up (not negotiated)");
+
+static int fuse_forget_delay = 10;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, forget_delay, CTLFLAG_RW,
+           &fuse_forget_delay, 0,
+           "max time FORGETs are held back for batching, in msecs");
+
 int
 fuse_internal_forget_callback(struct fuse_ticket *ftick, struct uio *uio)
 {
@@ -539,8 +554,10 @@ fuse_internal_forget_send(struct mount *mp,
                           uint64_t nlookup)
 {
 
+    struct fuse_data *data = fuse_get_mpdata(mp);
     struct fuse_dispatcher fdi;
     struct fuse_forget_in *ffi;
+    struct fuse_forget_one *ffo;
 
     debug_printf("mp=%p, nodeid=%jd, nlookup=%jd\n",
                  mp, (uintmax_t)nodeid, (uintmax_t)nlookup);
@@ -550,6 +567,21 @@ fuse_internal_forget_send(struct mount *mp,
      *         (long long unsigned) nodeid));
      */
 
+    if (fuse_batch_forget && (data->dataflags & FSESS_BATCH_FORGET)) {
+        sx_xlock(&data->forget_lock);
+        ffo = &data->forget_buf[data->forget_count++];
+        ffo->nodeid = nodeid;
+        ffo->nlookup = nlookup;
+        if (data->forget_count == FUSE_FORGET_BATCH)
+            fuse_internal_forget_flush_locked(data, td, cred);
+        else if (data->forget_count == 1)
+            callout_reset(&data->forget_callout,
+                          MAX(fuse_forget_delay * hz / 1000, 1),
+                          fuse_internal_forget_timeout, data);
+        sx_xunlock(&data->forget_lock);
+        return;
+    }
+
     fdisp_init(&fdi, sizeof(*ffi));
     fdisp_make(&fdi, FUSE_FORGET, mp, nodeid, td, cred);
 
@@ -560,6 +592,76 @@ fuse_internal_forget_send(struct mount *mp,
     fdisp_destroy(&fdi);
 }
 
+/*
+ * Send the FORGETs held back in a BATCH_FORGET. They are sent when the
+ * batch is full, when the daemon comes for messages (see the device read
+ * routine), or when forget_delay has passed since the first one.
+ */
+static void
+fuse_internal_forget_flush_locked(struct fuse_data *data,
+                                  struct thread *td,
+                                  struct ucred *cred)
+{
+    struct fuse_dispatcher fdi;
+    struct fuse_batch_forget_in *fbfi;
+    size_t len;
+
+    sx_assert(&data->forget_lock, SA_XLOCKED);
+
+    callout_stop(&data->forget_callout);
+    if (data->forget_count == 0)
+        return;
+
+    if (data->mp != NULL && !fdata_get_dead(data)) {
+        len = data->forget_count * sizeof(struct fuse_forget_one);
+        fdisp_init(&fdi, sizeof(*fbfi) + len);
+        fdisp_make(&fdi, FUSE_BATCH_FORGET, data->mp, 0, td, cred);
+
+        fbfi = fdi.indata;
+        fbfi->count = data->forget_count;
+        memcpy(fbfi + 1, data->forget_buf, len);
+
+        fuse_insert_message(fdi.tick);
+        fdisp_destroy(&fdi);
+    }
+    data->forget_count = 0;
+}
+
+void
+fuse_internal_forget_flush(struct fuse_data *data)
+{
+    sx_xlock(&data->forget_lock);
+    fuse_internal_forget_flush_locked(data, curthread, NULL);
+    sx_xunlock(&data->forget_lock);
+}
+
+/*
+ * Send what has been held back and make sure the flushing machinery
+ * is idle, before the session goes away.
+ */
+void
+fuse_internal_forget_drain(struct fuse_data *data)
+{
+    fuse_internal_forget_flush(data);
+    callout_drain(&data->forget_callout);
+    taskqueue_drain(taskqueue_thread, &data->forget_task);
+}
+
+void
+fuse_internal_forget_task(void *arg, int pending)
+{
+    fuse_internal_forget_flush(arg);
+}
+
+/* we can't sleep here, so flush from the thread taskqueue */
+static void
+fuse_internal_forget_timeout(void *arg)
+{
+    struct fuse_data *data = arg;
+
+    taskqueue_enqueue(taskqueue_thread, &data->forget_task);
+}
+
 void
 fuse_internal_vnode_disappear(struct vnode *vp)
 {
@@ -570,6 +672,78 @@ fuse_internal_vnode_disappear(struct vnode *vp)
     cache_purge(vp);
 }
 
+/* notifications */
+
+/*
+ * The daemon tells us that the attributes of node ino, and the data in
+ * [off, off + len) unless off is negative, may have changed behind our
+ * back. We can only throw away all the buffers of a file, so the range
+ * is not looked at. Nodes we have no vnode for have nothing cached.
+ *
+ * As the vnode gets locked, the daemon mustn't send this while it is
+ * serving a request which holds that lock, lest it deadlock.
+ */
+int
+fuse_internal_inval_inode(struct mount *mp, uint64_t ino, off_t off, off_t len)
+{
+    struct vnode *vp;
+    int err;
+
+    if ((err = fuse_vnode_find(mp, ino, LK_EXCLUSIVE, &vp)))
+        return err;
+    if (vp == NULL)
+        return ENOENT;
+
+    fuse_invalidate_attr(vp);
+    if (off >= 0 && vp->v_type == VREG)
+        err = fuse_io_invalbuf(vp, curthread);
+    vput(vp);
+
+    return err;
+}
+
+/*
+ * The daemon tells us that the entry name in directory parent may have
+ * changed. A name cache lookup without MAKEENTRY drops the entry, be it
+ * positive or negative, if there is one.
+ */
+int
+fuse_internal_inval_entry(struct mount *mp, uint64_t parent, char *name,
+                          int namelen)
+{
+    struct componentname cn;
+    struct vnode *dvp, *vp;
+    int err;
+
+    if ((namelen == 1 && name[0] == '.') ||
+        (namelen == 2 && name[0] == '.' && name[1] == '.'))
+        return EINVAL;
+
+    if ((err = fuse_vnode_find(mp, parent, LK_SHARED, &dvp)))
+        return err;
+    if (dvp == NULL)
+        return ENOENT;
+
+    bzero(&cn, sizeof(cn));
+    cn.cn_nameiop = LOOKUP;
+    cn.cn_flags = ISLASTCN;
+    cn.cn_lkflags = LK_SHARED;
+    cn.cn_thread = curthread;
+    cn.cn_cred = curthread->td_ucred;
+    cn.cn_nameptr = name;
+    cn.cn_namelen = namelen;
+
+    vp = NULL;
+    (void)cache_lookup(dvp, &vp, &cn);
+    KASSERT(vp == NULL, ("entry kept in name cache without MAKEENTRY"));
+
+    /* the mtime of the directory has likely changed, too */
+    fuse_invalidate_attr(dvp);
+    vput(dvp);
+
+    return 0;
+}
+
 /* fuse start/stop */
 
 int
@@ -599,17 +773,68 @@ fuse_internal_init_callback(struct fuse_ticket *tick, struct uio *uio)
     data->fuse_libabi_major = fiio->major;
     data->fuse_libabi_minor = fiio->minor;
 
-    if (fuse_libabi_geq(data, 7, 5)) {
+    /*
+     * libfuse answers with its own minor whatever we offered, but fills
+     * in the fields of the protocol agreed on only, and these are unused
+     * below 7.13. As we offer 7.8 (FUSE_KERNEL_MINOR_VERSION), the
+     * max_background and congestion_threshold mount options are the way
+     * to tune background writes for now.
+     */
+    if (fuse_proto_geq(data, 7, 13)) {
+        /* unless overridden on mount, the daemon's say counts */
+        fuse_lck_mtx_lock(data->bg_mtx);
+        if (fiio->max_background > 0 &&
+            !(data->dataflags & FSESS_MAX_BACKGROUND_SET))
+            data->max_background = fiio->max_background;
+        if (fiio->congestion_threshold > 0 &&
+            !(data->dataflags & FSESS_CONGESTION_SET))
+            data->congestion_threshold = fiio->congestion_threshold;
+        if (data->congestion_threshold > data->max_background)
+            data->congestion_threshold = data->max_background;
+        wakeup(&data->num_background);
+        fuse_lck_mtx_unlock(data->bg_mtx);
+    }
+
+    /*
+     * BATCH_FORGET is not negotiated, as it's beyond the 7.8 we offer: it
+     * is sent to daemons which speak 7.16 or later themselves, relying on
+     * them to take any opcode they know whatever version was agreed on
+     * (libfuse dispatches by opcode alone). Turn off vfs.fuse.batch_forget
+     * for daemons which don't.
+     */
+    if (fuse_libabi_geq(data, 7, 16)) {
+        data->dataflags |= FSESS_BATCH_FORGET;
+    }
+
+    if (fuse_proto_geq(data, 7, 5)) {
         if (fticket_resp(tick)->len == sizeof(struct fuse_init_out)) {
             data->max_write = fiio->max_write;
+            if (fiio->max_readahead < data->max_readahead)
+                data->max_readahead = fiio->max_readahead;
+            /*
+             * Write-back caching, as asked for on mount, is only done
+             * if the daemon acks it, whatever minor it speaks: it must be
+             * ready for getting file data late and for us owning mtime.
+             */
+            if (!(fiio->flags & FUSE_WRITEBACK_CACHE))
+                data->dataflags &= ~FSESS_WRITEBACK_CACHE;
         } else {
             err = EINVAL;
         }
     } else {
         /* Old fix values */
         data->max_write = 4096;
+        data->dataflags &= ~FSESS_WRITEBACK_CACHE;
     }
 
+    /*
+     * Clusters of buffers are read and written by a single request, so
+     * let them be as large as a WRITE can be.
+     */
+    if (data->mp != NULL)
+        data->mp->mnt_iosize_max = MAX(PAGE_SIZE,
+            MIN(rounddown(data->max_write, PAGE_SIZE), MAXPHYS));
+
 out:
     if (err) {
         fdata_set_dead(data);
@@ -634,8 +859,13 @@ fuse_internal_send_init(struct fuse_data *data, struct thread *td)
     fiii = fdi.indata;
     fiii->major = FUSE_KERNEL_VERSION;
     fiii->minor = FUSE_KERNEL_MINOR_VERSION;
-    fiii->max_readahead = FUSE_DEFAULT_IOSIZE * 16;
+    /* the daemon may only cut this down, so it's our bound from now on */
+    data->max_readahead = (data->dataflags & FSESS_NO_READAHEAD) ?
+        0 : FUSE_DEFAULT_MAX_READAHEAD;
+    fiii->max_readahead = data->max_readahead;
     fiii->flags = 0;
+    if (data->dataflags & FSESS_WRITEBACK_CACHE)
+        fiii->flags |= FUSE_WRITEBACK_CACHE;
 
     fuse_insert_callback(fdi.tick, fuse_internal_init_callback);
     fuse_insert_message(fdi.tick);
@@ -88,6 +88,28 @@ uio_setresid(struct uio *uio, ssize_t resid)
     uio->uio_resid = resid;
 }
 
+/* advance uio by n bytes without copying anything */
+static __inline void
+uio_skip(struct uio *uio, size_t n)
+{
+    struct iovec *iov;
+    size_t cnt;
+
+    while (n > 0 && uio->uio_iovcnt > 0) {
+        iov = uio->uio_iov;
+        cnt = min(iov->iov_len, n);
+        iov->iov_base = (char *)iov->iov_base + cnt;
+        iov->iov_len -= cnt;
+        uio->uio_resid -= cnt;
+        uio->uio_offset += cnt;
+        n -= cnt;
+        if (iov->iov_len == 0) {
+            uio->uio_iov++;
+            uio->uio_iovcnt--;
+        }
+    }
+}
+
 /* time */
 
 #define fuse_timespec_add(vvp, uvp)            \
@@ -224,8 +246,8 @@ fuse_internal_fsync(struct vnode           *vp,
                     struct ucred           *cred,
                     struct fuse_filehandle *fufh);
 
-int
-fuse_internal_fsync_callback(struct fuse_ticket *tick, struct uio *uio);
+void
+fuse_internal_fsync_done(struct fuse_ticket *tick, void *arg, int err);
 
 /* readdir */
 
@@ -266,6 +288,20 @@ fuse_internal_rename(struct vnode *fdvp,
 void
 fuse_internal_vnode_disappear(struct vnode *vp);
 
+/* notifications */
+
+int
+fuse_internal_inval_inode(struct mount *mp,
+                          uint64_t ino,
+                          off_t off,
+                          off_t len);
+
+int
+fuse_internal_inval_entry(struct mount *mp,
+                          uint64_t parent,
+                          char *name,
+                          int namelen);
+
 /* strategy */
 
 /* entity creation */
@@ -335,6 +371,15 @@ fuse_internal_forget_send(struct mount *mp,
                           uint64_t nodeid,
                           uint64_t nlookup);
 
+void
+fuse_internal_forget_flush(struct fuse_data *data);
+
+void
+fuse_internal_forget_drain(struct fuse_data *data);
+
+void
+fuse_internal_forget_task(void *arg, int pending);
+
 /* fuse start/stop */
 
 int fuse_internal_init_callback(struct fuse_ticket *tick, struct uio *uio);
@@ -45,10 +45,95 @@
 #include "fuse_internal.h"
 #include "fuse_ipc.h"
 #include "fuse_io.h"
+#include "fuse_sdt.h"
 
 #define FUSE_DEBUG_MODULE IO
 #include "fuse_debug.h"
 
+MALLOC_DEFINE(M_FUSEIO, "fuse_io", "fuse pipelined direct I/O");
+
+extern int fuse_pbuf_freecnt;
+
+static int fuse_zerocopy_read = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, zerocopy_read, CTLFLAG_RW,
+    &fuse_zerocopy_read, 0,
+    "let the daemon write READ answers right into the target buffer");
+
+static int fuse_zerocopy_write = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, zerocopy_write, CTLFLAG_RW,
+    &fuse_zerocopy_write, 0,
+    "let the daemon read WRITE payloads right from the source buffer");
+
+static int fuse_async_write = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, async_write, CTLFLAG_RW,
+    &fuse_async_write, 0,
+    "don't wait for the daemon upon writing out asynchronous buffers");
+
+#define FUSE_IO_MAXDEPTH 16
+
+static int fuse_direct_depth = 4;
+
+static int
+fuse_direct_depth_sysctl(SYSCTL_HANDLER_ARGS)
+{
+    int depth, err;
+
+    depth = fuse_direct_depth;
+    err = sysctl_handle_int(oidp, &depth, 0, req);
+    if (err || req->newptr == NULL)
+        return (err);
+    if (depth < 1 || depth > FUSE_IO_MAXDEPTH)
+        return (EINVAL);
+    fuse_direct_depth = depth;
+
+    return (0);
+}
+
+SYSCTL_PROC(_vfs_fuse, OID_AUTO, direct_io_depth,
+    CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_MPSAFE, NULL, 0,
+    fuse_direct_depth_sysctl, "I",
+    "READs or WRITEs a direct I/O call keeps outstanding (1 to 16)");
+
+static int fuse_async_read = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, async_read, CTLFLAG_RW,
+    &fuse_async_read, 0,
+    "don't wait for the daemon upon reading in asynchronous buffers");
+
+static int fuse_read_cluster = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, read_cluster, CTLFLAG_RW,
+    &fuse_read_cluster, 0,
+    "read ahead of sequential buffered reads by clustering");
+
+static int fuse_write_cluster = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, write_cluster, CTLFLAG_RW,
+    &fuse_write_cluster, 0,
+    "gather adjacent delayed writes into single WRITEs");
+
+#if __FreeBSD_version >= 1000030
+#define fuse_cluster_read(vp, fsize, lbn, size, cred, tot, seq, bpp) \
+    cluster_read((vp), (fsize), (lbn), (size), (cred), (tot), (seq), 0, (bpp))
+#define fuse_cluster_write(vp, bp, fsize, seq) \
+    cluster_write((vp), (bp), (fsize), (seq), 0)
+#else
+#define fuse_cluster_read(vp, fsize, lbn, size, cred, tot, seq, bpp) \
+    cluster_read((vp), (fsize), (lbn), (size), (cred), (tot), (seq), (bpp))
+#define fuse_cluster_write(vp, bp, fsize, seq) \
+    cluster_write((vp), (bp), (fsize), (seq))
+#endif
+
+/* pages of a user buffer wired for peer-to-peer I/O */
+struct fuse_io_hold {
+    struct buf *pbp;
+    int         npages;
+    vm_page_t   ma[btoc(MAXPHYS) + 1];
+};
+
+/* an outstanding request of a pipelined direct I/O call */
+struct fuse_io_chunk {
+    struct fuse_dispatcher fdi;
+    struct fuse_io_hold    fih;
+    size_t                 size;
+};
 
 static int fuse_read_directbackend(struct vnode *vp, struct uio *uio,
     struct ucred *cred, struct fuse_filehandle *fufh);
@@ -57,7 +142,17 @@ static int fuse_read_biobackend(struct vnode *vp, struct uio *uio,
 static int fuse_write_directbackend(struct vnode *vp, struct uio *uio,
     struct ucred *cred, struct fuse_filehandle *fufh);
 static int fuse_write_biobackend(struct vnode *vp, struct uio *uio,
+    struct ucred *cred, struct fuse_filehandle *fufh, int ioflag);
+static int fuse_io_strategy_read_async(struct vnode *vp, struct buf *bp,
+    struct ucred *cred, struct fuse_filehandle *fufh);
+static void fuse_io_wberror_set(struct vnode *vp, int err);
+static int fuse_io_strategy_write_async(struct vnode *vp, struct buf *bp,
     struct ucred *cred, struct fuse_filehandle *fufh);
+static int fuse_io_pipeline(struct vnode *vp, struct uio *uio,
+    struct ucred *cred, struct fuse_filehandle *fufh, int depth, int *donep);
+static char *fuse_io_hold(struct uio *uio, size_t *sizep, vm_prot_t prot,
+    int nowait, struct fuse_io_hold *fih);
+static void fuse_io_unhold(struct fuse_io_hold *fih);
 
 int
 fuse_io_dispatch(struct vnode *vp, struct uio *uio, int ioflag,
@@ -106,7 +201,7 @@ fuse_io_dispatch(struct vnode *vp, struct uio *uio, int ioflag,
 	    fuse_invalidate_attr(vp);
         } else {
             DEBUG("buffered write of vnode %ju\n", (uintmax_t)VTOILLU(vp));
-            err = fuse_write_biobackend(vp, uio, cred, fufh);
+            err = fuse_write_biobackend(vp, uio, cred, fufh, ioflag);
         }
         break;
     default:
@@ -116,6 +211,55 @@ fuse_io_dispatch(struct vnode *vp, struct uio *uio, int ioflag,
     return (err);
 }
 
+/*
+ * getblk() which also sets the device block number, as fuse_vnop_bmap()
+ * would, so that the clustering code can tell adjacent buffers.
+ */
+static struct buf *
+fuse_io_getblk(struct vnode *vp, daddr_t lbn, int size)
+{
+    struct buf *bp;
+
+    bp = getblk(vp, lbn, size, PCATCH, 0, 0);
+    if (bp != NULL)
+        bp->b_blkno = lbn * btodb(fuse_iosize(vp));
+
+    return (bp);
+}
+
+/*
+ * The sequential access heuristic of vfs_vnops.c, only it's kept by
+ * vnode, in blocks: reads which go on where the previous one stopped
+ * count up, a seek starts it over. The result is how many blocks to read
+ * ahead, bounded by what the daemon is willing to; 0 if none at all.
+ *
+ * We may hold the vnode lock shared only, but these are mere hints.
+ */
+static int
+fuse_io_seqcount(struct vnode *vp, struct uio *uio, int biosize)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    int maxra;
+
+    maxra = data->max_readahead / biosize;
+    if (!fuse_read_cluster || (data->dataflags & FSESS_NO_READAHEAD) ||
+        maxra == 0)
+        return (0);
+
+    if ((uio->uio_offset == 0 && fvdat->read_seqcount > 0) ||
+        uio->uio_offset == fvdat->read_nextoff) {
+        fvdat->read_seqcount += howmany(uio->uio_resid, biosize);
+        if (fvdat->read_seqcount > IO_SEQMAX)
+            fvdat->read_seqcount = IO_SEQMAX;
+    } else if (fvdat->read_seqcount > 1)
+        fvdat->read_seqcount = 1;
+    else
+        fvdat->read_seqcount = 0;
+
+    return (MIN(fvdat->read_seqcount, maxra));
+}
+
 static int
 fuse_read_biobackend(struct vnode *vp, struct uio *uio,
     struct ucred *cred, struct fuse_filehandle *fufh)
@@ -124,6 +268,7 @@ fuse_read_biobackend(struct vnode *vp, struct uio *uio,
     daddr_t lbn;
     int bcount;
     int err = 0, n = 0, on = 0;
+    int seqcount;
     off_t filesize;
 
     const int biosize = fuse_iosize(vp);
@@ -138,6 +283,7 @@ fuse_read_biobackend(struct vnode *vp, struct uio *uio,
 
     bcount = MIN(MAXBSIZE, biosize);
     filesize = VTOFUD(vp)->filesize;
+    seqcount = fuse_io_seqcount(vp, uio, biosize);
 
     do {
         if (fuse_isdeadfs(vp)) {
@@ -167,23 +313,37 @@ fuse_read_biobackend(struct vnode *vp, struct uio *uio,
             bcount = filesize - (off_t)lbn * biosize;
         }
 
-        bp = getblk(vp, lbn, bcount, PCATCH, 0, 0);
+        if (seqcount > 0 && bcount == biosize) {
+            /*
+             * Let the clustering code fetch the block, together with
+             * the ones to follow, by as few READs as it can (see
+             * fuse_vnop_bmap() for how far it may go).
+             */
+            err = fuse_cluster_read(vp, filesize, lbn, bcount, cred,
+                on + uio->uio_resid, seqcount, &bp);
+            if (err) {
+                brelse(bp);
+                break;
+            }
+        } else {
+            bp = fuse_io_getblk(vp, lbn, bcount);
 
-        if (!bp)
-            return (EINTR);
+            if (!bp)
+                return (EINTR);
 
-        /*
-         * If B_CACHE is not set, we must issue the read.  If this
-         * fails, we return an error.
-         */
+            /*
+             * If B_CACHE is not set, we must issue the read.  If this
+             * fails, we return an error.
+             */
 
-        if ((bp->b_flags & B_CACHE) == 0) {
-            bp->b_iocmd = BIO_READ;
-            vfs_busy_pages(bp, 0);
-            err = fuse_io_strategy(vp, bp);
-            if (err) {
-                brelse(bp);
-                return (err);
+            if ((bp->b_flags & B_CACHE) == 0) {
+                bp->b_iocmd = BIO_READ;
+                vfs_busy_pages(bp, 0);
+                err = fuse_io_strategy(vp, bp);
+                if (err) {
+                    brelse(bp);
+                    return (err);
+                }
             }
         }
 
@@ -208,6 +368,8 @@ fuse_read_biobackend(struct vnode *vp, struct uio *uio,
             err, uio->uio_resid, n);
     } while (err == 0 && uio->uio_resid > 0 && n > 0);
 
+    VTOFUD(vp)->read_nextoff = uio->uio_offset;
+
     return (err);
 }
 
@@ -217,40 +379,72 @@ fuse_read_directbackend(struct vnode *vp, struct uio *uio,
 {
     struct fuse_dispatcher fdi;
     struct fuse_read_in *fri;
-    int err = 0;
+    struct fuse_io_hold fih;
+    struct iovec *iov;
+    char *direct;
+    size_t size;
+    int err = 0, depth, done;
 
     if (uio->uio_resid == 0)
         return (0);
 
+    depth = imin(fuse_direct_depth, FUSE_IO_MAXDEPTH);
+    if (depth > 1 && fuse_zerocopy_read) {
+        err = fuse_io_pipeline(vp, uio, cred, fufh, depth, &done);
+        if (err || done || uio->uio_resid == 0)
+            return (err);
+    }
+
     fdisp_init(&fdi, 0);
 
     /*
-     * XXX In "normal" case we use an intermediate kernel buffer for
-     * transmitting data from daemon's context to ours. Eventually, we should
-     * get rid of this. Anyway, if the target uio lives in sysspace (we are
-     * called from pageops), and the input data doesn't need kernel-side
-     * processing (we are not called from readdir) we can already invoke
-     * an optimized, "peer-to-peer" I/O routine.
+     * Unless the zerocopy_read knob is turned off, the answer of the daemon
+     * is copied right into the target of the uio ("peer-to-peer" I/O, see
+     * fuse_io_hold()). Else we use an intermediate kernel buffer to
+     * transmit data from daemon's context to ours.
      */
     while (uio->uio_resid > 0) {
+        iov = uio->uio_iov;
+        if (iov->iov_len == 0) {
+            uio->uio_iov++;
+            uio->uio_iovcnt--;
+            continue;
+        }
+
         fdi.iosize = sizeof(*fri);
         fdisp_make_vp(&fdi, FUSE_READ, vp, uio->uio_td, cred);
+        size = MIN(iov->iov_len, fuse_get_mpdata(vp->v_mount)->max_read);
+
+        direct = NULL;
+        if (fuse_zerocopy_read)
+            direct = fuse_io_hold(uio, &size, VM_PROT_WRITE, 0, &fih);
+
         fri = fdi.indata;
         fri->fh = fufh->fh_id;
         fri->offset = uio->uio_offset;
-        fri->size = MIN(uio->uio_resid,
-            fuse_get_mpdata(vp->v_mount)->max_read);
+        fri->size = size;
+
+        if (direct) {
+            fdi.tick->tk_aw_type = FT_A_BUF;
+            fdi.tick->tk_aw_bufdata = direct;
+            fdi.tick->tk_aw_bufsize = size;
+        }
 
         DEBUG2G("fri->fh %ju, fri->offset %ju, fri->size %ju\n",
             (uintmax_t)fri->fh, (uintmax_t)fri->offset, (uintmax_t)fri->size);
-        if ((err = fdisp_wait_answ(&fdi)))
+        err = fdisp_wait_answ(&fdi);
+        if (direct)
+            fuse_io_unhold(&fih);
+        if (err)
             goto out;
 
         DEBUG2G("complete: got iosize=%d, requested fri.size=%zd; "
             "resid=%zd offset=%ju\n",
             fri->size, fdi.iosize, uio->uio_resid, (uintmax_t)uio->uio_offset);
 
-        if ((err = uiomove(fdi.answ, MIN(fri->size, fdi.iosize), uio)))
+        if (direct)
+            uio_skip(uio, MIN(fri->size, fdi.iosize));
+        else if ((err = uiomove(fdi.answ, MIN(fri->size, fdi.iosize), uio)))
             break;
         if (fdi.iosize < fri->size)
             break;
@@ -268,20 +462,44 @@ fuse_write_directbackend(struct vnode *vp, struct uio *uio,
     struct fuse_vnode_data *fvdat = VTOFUD(vp);
     struct fuse_write_in *fwi;
     struct fuse_dispatcher fdi;
+    struct fuse_io_hold fih;
+    char *direct;
     size_t chunksize;
     int diff;
-    int err = 0;
+    int err = 0, depth, done;
 
     if (!uio->uio_resid)
         return (0);
 
+    depth = imin(fuse_direct_depth, FUSE_IO_MAXDEPTH);
+    if (depth > 1 && fuse_zerocopy_write) {
+        err = fuse_io_pipeline(vp, uio, cred, fufh, depth, &done);
+        if (err || done || uio->uio_resid == 0)
+            return (err);
+    }
+
     fdisp_init(&fdi, 0);
 
+    /*
+     * Unless the zerocopy_write knob is turned off, the payload is passed
+     * to the daemon right from the source of the uio, and only the headers
+     * go to the message buffer of the ticket.
+     */
     while (uio->uio_resid > 0) {
         chunksize = MIN(uio->uio_resid,
             fuse_get_mpdata(vp->v_mount)->max_write);
 
-        fdi.iosize = sizeof(*fwi) + chunksize;
+        direct = NULL;
+        if (fuse_zerocopy_write) {
+            while (uio->uio_iov->iov_len == 0) {
+                uio->uio_iov++;
+                uio->uio_iovcnt--;
+            }
+            chunksize = MIN(chunksize, uio->uio_iov->iov_len);
+            direct = fuse_io_hold(uio, &chunksize, VM_PROT_READ, 0, &fih);
+        }
+
+        fdi.iosize = sizeof(*fwi) + (direct ? 0 : chunksize);
         fdisp_make_vp(&fdi, FUSE_WRITE, vp, uio->uio_td, cred);
 
         fwi = fdi.indata;
@@ -289,11 +507,22 @@ fuse_write_directbackend(struct vnode *vp, struct uio *uio,
         fwi->offset = uio->uio_offset;
         fwi->size = chunksize;
 
-        if ((err = uiomove((char *)fdi.indata + sizeof(*fwi),
+        if (direct) {
+            fdi.tick->tk_ms_type = FT_M_BUF;
+            fdi.tick->tk_ms_bufdata = direct;
+            fdi.tick->tk_ms_bufsize = chunksize;
+            fdi.finh->len += chunksize;
+        } else if ((err = uiomove((char *)fdi.indata + sizeof(*fwi),
             chunksize, uio)))
             break;
 
-        if ((err = fdisp_wait_answ(&fdi)))
+        err = fdisp_wait_answ(&fdi);
+        if (direct) {
+            fuse_io_unhold(&fih);
+            if (!err)
+                uio_skip(uio, chunksize);
+        }
+        if (err)
             break;
 
         diff = chunksize - ((struct fuse_write_out *)fdi.answ)->size;
@@ -313,15 +542,220 @@ fuse_write_directbackend(struct vnode *vp, struct uio *uio,
     return (err);
 }
 
+/*
+ * Pipelined direct I/O: up to depth (> 1) READs or WRITEs of chunks of
+ * the current iovec are outstanding at once, each answered right into, or
+ * taken right from the target of the uio (see fuse_io_hold()). Chunks are
+ * completed in order, and the uio is advanced by what each one did, just
+ * like in the serial loops. Once a chunk fails or comes up short, the ones
+ * beyond it are cancelled: a short READ ends the I/O (*donep is set), a
+ * short WRITE makes the serial loop go on from where it stopped. So does a
+ * chunk we can't access directly.
+ */
+static int
+fuse_io_pipeline(struct vnode *vp, struct uio *uio, struct ucred *cred,
+    struct fuse_filehandle *fufh, int depth, int *donep)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    struct fuse_io_chunk *chunks, *ck;
+    struct fuse_read_in *fri;
+    struct fuse_write_in *fwi;
+    struct iovec iov;
+    struct uio cuio;
+    size_t max, sent, size, done;
+    char *direct;
+    int head, tail, n, stop, cancel;
+    int reading = (uio->uio_rw == UIO_READ);
+    int err = 0;
+
+    *donep = 0;
+    KASSERT(depth > 1 && depth <= FUSE_IO_MAXDEPTH,
+        ("fuse_io_pipeline: bad depth %d", depth));
+    max = reading ? data->max_read : data->max_write;
+    chunks = malloc(depth * sizeof(*chunks), M_FUSEIO, M_WAITOK);
+
+    /* chunks[tail] is the oldest of n in flight, sent bytes ahead of uio */
+    head = tail = n = 0;
+    sent = 0;
+    stop = cancel = 0;
+
+    for (;;) {
+        while (!stop && n < depth && uio->uio_resid > sent) {
+            if (n == 0) {
+                while (uio->uio_iov->iov_len == 0) {
+                    uio->uio_iov++;
+                    uio->uio_iovcnt--;
+                }
+            }
+            if (sent == uio->uio_iov->iov_len)
+                break;
+
+            size = MIN(MIN(uio->uio_iov->iov_len, uio->uio_resid) - sent,
+                max);
+            iov.iov_base = (char *)uio->uio_iov->iov_base + sent;
+            iov.iov_len = size;
+            cuio = *uio;
+            cuio.uio_iov = &iov;
+            cuio.uio_iovcnt = 1;
+            cuio.uio_resid = size;
+            cuio.uio_offset = uio->uio_offset + sent;
+
+            /* don't sleep for a pbuf while holding some */
+            ck = &chunks[head];
+            direct = fuse_io_hold(&cuio, &size,
+                reading ? VM_PROT_WRITE : VM_PROT_READ, n > 0, &ck->fih);
+            if (direct == NULL) {
+                stop = 1;
+                break;
+            }
+
+            if (reading) {
+                fdisp_init(&ck->fdi, sizeof(*fri));
+                fdisp_make_vp(&ck->fdi, FUSE_READ, vp, uio->uio_td, cred);
+                fri = ck->fdi.indata;
+                fri->fh = fufh->fh_id;
+                fri->offset = cuio.uio_offset;
+                fri->size = size;
+                ck->fdi.tick->tk_aw_type = FT_A_BUF;
+                ck->fdi.tick->tk_aw_bufdata = direct;
+                ck->fdi.tick->tk_aw_bufsize = size;
+            } else {
+                fdisp_init(&ck->fdi, sizeof(*fwi));
+                fdisp_make_vp(&ck->fdi, FUSE_WRITE, vp, uio->uio_td, cred);
+                fwi = ck->fdi.indata;
+                fwi->fh = fufh->fh_id;
+                fwi->offset = cuio.uio_offset;
+                fwi->size = size;
+                ck->fdi.tick->tk_ms_type = FT_M_BUF;
+                ck->fdi.tick->tk_ms_bufdata = direct;
+                ck->fdi.tick->tk_ms_bufsize = size;
+                ck->fdi.finh->len += size;
+            }
+            ck->size = size;
+            fdisp_send(&ck->fdi);
+
+            sent += size;
+            head = (head + 1) % depth;
+            n++;
+        }
+
+        if (n == 0)
+            break;
+
+        ck = &chunks[tail];
+        tail = (tail + 1) % depth;
+        n--;
+
+        if (cancel) {
+            fdisp_cancel(&ck->fdi);
+            fuse_io_unhold(&ck->fih);
+            fdisp_destroy(&ck->fdi);
+            continue;
+        }
+
+        err = fdisp_wait_sent(&ck->fdi);
+        fuse_io_unhold(&ck->fih);
+        if (err == 0) {
+            if (reading) {
+                done = MIN(ck->size, ck->fdi.iosize);
+            } else {
+                done = ((struct fuse_write_out *)ck->fdi.answ)->size;
+                if (done > ck->size)
+                    err = EINVAL;
+            }
+        }
+        fdisp_destroy(&ck->fdi);
+        if (err) {
+            stop = cancel = 1;
+            continue;
+        }
+
+        uio_skip(uio, done);
+        sent -= done;
+        if (!reading && uio->uio_offset > fvdat->filesize)
+            fuse_vnode_setsize(vp, cred, uio->uio_offset);
+        if (done < ck->size) {
+            if (reading)
+                *donep = 1;
+            stop = cancel = 1;
+        }
+    }
+
+    free(chunks, M_FUSEIO);
+
+    return (err);
+}
+
+/*
+ * Get the buffer of the current iovec of uio ready for the daemon to
+ * access directly, up to *sizep bytes. Sysspace buffers (we are called from
+ * strategy or pageops) are used as is; user buffers get their pages held
+ * and mapped into kernel space, which may make us cut *sizep. Returns the
+ * kernel address of the buffer, or NULL if it can't be accessed directly
+ * (or, with nowait, if there's no pbuf to map it with right now).
+ */
+static char *
+fuse_io_hold(struct uio *uio, size_t *sizep, vm_prot_t prot, int nowait,
+    struct fuse_io_hold *fih)
+{
+    struct iovec *iov = uio->uio_iov;
+    vm_offset_t uva = (vm_offset_t)iov->iov_base;
+
+    fih->pbp = NULL;
+    fih->npages = 0;
+
+    switch (uio->uio_segflg) {
+    case UIO_SYSSPACE:
+        return (iov->iov_base);
+    case UIO_USERSPACE:
+        *sizep = MIN(*sizep, MAXPHYS - (uva & PAGE_MASK));
+        fih->npages = vm_fault_quick_hold_pages(
+            &uio->uio_td->td_proc->p_vmspace->vm_map, uva, *sizep, prot,
+            fih->ma, nitems(fih->ma));
+        if (fih->npages < 0) {
+            /* let uiomove() sort out the fault */
+            fih->npages = 0;
+            return (NULL);
+        }
+        if (nowait)
+            fih->pbp = trypbuf(&fuse_pbuf_freecnt);
+        else
+            fih->pbp = getpbuf(&fuse_pbuf_freecnt);
+        if (fih->pbp == NULL) {
+            vm_page_unhold_pages(fih->ma, fih->npages);
+            fih->npages = 0;
+            return (NULL);
+        }
+        pmap_qenter((vm_offset_t)fih->pbp->b_data, fih->ma, fih->npages);
+        return ((char *)fih->pbp->b_data + (uva & PAGE_MASK));
+    default:
+        return (NULL);
+    }
+}
+
+static void
+fuse_io_unhold(struct fuse_io_hold *fih)
+{
+    if (fih->pbp == NULL)
+        return;
+
+    pmap_qremove((vm_offset_t)fih->pbp->b_data, fih->npages);
+    relpbuf(fih->pbp, &fuse_pbuf_freecnt);
+    vm_page_unhold_pages(fih->ma, fih->npages);
+}
+
 static int
 fuse_write_biobackend(struct vnode *vp, struct uio *uio,
-    struct ucred *cred, struct fuse_filehandle *fufh)
+    struct ucred *cred, struct fuse_filehandle *fufh, int ioflag)
 {
     struct fuse_vnode_data *fvdat = VTOFUD(vp);
     struct buf *bp;
     daddr_t lbn;
     int bcount;
     int n, on, err = 0;
+    int writeback;
+    ssize_t resid;
 
     const int biosize = fuse_iosize(vp);
 
@@ -335,6 +769,10 @@ fuse_write_biobackend(struct vnode *vp, struct uio *uio,
     if (uio->uio_resid == 0)
         return (0);
 
+    writeback = fsess_opt_writeback(vnode_mount(vp)) &&
+        (ioflag & IO_SYNC) == 0;
+    resid = uio->uio_resid;
+
     /*
      * Find all of this file's B_NEEDCOMMIT buffers.  If our writes
      * would exceed the local maximum per-file write commit size when
@@ -349,6 +787,11 @@ fuse_write_biobackend(struct vnode *vp, struct uio *uio,
             break;
         }
 
+        /* let the daemon catch up with background writes */
+        err = fdata_bg_throttle(fuse_get_mpdata(vnode_mount(vp)));
+        if (err)
+            break;
+
         lbn = uio->uio_offset / biosize;
         on = uio->uio_offset & (biosize-1);
         n = MIN((unsigned)(biosize - on), uio->uio_resid);
@@ -370,7 +813,7 @@ again:
              */
             bcount = on;
             DEBUG("getting block from OS, bcount %d\n", bcount);
-            bp = getblk(vp, lbn, bcount, PCATCH, 0, 0);
+            bp = fuse_io_getblk(vp, lbn, bcount);
 
             if (bp != NULL) {
                 long save;
@@ -399,7 +842,7 @@ again:
                     bcount = fvdat->filesize - (off_t)lbn * biosize;
             }
             DEBUG("getting block from OS, bcount %d\n", bcount);
-            bp = getblk(vp, lbn, bcount, PCATCH, 0, 0);
+            bp = fuse_io_getblk(vp, lbn, bcount);
             if (bp && uio->uio_offset + n > fvdat->filesize) {
                 err = fuse_vnode_setsize(vp, cred, uio->uio_offset + n);
                 if (err) {
@@ -462,7 +905,7 @@ again:
 
         if (bp->b_dirtyend > bcount) {
             DEBUG("FUSE append race @%lx:%d\n",
-                (long)bp->b_blkno * biosize,
+                (long)bp->b_lblkno * biosize,
                 bp->b_dirtyend - bcount);
             bp->b_dirtyend = bcount;
         }
@@ -535,12 +978,43 @@ again:
             vfs_bio_set_valid(bp, on, n);
         }
 
-        err = bwrite(bp);
-        if (err)
-            break;
+        if (writeback) {
+            /*
+             * Leave the buffer to the syncer (or fsync), unless it's
+             * full, as then it's unlikely to be written again soon:
+             * that's started right away, but not waited for. Either
+             * way, the buffer is valid all over (see above), so it can
+             * go out in one piece with its neighbours; full ones are
+             * gathered as they come, up to mnt_iosize_max.
+             */
+            if (fuse_write_cluster)
+                bp->b_flags |= B_CLUSTEROK;
+            if (on + n == biosize) {
+                if (fuse_write_cluster)
+                    fuse_cluster_write(vp, bp, fvdat->filesize,
+                        ioflag >> IO_SEQSHIFT);
+                else
+                    bawrite(bp);
+            } else
+                bdwrite(bp);
+        } else {
+            err = bwrite(bp);
+            if (err)
+                break;
+        }
     } while (uio->uio_resid > 0 && n > 0);
 
-    if (fuse_sync_resize && (fvdat->flag & FN_SIZECHANGE) != 0)
+    if (writeback) {
+        /*
+         * The daemon will see the data late, so it can't keep mtime
+         * for us; neither the size, which goes out along with mtime
+         * (see fuse_vnode_savesize()).
+         */
+        if (uio->uio_resid != resid) {
+            vfs_timestamp(&fvdat->local_mtime);
+            fvdat->flag |= FN_MTIMECHANGE;
+        }
+    } else if (fuse_sync_resize && (fvdat->flag & FN_SIZECHANGE) != 0)
 	    fuse_vnode_savesize(vp, cred);
 
     return (err);
@@ -562,7 +1036,7 @@ fuse_io_strategy(struct vnode *vp, struct buf *bp)
     MPASS(vp->v_type == VREG);
     MPASS(bp->b_iocmd == BIO_READ || bp->b_iocmd == BIO_WRITE);
     DEBUG("inode=%jd offset=%jd resid=%jd\n",
-        VTOI(vp), ((off_t)bp->b_blkno) * biosize, bp->b_bcount);
+        VTOI(vp), ((off_t)bp->b_lblkno) * biosize, bp->b_bcount);
 
     error = fuse_filehandle_getrw(vp,
 	(bp->b_iocmd == BIO_READ) ? FUFH_RDONLY : FUFH_WRONLY, &fufh);
@@ -591,12 +1065,17 @@ fuse_io_strategy(struct vnode *vp, struct buf *bp)
 
     KASSERT(!(bp->b_flags & B_DONE),
         ("fuse_io_strategy: bp %p already marked done", bp));
+    SDT_PROBE5(fuse, , io, start, VTOI(vp), bp, bp->b_iocmd,
+        ((off_t)bp->b_lblkno) * biosize, bp->b_bcount);
     if (bp->b_iocmd == BIO_READ) {
+        if (fuse_io_strategy_read_async(vp, bp, cred, fufh) == 0)
+            return (0);
+
         io.iov_len = uiop->uio_resid = bp->b_bcount;
         io.iov_base = bp->b_data;
         uiop->uio_rw = UIO_READ;
 
-        uiop->uio_offset = ((off_t)bp->b_blkno) * biosize;
+        uiop->uio_offset = ((off_t)bp->b_lblkno) * biosize;
         error = fuse_read_directbackend(vp, uiop, cred, fufh);
 
         if ((!error && uiop->uio_resid) ||
@@ -638,24 +1117,39 @@ fuse_io_strategy(struct vnode *vp, struct buf *bp)
             DEBUG("write: B_NEEDCOMMIT flags set\n");
         }
 
+        /*
+         * A cluster of buffers, as built by cluster_wbuild(), is to be
+         * written all over, see fuse_write_biobackend()
+         */
+        if (bp->b_flags & B_CLUSTER) {
+            bp->b_dirtyoff = 0;
+            bp->b_dirtyend = bp->b_bcount;
+        }
+
         /*
          * Setup for actual write
          */
-        if ((off_t)bp->b_blkno * biosize + bp->b_dirtyend > fvdat->filesize)
-            bp->b_dirtyend = fvdat->filesize - (off_t)bp->b_blkno * biosize;
+        if ((off_t)bp->b_lblkno * biosize + bp->b_dirtyend > fvdat->filesize)
+            bp->b_dirtyend = fvdat->filesize - (off_t)bp->b_lblkno * biosize;
+
+        if (bp->b_dirtyend > bp->b_dirtyoff &&
+            fuse_io_strategy_write_async(vp, bp, cred, fufh) == 0)
+            return (0);
 
         if (bp->b_dirtyend > bp->b_dirtyoff) {
             io.iov_len = uiop->uio_resid = bp->b_dirtyend
               - bp->b_dirtyoff;
-            uiop->uio_offset = (off_t)bp->b_blkno * biosize
+            uiop->uio_offset = (off_t)bp->b_lblkno * biosize
               + bp->b_dirtyoff;
             io.iov_base = (char *)bp->b_data + bp->b_dirtyoff;
             uiop->uio_rw = UIO_WRITE;
 
             error = fuse_write_directbackend(vp, uiop, cred, fufh);
 
-            if (error == EINTR || error == ETIMEDOUT
-                || (!error && (bp->b_flags & B_NEEDCOMMIT))) {
+            /* the buffers of a cluster are redirtied on error by brelse */
+            if ((bp->b_flags & B_CLUSTER) == 0 &&
+                (error == EINTR || error == ETIMEDOUT
+                || (!error && (bp->b_flags & B_NEEDCOMMIT)))) {
 
                 bp->b_flags &= ~(B_INVAL|B_NOCACHE);
                 if ((bp->b_flags & B_PAGING) == 0) {
@@ -670,20 +1164,191 @@ fuse_io_strategy(struct vnode *vp, struct buf *bp)
                     bp->b_ioflags |= BIO_ERROR;
                     bp->b_flags |= B_INVAL;
                     bp->b_error = error;
+                    if ((bp->b_flags & B_ASYNC) &&
+                        error != EINTR && error != ETIMEDOUT)
+                        fuse_io_wberror_set(vp, error);
                 }
                 bp->b_dirtyoff = bp->b_dirtyend = 0;
             }
         } else {
             bp->b_resid = 0;
+            SDT_PROBE5(fuse, , io, done, VTOI(vp), bp, bp->b_iocmd, 0, 0);
             bufdone(bp);
             return (0);
         }
     }
     bp->b_resid = uiop->uio_resid;
+    SDT_PROBE5(fuse, , io, done, VTOI(vp), bp, bp->b_iocmd, error,
+        bp->b_resid);
     bufdone(bp);
     return (error);
 }
 
+static void
+fuse_io_read_done(struct fuse_ticket *tick, void *arg, int err)
+{
+    struct buf *bp = arg;
+    size_t nread;
+
+    DEBUG("bp=%p err=%d\n", bp, err);
+
+    if (err) {
+        bp->b_ioflags |= BIO_ERROR;
+        bp->b_error = err;
+        bp->b_resid = bp->b_bcount;
+    } else {
+        /* a short read means a hole or EOF, see fuse_io_strategy() */
+        nread = tick->tk_aw_bufsize;
+        if (nread < bp->b_bcount)
+            bzero((char *)bp->b_data + nread, bp->b_bcount - nread);
+        bp->b_resid = 0;
+    }
+    SDT_PROBE5(fuse, , io, done, VTOILLU(bp->b_vp), bp, bp->b_iocmd, err,
+        bp->b_resid);
+    bufdone(bp);
+}
+
+/*
+ * Read in an asynchronous buffer, typically a read-ahead cluster, by a
+ * single READ which isn't waited for: the answer is pulled right into the
+ * buffer, which is completed then. So the reader waits only for the
+ * buffer it needs, while the ones ahead are in the works. Returns
+ * non-zero if the buffer doesn't qualify, so that it's to be read in
+ * synchronously.
+ */
+static int
+fuse_io_strategy_read_async(struct vnode *vp, struct buf *bp,
+    struct ucred *cred, struct fuse_filehandle *fufh)
+{
+    struct fuse_read_in *fri;
+    struct fuse_dispatcher fdi;
+
+    if (!fuse_async_read || (bp->b_flags & B_ASYNC) == 0 ||
+        bp->b_bcount > fuse_get_mpdata(vnode_mount(vp))->max_read)
+        return (EOPNOTSUPP);
+
+    fdisp_init(&fdi, sizeof(*fri));
+    fdisp_make_vp(&fdi, FUSE_READ, vp, curthread, cred);
+
+    fri = fdi.indata;
+    fri->fh = fufh->fh_id;
+    fri->offset = (off_t)bp->b_lblkno * fuse_iosize(vp);
+    fri->size = bp->b_bcount;
+
+    /* the buffer is ours till bufdone(), so it's safe to receive into */
+    fdi.tick->tk_aw_type = FT_A_BUF;
+    fdi.tick->tk_aw_bufdata = bp->b_data;
+    fdi.tick->tk_aw_bufsize = bp->b_bcount;
+
+    fuse_ticket_submit_background(fdi.tick, fuse_io_read_done, bp);
+    fdisp_destroy(&fdi);
+
+    return (0);
+}
+
+/*
+ * Buffers which are written out asynchronously have nobody to tell if
+ * that fails, and their data is gone then. So the vnode keeps the first
+ * such error, for fsync(2) and close(2) to report, as NFS does.
+ */
+static void
+fuse_io_wberror_set(struct vnode *vp, int err)
+{
+    atomic_cmpset_int(&VTOFUD(vp)->wb_error, 0, err);
+}
+
+/*
+ * Take the write-out error kept by vp, if any.
+ */
+int
+fuse_io_wberror(struct vnode *vp)
+{
+    return (atomic_readandclear_int(&VTOFUD(vp)->wb_error));
+}
+
+static void
+fuse_io_write_done(struct fuse_ticket *tick, void *arg, int err)
+{
+    struct buf *bp = arg;
+    struct fuse_write_out *fwo;
+
+    if (!err) {
+        fwo = fticket_resp(tick)->base;
+        if (fwo->size != bp->b_dirtyend - bp->b_dirtyoff)
+            err = EIO;
+    }
+
+    DEBUG("bp=%p err=%d\n", bp, err);
+
+    if ((err == EINTR || err == ETIMEDOUT) &&
+        (bp->b_flags & B_CLUSTER) == 0) {
+        /* the daemon may yet come round, keep it dirty as strategy does */
+        bp->b_flags &= ~(B_INVAL|B_NOCACHE);
+        if ((bp->b_flags & B_PAGING) == 0) {
+            bdirty(bp);
+            bp->b_flags &= ~B_DONE;
+        }
+        bp->b_resid = bp->b_dirtyend - bp->b_dirtyoff;
+    } else {
+        if (err == EINTR || err == ETIMEDOUT) {
+            /* the buffers of a cluster are redirtied on error by brelse */
+            bp->b_ioflags |= BIO_ERROR;
+            bp->b_error = err;
+            bp->b_resid = bp->b_dirtyend - bp->b_dirtyoff;
+        } else if (err) {
+            bp->b_ioflags |= BIO_ERROR;
+            bp->b_flags |= B_INVAL;
+            bp->b_error = err;
+            bp->b_resid = bp->b_dirtyend - bp->b_dirtyoff;
+            fuse_io_wberror_set(bp->b_vp, err);
+        } else
+            bp->b_resid = 0;
+        bp->b_dirtyoff = bp->b_dirtyend = 0;
+    }
+    SDT_PROBE5(fuse, , io, done, VTOILLU(bp->b_vp), bp, bp->b_iocmd, err,
+        bp->b_resid);
+    bufdone(bp);
+}
+
+/*
+ * Write out the dirty region of an asynchronous buffer by a single WRITE
+ * which isn't waited for: the buffer is completed when the answer comes
+ * in. Returns non-zero if the buffer doesn't qualify, so that it's to be
+ * written out synchronously.
+ */
+static int
+fuse_io_strategy_write_async(struct vnode *vp, struct buf *bp,
+    struct ucred *cred, struct fuse_filehandle *fufh)
+{
+    struct fuse_write_in *fwi;
+    struct fuse_dispatcher fdi;
+    size_t size = bp->b_dirtyend - bp->b_dirtyoff;
+
+    if (!fuse_async_write ||
+        (bp->b_flags & (B_ASYNC | B_NEEDCOMMIT)) != B_ASYNC ||
+        size > fuse_get_mpdata(vnode_mount(vp))->max_write)
+        return (EOPNOTSUPP);
+
+    fdisp_init(&fdi, sizeof(*fwi));
+    fdisp_make_vp(&fdi, FUSE_WRITE, vp, curthread, cred);
+
+    fwi = fdi.indata;
+    fwi->fh = fufh->fh_id;
+    fwi->offset = (off_t)bp->b_lblkno * fuse_iosize(vp) + bp->b_dirtyoff;
+    fwi->size = size;
+
+    /* the buffer is ours till bufdone(), so it's safe to send from */
+    fdi.tick->tk_ms_type = FT_M_BUF;
+    fdi.tick->tk_ms_bufdata = (char *)bp->b_data + bp->b_dirtyoff;
+    fdi.tick->tk_ms_bufsize = size;
+    fdi.finh->len += size;
+
+    fuse_ticket_submit_background(fdi.tick, fuse_io_write_done, bp);
+    fdisp_destroy(&fdi);
+
+    return (0);
+}
+
 int
 fuse_io_flushbuf(struct vnode *vp, int waitfor, struct thread *td)
 {
@@ -12,5 +12,6 @@ int fuse_io_dispatch(struct vnode *vp, struct uio *uio, int ioflag,
 int fuse_io_strategy(struct vnode *vp, struct buf *bp);
 int fuse_io_flushbuf(struct vnode *vp, int waitfor, struct thread *td);
 int fuse_io_invalbuf(struct vnode *vp, struct thread *td);
+int fuse_io_wberror(struct vnode *vp);
 
 #endif /* _FUSE_IO_H_ */
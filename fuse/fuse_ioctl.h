@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#ifndef _FUSE_IOCTL_H_
+#define _FUSE_IOCTL_H_
+
+#include <sys/types.h>
+#include <sys/ioccom.h>
+
+/*
+ * Device controls understood by /dev/fuseN. This header is shared with
+ * the userspace side of the session (mount utility, daemons).
+ */
+
+/*
+ * Attach the device the ioctl is issued on as an additional channel of
+ * the session which is served through the fuse device open on the file
+ * descriptor given as argument. The device must be freshly opened and
+ * must not have been used for anything else yet.
+ *
+ * Requests of the session are then spread over the channels (see the
+ * vfs.fuse.chan_route sysctl); replies are accepted on any of them.
+ */
+#define FUSEDEVIOCATTACH    _IOW('F', 1, int)
+
+/*
+ * Negotiate optional features of the device protocol for the channel the
+ * ioctl is issued on. The argument holds the requested feature bits on
+ * input and the ones put in effect on output.
+ */
+#define FUSEDEVIOCSETFEAT   _IOWR('F', 2, int)
+
+/*
+ * read(2) passes up as many whole queued messages as fit in the buffer
+ * (at least one) instead of exactly one.
+ */
+#define FUSE_DEVFEAT_BATCH_READ     0x0001
+
+/*
+ * write(2) takes a sequence of replies, each framed by the len field of
+ * its fuse_out_header. Replies are processed in order up to the first
+ * one which fails. If that's the first reply of the write, its error is
+ * returned; else the count returned is the offset of the failed reply.
+ * A failed reply is consumed either way, the daemon should carry on with
+ * the one following it.
+ */
+#define FUSE_DEVFEAT_BATCH_WRITE    0x0002
+
+#define FUSE_DEVFEAT_ALL            (FUSE_DEVFEAT_BATCH_READ | \
+                                     FUSE_DEVFEAT_BATCH_WRITE)
+
+/*
+ * Shared memory rings.
+ *
+ * A channel can be given a ring area which the daemon maps by mmap(2) on
+ * the device (offset 0, size fs_mapsize). The area consists of
+ *
+ *  - the submission queue: a fuse_ring_hdr followed by fs_nslots
+ *    fuse_ring_ent's, at offset fs_sq_off;
+ *  - the completion queue, likewise, at offset fs_cq_off;
+ *  - fs_nslots message slots of fs_slotsize bytes each, at fs_slots_off.
+ *
+ * The kernel copies a request into a free slot and posts the slot to the
+ * submission queue, instead of queueing it for read(2). Requests which do
+ * not fit in a slot, or find no free slot, are queued for read(2) as usual.
+ *
+ * The daemon writes the reply (fuse_out_header and body) into the slot of
+ * the request and posts the slot to the completion queue with the length
+ * of the reply. Requests which take no reply (FORGET), or which have been
+ * replied to by write(2), are to be completed with a zero length to give
+ * back the slot. Completions are picked up by the FUSEDEVIOCRINGENTER
+ * ioctl, which can also wait for new submissions.
+ *
+ * head and tail are free running counters; entry i of a queue is at index
+ * i & (fs_nslots - 1). The producer advances tail, the consumer head.
+ *
+ * The stand-in daemon of fuse_ringbench (standin.c) serves requests either
+ * way, for an example.
+ */
+struct fuse_ring_hdr {
+    volatile uint32_t fr_head;
+    volatile uint32_t fr_tail;
+    uint32_t          fr_pad[14];
+};
+
+struct fuse_ring_ent {
+    uint32_t fe_slot;
+    uint32_t fe_len;
+};
+
+struct fuse_ring_setup {
+    /* in: wanted geometry, rounded up as needed */
+    uint32_t fs_nslots;
+    uint32_t fs_slotsize;
+    /* out: layout of the mapping */
+    uint32_t fs_mapsize;
+    uint32_t fs_sq_off;
+    uint32_t fs_cq_off;
+    uint32_t fs_slots_off;
+};
+
+#define FUSE_RING_MAXSLOTS          1024
+#define FUSE_RING_MAXMAPSIZE        (64 * 1024 * 1024)
+
+struct fuse_ring_enter {
+    uint32_t fn_flags;
+    uint32_t fn_reaped;     /* out: completions processed */
+};
+
+/* sleep until there is something to do on the submission queue */
+#define FUSE_RING_ENTER_GETEVENTS   0x0001
+
+/* Set up the ring area of the channel. Can be done only once. */
+#define FUSEDEVIOCRINGSETUP         _IOWR('F', 3, struct fuse_ring_setup)
+/* Process posted completions and optionally wait for submissions. */
+#define FUSEDEVIOCRINGENTER         _IOWR('F', 4, struct fuse_ring_enter)
+
+#endif /* _FUSE_IOCTL_H_ */
@@ -22,11 +22,20 @@
 #include <sys/mount.h>
 #include <sys/vnode.h>
 #include <sys/sysctl.h>
+#include <sys/selinfo.h>
+#include <sys/pcpu.h>
+#include <sys/counter.h>
+#include <sys/callout.h>
+#include <sys/taskqueue.h>
 #include <vm/uma.h>
 
 #include "fuse.h"
+#include "fuse_param.h"
 #include "fuse_node.h"
 #include "fuse_ipc.h"
+#include "fuse_ring.h"
+#include "fuse_stats.h"
+#include "fuse_sdt.h"
 #include "fuse_internal.h"
 
 #define FUSE_DEBUG_MODULE IPC
@@ -49,38 +58,167 @@ static __inline__ void fuse_setup_ihead(struct fuse_in_header *ihead,
                                         struct ucred          *cred);
 
 static fuse_handler_t  fuse_standard_handler;
+static fuse_handler_t  fuse_async_handler;
+static void            fuse_async_complete(struct fuse_ticket *ftick, int err);
+static void            fdata_bg_done(struct fuse_data *data);
+static void            fdata_bg_timeout(void *arg);
+static void            fdata_bg_timeout_task(void *arg, int pending);
+static void            fuse_interrupt_send(struct fuse_ticket *otick);
+static void            fuse_interrupt_reap(struct fuse_data *data,
+                                           uint64_t unique);
+static struct fuse_chan *fchan_route(struct fuse_ticket *ftick);
 
 SYSCTL_NODE(_vfs, OID_AUTO, fuse, CTLFLAG_RW, 0, "FUSE tunables");
 SYSCTL_STRING(_vfs_fuse, OID_AUTO, version, CTLFLAG_RD,
               FUSE_FREEBSD_VERSION, 0, "fuse-freebsd version");
-static int fuse_ticket_count = 0;
-SYSCTL_INT(_vfs_fuse, OID_AUTO, ticket_count, CTLFLAG_RW,
-            &fuse_ticket_count, 0, "number of allocated tickets");
-static long fuse_iov_permanent_bufsize = 1 << 19;
+static counter_u64_t fuse_ticket_count;
+SYSCTL_COUNTER_U64(_vfs_fuse, OID_AUTO, ticket_count, CTLFLAG_RD,
+            &fuse_ticket_count, "number of allocated tickets");
+static long fuse_iov_permanent_bufsize = 1 << 16;
 SYSCTL_LONG(_vfs_fuse, OID_AUTO, iov_permanent_bufsize, CTLFLAG_RW,
             &fuse_iov_permanent_bufsize, 0,
             "limit for permanently stored buffer size for fuse_iovs");
-static int fuse_iov_credit = 16;
-SYSCTL_INT(_vfs_fuse, OID_AUTO, iov_credit, CTLFLAG_RW,
-            &fuse_iov_credit, 0,
-            "how many times is an oversized fuse_iov tolerated");
+
+#define FUSE_CHAN_ROUTE_CPU    0
+#define FUSE_CHAN_ROUTE_NODEID 1
+static int fuse_chan_route = FUSE_CHAN_ROUTE_CPU;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, chan_route, CTLFLAG_RW,
+            &fuse_chan_route, 0,
+            "how to spread requests over channels (0: by cpu, 1: by nodeid)");
+
+static int fuse_lockless_submit = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, lockless_submit, CTLFLAG_RW,
+            &fuse_lockless_submit, 0,
+            "queue messages without taking the message list mutex");
+
+static u_long fuse_wakeups_saved = 0;
+SYSCTL_ULONG(_vfs_fuse, OID_AUTO, wakeups_saved, CTLFLAG_RD,
+            &fuse_wakeups_saved, 0,
+            "reader notifications skipped as nobody was waiting");
+
+/* the statistics of the lanes are per channel, see fuse_stats_attach() */
+static int fuse_lane_weight[FUSE_NLANES] = {
+    [FUSE_LANE_CTL]  = 0,
+    [FUSE_LANE_META] = 4,
+    [FUSE_LANE_DATA] = 1,
+};
+
+SYSCTL_NODE(_vfs_fuse, OID_AUTO, lane, CTLFLAG_RW, 0,
+            "message queue priority lanes");
+SYSCTL_NODE(_vfs_fuse_lane, OID_AUTO, meta, CTLFLAG_RW, 0,
+            "message queue lane meta");
+SYSCTL_NODE(_vfs_fuse_lane, OID_AUTO, data, CTLFLAG_RW, 0,
+            "message queue lane data");
+
+SYSCTL_INT(_vfs_fuse_lane_meta, OID_AUTO, weight, CTLFLAG_RW,
+           &fuse_lane_weight[FUSE_LANE_META], 0,
+           "metadata messages passed up per round");
+SYSCTL_INT(_vfs_fuse_lane_data, OID_AUTO, weight, CTLFLAG_RW,
+           &fuse_lane_weight[FUSE_LANE_DATA], 0,
+           "data messages passed up per round");
 
 MALLOC_DEFINE(M_FUSEMSG, "fuse_msgbuf", "fuse message buffer");
 static uma_zone_t ticket_zone;
 
+/*
+ * fuse_iov buffers come from a few size classes, each backed by an UMA
+ * zone, so that swapping the buffer of a pooled ticket for one of another
+ * size is cheap. Oversized buffers (beyond the largest class, which fits
+ * a max sized WRITE) are malloc'd.
+ */
+#define FIOV_NCLASSES 4
+#define FIOV_MALLOC   FIOV_NCLASSES
+
+static struct fiov_class {
+    const char *fc_name;
+    size_t      fc_size;
+    uma_zone_t  fc_zone;
+    u_long      fc_hits;
+    u_long      fc_misses;
+    u_long      fc_footprint;
+} fiov_classes[FIOV_NCLASSES + 1] = {
+    { "fuse_iov_256",   256 },
+    { "fuse_iov_4k",    4096 },
+    { "fuse_iov_64k",   65536 },
+    { "fuse_iov_max",   MAXPHYS + PAGE_SIZE },
+    { "fuse_iov_large", 0 },
+};
+
+SYSCTL_NODE(_vfs_fuse, OID_AUTO, iov, CTLFLAG_RW, 0,
+            "fuse_iov buffer classes");
+
+#define FIOV_CLASS_SYSCTL(class, name)                                   \
+SYSCTL_NODE(_vfs_fuse_iov, OID_AUTO, name, CTLFLAG_RW, 0,                \
+            "fuse_iov buffer class " #name);                             \
+SYSCTL_ULONG(_vfs_fuse_iov_##name, OID_AUTO, hits, CTLFLAG_RD,           \
+             &fiov_classes[class].fc_hits, 0,                            \
+             "requests served by the buffer at hand");                   \
+SYSCTL_ULONG(_vfs_fuse_iov_##name, OID_AUTO, misses, CTLFLAG_RD,         \
+             &fiov_classes[class].fc_misses, 0,                          \
+             "buffers of the class allocated");                          \
+SYSCTL_ULONG(_vfs_fuse_iov_##name, OID_AUTO, footprint, CTLFLAG_RD,      \
+             &fiov_classes[class].fc_footprint, 0,                       \
+             "bytes held in buffers of the class")
+
+FIOV_CLASS_SYSCTL(0, 256);
+FIOV_CLASS_SYSCTL(1, 4k);
+FIOV_CLASS_SYSCTL(2, 64k);
+FIOV_CLASS_SYSCTL(3, max);
+FIOV_CLASS_SYSCTL(FIOV_MALLOC, large);
+
+static __inline int
+fiov_class(size_t size)
+{
+    int class;
+
+    for (class = 0; class < FIOV_NCLASSES; class++)
+        if (size <= fiov_classes[class].fc_size)
+            break;
+
+    return class;
+}
+
+static void
+fiov_alloc(struct fuse_iov *fiov, size_t size)
+{
+    struct fiov_class *fc;
+
+    fiov->class = fiov_class(size);
+    fc = &fiov_classes[fiov->class];
+
+    if (fiov->class == FIOV_MALLOC) {
+        fiov->allocated_size = size;
+        fiov->base = malloc(size, M_FUSEMSG, M_WAITOK);
+    } else {
+        fiov->allocated_size = fc->fc_size;
+        fiov->base = uma_zalloc(fc->fc_zone, M_WAITOK);
+    }
+
+    atomic_add_long(&fc->fc_misses, 1);
+    atomic_add_long(&fc->fc_footprint, fiov->allocated_size);
+}
+
+static void
+fiov_free(struct fuse_iov *fiov)
+{
+    struct fiov_class *fc = &fiov_classes[fiov->class];
+
+    if (fiov->class == FIOV_MALLOC)
+        free(fiov->base, M_FUSEMSG);
+    else
+        uma_zfree(fc->fc_zone, fiov->base);
+
+    atomic_subtract_long(&fc->fc_footprint, fiov->allocated_size);
+    fiov->base = NULL;
+}
+
 void
 fiov_init(struct fuse_iov *fiov, size_t size)
 {
-    uint32_t msize = FU_AT_LEAST(size);
-
     debug_printf("fiov=%p, size=%zd\n", fiov, size);
 
     fiov->len = 0;
-
-    fiov->base = malloc(msize, M_FUSEMSG, M_WAITOK | M_ZERO);
-
-    fiov->allocated_size = msize;
-    fiov->credit = fuse_iov_credit;
+    fiov_alloc(fiov, FU_AT_LEAST(size));
 }
 
 void
@@ -89,9 +227,14 @@ fiov_teardown(struct fuse_iov *fiov)
     debug_printf("fiov=%p\n", fiov);
 
     MPASS(fiov->base != NULL);
-    free(fiov->base, M_FUSEMSG);
+    fiov_free(fiov);
 }
 
+/*
+ * Make fiov hold size bytes. Buffers are not zeroed, and contents are not
+ * kept when the buffer is swapped. Buffers beyond the permanent limit are
+ * swapped for a smaller one as soon as it would do.
+ */
 void
 fiov_adjust(struct fuse_iov *fiov, size_t size)
 {
@@ -99,18 +242,12 @@ fiov_adjust(struct fuse_iov *fiov, size_t size)
 
     if (fiov->allocated_size < size ||
         (fuse_iov_permanent_bufsize >= 0 &&
-         fiov->allocated_size - size > fuse_iov_permanent_bufsize &&
-             --fiov->credit < 0)) {
-
-        fiov->base = realloc(fiov->base, FU_AT_LEAST(size), M_FUSEMSG,
-                             M_WAITOK | M_ZERO);
-        if (!fiov->base) {
-            panic("FUSE: realloc failed");
-        }
-
-        fiov->allocated_size = FU_AT_LEAST(size);
-        fiov->credit = fuse_iov_credit;
-    }
+         fiov->allocated_size > fuse_iov_permanent_bufsize &&
+         fiov_class(FU_AT_LEAST(size)) < fiov->class)) {
+        fiov_free(fiov);
+        fiov_alloc(fiov, FU_AT_LEAST(size));
+    } else
+        atomic_add_long(&fiov_classes[fiov->class].fc_hits, 1);
 
     fiov->len = size;
 }
@@ -120,7 +257,6 @@ fiov_refresh(struct fuse_iov *fiov)
 {
     debug_printf("fiov=%p\n", fiov);
 
-    bzero(fiov->base, fiov->len);
     fiov_adjust(fiov, 0);
 }
 
@@ -140,13 +276,8 @@ fticket_ctor(void *mem, int size, void *arg, int flags)
     if (ftick->tk_unique != 0)
 	    fticket_refresh(ftick);
 
-    /* May be truncated to 32 bits */
-    ftick->tk_unique = atomic_fetchadd_long(&data->ticketer, 1);
-    if (ftick->tk_unique == 0)
-        ftick->tk_unique = atomic_fetchadd_long(&data->ticketer, 1);
-
     refcount_init(&ftick->tk_refcount, 1);
-    atomic_add_acq_int(&fuse_ticket_count, 1);
+    counter_u64_add(fuse_ticket_count, 1);
 
     return 0;
 }
@@ -161,7 +292,7 @@ fticket_dtor(void *mem, int size, void *arg)
     FUSE_ASSERT_MS_DONE(ftick);
     FUSE_ASSERT_AW_DONE(ftick);
 
-    atomic_subtract_acq_int(&fuse_ticket_count, 1);
+    counter_u64_add(fuse_ticket_count, -1);
 }
 
 static int
@@ -195,16 +326,77 @@ fticket_fini(void *mem, int size)
     mtx_destroy(&ftick->tk_aw_mtx);
 }
 
-static __inline struct fuse_ticket *
+/*
+ * Tickets come from the cache of the current cpu if there is one, else
+ * from the zone. Either way, the unique id is taken from the range of
+ * the cpu, so that the requesters of a session don't need to share any
+ * cache line.
+ */
+static struct fuse_ticket *
 fticket_alloc(struct fuse_data *data)
 {
-    return uma_zalloc_arg(ticket_zone, data, M_WAITOK);
+    struct fuse_pcpu *pc;
+    struct fuse_ticket *ftick;
+    u_long unique;
+
+    critical_enter();
+    pc = &data->pcpu[curcpu];
+    if (pc->pc_unique == pc->pc_unique_end) {
+        /* May be truncated to 32 bits */
+        pc->pc_unique = atomic_fetchadd_long(&data->ticketer,
+                                             FUSE_UNIQUE_BATCH);
+        pc->pc_unique_end = pc->pc_unique + FUSE_UNIQUE_BATCH;
+        if (pc->pc_unique == 0)
+            pc->pc_unique++;
+    }
+    unique = pc->pc_unique++;
+    if ((ftick = SLIST_FIRST(&pc->pc_free)) != NULL) {
+        SLIST_REMOVE_HEAD(&pc->pc_free, tk_free_link);
+        pc->pc_nfree--;
+    }
+    critical_exit();
+
+    if (ftick != NULL) {
+        FUSE_ASSERT_MS_DONE(ftick);
+        FUSE_ASSERT_AW_DONE(ftick);
+        fticket_refresh(ftick);
+        refcount_init(&ftick->tk_refcount, 1);
+    } else
+        ftick = uma_zalloc_arg(ticket_zone, data, M_WAITOK);
+    ftick->tk_unique = unique;
+
+    return ftick;
 }
 
-static __inline void
+/*
+ * Tickets are cached with their buffers, which are only cut down to the
+ * permanent size here: a ticket which last carried a big READ or WRITE
+ * would pin that until it's reused otherwise.
+ */
+static void
 fticket_destroy(struct fuse_ticket *ftick)
 {
-    return uma_zfree(ticket_zone, ftick);
+    struct fuse_data *data = ftick->tk_data;
+    struct fuse_pcpu *pc;
+
+    if (fuse_iov_permanent_bufsize >= 0) {
+        if (ftick->tk_ms_fiov.allocated_size > fuse_iov_permanent_bufsize)
+            fiov_refresh(&ftick->tk_ms_fiov);
+        if (ftick->tk_aw_fiov.allocated_size > fuse_iov_permanent_bufsize)
+            fiov_refresh(&ftick->tk_aw_fiov);
+    }
+
+    critical_enter();
+    pc = &data->pcpu[curcpu];
+    if (pc->pc_nfree < data->pcpu_max_free) {
+        SLIST_INSERT_HEAD(&pc->pc_free, ftick, tk_free_link);
+        pc->pc_nfree++;
+        ftick = NULL;
+    }
+    critical_exit();
+
+    if (ftick != NULL)
+        uma_zfree(ticket_zone, ftick);
 }
 
 static __inline__
@@ -228,6 +420,10 @@ fticket_refresh(struct fuse_ticket *ftick)
     ftick->tk_aw_bufdata = NULL;
     ftick->tk_aw_bufsize = 0;
     ftick->tk_aw_type = FT_A_FIOV;
+    ftick->tk_interrupt = 0;
+
+    ftick->tk_async_done = NULL;
+    ftick->tk_async_arg = NULL;
 
     ftick->tk_flag = 0;
 }
@@ -247,7 +443,7 @@ fticket_wait_answer(struct fuse_ticket *ftick)
 
     data = ftick->tk_data;
 
-    if (fdata_get_dead(data)) {
+    if (fdata_get_dead(data) && !(ftick->tk_flag & FT_PULLING)) {
         err = ENOTCONN;
         fticket_set_answered(ftick);
         goto out;
@@ -255,14 +451,25 @@ fticket_wait_answer(struct fuse_ticket *ftick)
 
     err = msleep(ftick, &ftick->tk_aw_mtx, PCATCH, "fu_ans",
                  data->daemon_timeout * hz);
+    if (err && (ftick->tk_flag & FT_PULLING)) {
+        /*
+         * The answer is being copied right into the caller's buffer;
+         * we can't let the caller go until that's done. It won't take
+         * long, and the answer is complete then.
+         */
+        while (ftick->tk_flag & FT_PULLING)
+            msleep(ftick, &ftick->tk_aw_mtx, 0, "fu_pull", 0);
+        err = 0;
+    }
     if (err == EAGAIN) { /* same as EWOULDBLOCK */
 #ifdef XXXIP /* die conditionally */
         if (!fdata_get_dead(data)) {
             fdata_set_dead(data);
         }
 #endif
+        /* fdisp_cancel() marks it answered and sends the INTERRUPT */
         err = ETIMEDOUT;
-        fticket_set_answered(ftick);
+        FUSE_TICKET_PROBE(ticket, timeout, ftick, data->daemon_timeout);
     }
 
 out:
@@ -270,6 +477,7 @@ out:
         debug_printf("FUSE: requester was woken up but still no answer");
         err = ENXIO;
     }
+    FUSE_TICKET_PROBE(ticket, wakeup, ftick, err);
 
     fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
 
@@ -285,6 +493,9 @@ fticket_aw_pull_uio(struct fuse_ticket *ftick, struct uio *uio)
 
     debug_printf("ftick=%p, uio=%p\n", ftick, uio);
 
+    if (ftick->tk_aw_type == FT_A_BUF)
+        ftick->tk_aw_bufsize = len;
+
     if (len) {
         switch (ftick->tk_aw_type) {
         case FT_A_FIOV:
@@ -297,7 +508,6 @@ fticket_aw_pull_uio(struct fuse_ticket *ftick, struct uio *uio)
             break;
 
         case FT_A_BUF:
-            ftick->tk_aw_bufsize = len;
             err = uiomove(ftick->tk_aw_bufdata, len, uio);
             if (err) {
                 debug_printf("FUSE: FT_A_BUF: error is %d (%p, %zd, %p)\n",
@@ -313,6 +523,80 @@ fticket_aw_pull_uio(struct fuse_ticket *ftick, struct uio *uio)
     return err;
 }
 
+/*
+ * tk_ms_bufdata of FT_M_BUF messages belongs to the sender, so it's only
+ * to be read as long as she is waiting. Readers of the message claim it
+ * for the time of copying it out; claiming fails if the sender is gone.
+ */
+int
+fticket_ms_claim(struct fuse_ticket *ftick)
+{
+    int err = 0;
+
+    if (ftick->tk_ms_type != FT_M_BUF)
+        return 0;
+
+    fuse_lck_mtx_lock(ftick->tk_aw_mtx);
+    if (ftick->tk_flag & FT_MSDROP)
+        err = ECANCELED;
+    else
+        ftick->tk_flag |= FT_MSCOPY;
+    fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+
+    return err;
+}
+
+void
+fticket_ms_release(struct fuse_ticket *ftick, int sent)
+{
+    if (ftick->tk_ms_type != FT_M_BUF)
+        return;
+
+    fuse_lck_mtx_lock(ftick->tk_aw_mtx);
+    MPASS(ftick->tk_flag & FT_MSCOPY);
+    if (sent)
+        ftick->tk_flag |= FT_MSSENT;
+    if (ftick->tk_flag & FT_MSWANT)
+        wakeup(ftick);
+    ftick->tk_flag &= ~(FT_MSCOPY | FT_MSWANT);
+    fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+}
+
+/*
+ * The sender gives up on the message: wait for a pending copy of it to
+ * finish and keep off further ones.
+ */
+static void
+fticket_ms_abandon(struct fuse_ticket *ftick)
+{
+    mtx_assert(&ftick->tk_aw_mtx, MA_OWNED);
+
+    if (ftick->tk_ms_type != FT_M_BUF)
+        return;
+
+    while (ftick->tk_flag & FT_MSCOPY) {
+        ftick->tk_flag |= FT_MSWANT;
+        msleep(ftick, &ftick->tk_aw_mtx, 0, "fu_mscp", 0);
+    }
+    if (!(ftick->tk_flag & FT_MSSENT))
+        ftick->tk_flag |= FT_MSDROP;
+}
+
+/*
+ * The answer of an interrupted request is in: hand over the INTERRUPT sent
+ * for it, if any, to be reaped.
+ */
+static __inline uint64_t
+fticket_intr_clear(struct fuse_ticket *ftick)
+{
+    mtx_assert(&ftick->tk_aw_mtx, MA_OWNED);
+
+    if (!(ftick->tk_flag & FT_INTR))
+        return 0;
+    ftick->tk_flag &= ~FT_INTR;
+    return ftick->tk_interrupt;
+}
+
 int
 fticket_pull(struct fuse_ticket *ftick, struct uio *uio)
 {
@@ -332,30 +616,466 @@ fticket_pull(struct fuse_ticket *ftick, struct uio *uio)
     return err;
 }
 
+static __inline int
+fticket_lane(struct fuse_ticket *ftick)
+{
+    switch (fticket_opcode(ftick)) {
+    case FUSE_INTERRUPT:
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+        return FUSE_LANE_CTL;
+    case FUSE_READ:
+    case FUSE_WRITE:
+    case FUSE_FSYNC:
+        return FUSE_LANE_DATA;
+    default:
+        return FUSE_LANE_META;
+    }
+}
+
+/*
+ * Put ftick on its lane of the message queue of chan, carrying over a
+ * reference the caller owns.
+ */
+static void
+fuse_ms_enqueue(struct fuse_chan *chan, struct fuse_ticket *ftick)
+{
+    mtx_assert(&chan->ms_mtx, MA_OWNED);
+
+    ftick->tk_ms_lane = fticket_lane(ftick);
+    ftick->tk_ms_ticks = ticks;
+    STAILQ_INSERT_TAIL(&chan->ms_lane[ftick->tk_ms_lane].ml_head, ftick,
+                       tk_ms_link);
+    chan->ms_count++;
+    chan->ms_lane[ftick->tk_ms_lane].ml_depth++;
+}
+
+/*
+ * Messages may be put on the staging stack of a channel without holding
+ * its message list mutex, see fuse_insert_message(). Whoever holds the
+ * mutex takes them all over to the lanes in one go, restoring the order
+ * they were staged in.
+ *
+ * Returns non-zero if the stack was empty, ie. it's up to the caller to
+ * let the readers know.
+ */
+static int
+fchan_stage(struct fuse_chan *chan, struct fuse_ticket *ftick)
+{
+    struct fuse_ticket *head;
+
+    refcount_acquire(&ftick->tk_refcount);
+    do {
+        head = chan->ch_stage;
+        ftick->tk_ms_link.stqe_next = head;
+    } while (!atomic_cmpset_ptr((volatile uintptr_t *)&chan->ch_stage,
+                                (uintptr_t)head, (uintptr_t)ftick));
+
+    return (head == NULL);
+}
+
+static void
+fchan_stage_drain(struct fuse_chan *chan)
+{
+    struct fuse_ticket *ftick, *next, *prev = NULL;
+
+    mtx_assert(&chan->ms_mtx, MA_OWNED);
+
+    if (chan->ch_stage == NULL)
+        return;
+    ftick = (struct fuse_ticket *)atomic_readandclear_ptr(
+                 (volatile uintptr_t *)&chan->ch_stage);
+    for (; ftick != NULL; ftick = next) {
+        next = ftick->tk_ms_link.stqe_next;
+        ftick->tk_ms_link.stqe_next = prev;
+        prev = ftick;
+    }
+    for (ftick = prev; ftick != NULL; ftick = next) {
+        next = ftick->tk_ms_link.stqe_next;
+        fuse_ms_enqueue(chan, ftick);
+    }
+}
+
+/*
+ * Number of messages on the lanes of chan, staged ones included.
+ */
+int
+fuse_ms_count(struct fuse_chan *chan)
+{
+    fchan_stage_drain(chan);
+    return chan->ms_count;
+}
+
+void
+fuse_ms_push(struct fuse_chan *chan, struct fuse_ticket *ftick)
+{
+    DEBUGX(FUSE_DEBUG_IPC, "ftick=%p refcount=%d\n",
+        ftick, ftick->tk_refcount + 1);
+    mtx_assert(&chan->ms_mtx, MA_OWNED);
+    refcount_acquire(&ftick->tk_refcount);
+    fuse_ms_enqueue(chan, ftick);
+}
+
+/*
+ * Pick the lane the next message is to be taken from: the control lane
+ * if it's not empty, else the first non-empty lane with turns left in
+ * the current round. A new round starts when no such lane is left.
+ */
+static int
+fuse_ms_lane(struct fuse_chan *chan)
+{
+    struct fuse_ms_lane *ml;
+    int lane, round;
+
+    if (fuse_ms_count(chan) == 0)
+        return -1;
+    if (!STAILQ_EMPTY(&chan->ms_lane[FUSE_LANE_CTL].ml_head))
+        return FUSE_LANE_CTL;
+
+    for (round = 0; round < 2; round++) {
+        for (lane = FUSE_LANE_META; lane < FUSE_NLANES; lane++) {
+            ml = &chan->ms_lane[lane];
+            if (ml->ml_credit > 0 && !STAILQ_EMPTY(&ml->ml_head))
+                return lane;
+        }
+        for (lane = FUSE_LANE_META; lane < FUSE_NLANES; lane++)
+            chan->ms_lane[lane].ml_credit =
+                MAX(fuse_lane_weight[lane], 1);
+    }
+
+    panic("FUSE: message count of channel %p is off", chan);
+}
+
+/*
+ * Return the message fuse_ms_pop() would take next.
+ */
+struct fuse_ticket *
+fuse_ms_peek(struct fuse_chan *chan)
+{
+    int lane;
+
+    if ((lane = fuse_ms_lane(chan)) < 0)
+        return NULL;
+
+    return STAILQ_FIRST(&chan->ms_lane[lane].ml_head);
+}
+
+/*
+ * Take the next message off chan, charging the time it spent queued to
+ * its lane. If it's put back (fuse_ms_requeue(), fchan_handover()), the
+ * clock starts anew but the time is not taken back, it's only the count
+ * which is.
+ */
+struct fuse_ticket *
+fuse_ms_pop(struct fuse_chan *chan)
+{
+    struct fuse_ms_lane *ml;
+    struct fuse_ticket *ftick = NULL;
+    u_long wait;
+    int lane;
+
+    if ((lane = fuse_ms_lane(chan)) >= 0) {
+        ml = &chan->ms_lane[lane];
+        ftick = STAILQ_FIRST(&ml->ml_head);
+        STAILQ_REMOVE_HEAD(&ml->ml_head, tk_ms_link);
+#ifdef INVARIANTS
+        ftick->tk_ms_link.stqe_next = NULL;
+#endif
+        if (lane != FUSE_LANE_CTL)
+            ml->ml_credit--;
+        chan->ms_count--;
+
+        wait = (u_long)(ticks - ftick->tk_ms_ticks) * tick;
+        ftick->tk_ms_ticks = ticks;
+        ml->ml_depth--;
+        ml->ml_count++;
+        ml->ml_wait += wait;
+        if (wait > ml->ml_maxwait)
+            ml->ml_maxwait = wait;
+    }
+    DEBUGX(FUSE_DEBUG_IPC, "ftick=%p refcount=%d\n",
+        ftick, ftick ? ftick->tk_refcount : -1);
+
+    return ftick;
+}
+
+/*
+ * Put messages taken by fuse_ms_pop() back to the head of their lanes,
+ * keeping their order, and give the lanes back the turns they took. The
+ * references of head are carried over.
+ */
+void
+fuse_ms_requeue(struct fuse_chan *chan, struct fuse_ms_head *head)
+{
+    struct fuse_ms_head back[FUSE_NLANES];
+    struct fuse_ms_lane *ml;
+    struct fuse_ticket *ftick;
+    int lane;
+
+    mtx_assert(&chan->ms_mtx, MA_OWNED);
+
+    for (lane = 0; lane < FUSE_NLANES; lane++)
+        STAILQ_INIT(&back[lane]);
+    while ((ftick = STAILQ_FIRST(head))) {
+        STAILQ_REMOVE_HEAD(head, tk_ms_link);
+        STAILQ_INSERT_TAIL(&back[ftick->tk_ms_lane], ftick, tk_ms_link);
+        ml = &chan->ms_lane[ftick->tk_ms_lane];
+        if (ftick->tk_ms_lane != FUSE_LANE_CTL)
+            ml->ml_credit++;
+        chan->ms_count++;
+        ml->ml_depth++;
+        ml->ml_count--;
+    }
+    for (lane = 0; lane < FUSE_NLANES; lane++) {
+        STAILQ_CONCAT(&back[lane], &chan->ms_lane[lane].ml_head);
+        STAILQ_CONCAT(&chan->ms_lane[lane].ml_head, &back[lane]);
+    }
+}
+
+/*
+ * Let the readers of chan know there are new messages, if any of them
+ * waits for that: readers sleeping in read(2) or ring enter are counted,
+ * pollers and knotes are registered under the message list mutex, which
+ * we hold, so nobody can slip through.
+ */
+void
+fchan_notify(struct fuse_chan *chan)
+{
+    mtx_assert(&chan->ms_mtx, MA_OWNED);
+
+    if (chan->ch_sleepers > 0)
+        wakeup_one(chan);
+    else
+        atomic_add_long(&fuse_wakeups_saved, 1);
+    if (SEL_WAITING(&chan->ks_rsel))
+        selwakeuppri(&chan->ks_rsel, PZERO + 1);
+    if (!knlist_empty(&chan->ks_rsel.si_note))
+        KNOTE_LOCKED(&chan->ks_rsel.si_note, 0);
+}
+
+struct fuse_chan *
+fchan_alloc(struct fuse_data *data, struct cdev *dev)
+{
+    struct fuse_chan *chan;
+    int lane;
+
+    debug_printf("data=%p, dev=%p\n", data, dev);
+
+    chan = malloc(sizeof(struct fuse_chan), M_FUSEMSG, M_WAITOK | M_ZERO);
+
+    chan->ch_data = data;
+    chan->ch_dev = dev;
+    mtx_init(&chan->ms_mtx, "fuse message list mutex", NULL, MTX_DEF);
+    for (lane = 0; lane < FUSE_NLANES; lane++)
+        STAILQ_INIT(&chan->ms_lane[lane].ml_head);
+    knlist_init_mtx(&chan->ks_rsel.si_note, &chan->ms_mtx);
+
+    return chan;
+}
+
+void
+fchan_destroy(struct fuse_chan *chan)
+{
+    debug_printf("chan=%p\n", chan);
+
+    MPASS(chan->ch_ring == NULL);
+    seldrain(&chan->ks_rsel);
+    knlist_clear(&chan->ks_rsel.si_note, 0);
+    knlist_destroy(&chan->ks_rsel.si_note);
+    mtx_destroy(&chan->ms_mtx);
+    free(chan, M_FUSEMSG);
+}
+
+static void fchan_handover(struct fuse_chan *chan, struct fuse_ms_head *stale);
+
+/*
+ * Take an extra channel out of service as its device gets closed.
+ * Messages still queued on it, or posted to its ring and not answered,
+ * are handed over to the primary channel.
+ */
+void
+fchan_close(struct fuse_chan *chan)
+{
+    struct fuse_data *data = chan->ch_data;
+    struct fuse_ticket *ftick;
+    struct fuse_ms_head pending, stale;
+    int answered;
+
+    debug_printf("chan=%p\n", chan);
+
+    MPASS(chan != data->chans[0]);
+    STAILQ_INIT(&pending);
+    STAILQ_INIT(&stale);
+
+    fring_teardown(chan, &pending);
+    while ((ftick = STAILQ_FIRST(&pending))) {
+        STAILQ_REMOVE_HEAD(&pending, tk_ms_link);
+        fuse_lck_mtx_lock(ftick->tk_aw_mtx);
+        answered = fticket_answered(ftick);
+        fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+        if (answered) {
+#ifdef INVARIANTS
+            ftick->tk_ms_link.stqe_next = NULL;
+#endif
+            fuse_ticket_drop(ftick);
+        } else
+            STAILQ_INSERT_TAIL(&stale, ftick, tk_ms_link);
+    }
+
+    fchan_handover(chan, &stale);
+}
+
+/*
+ * Mark chan closed and pass the messages queued on it, along with those
+ * in stale, over to the primary channel.
+ */
+static void
+fchan_handover(struct fuse_chan *chan, struct fuse_ms_head *stale)
+{
+    struct fuse_chan *pchan = chan->ch_data->chans[0];
+    struct fuse_ticket *ftick;
+
+    fuse_lck_mtx_lock(chan->ms_mtx);
+    chan->ch_flags |= FCH_CLOSED;
+    while ((ftick = fuse_ms_pop(chan))) {
+        /* not passed up after all */
+        chan->ms_lane[ftick->tk_ms_lane].ml_count--;
+        STAILQ_INSERT_TAIL(stale, ftick, tk_ms_link);
+    }
+    fuse_lck_mtx_unlock(chan->ms_mtx);
+
+    if (STAILQ_EMPTY(stale))
+        return;
+
+    fuse_lck_mtx_lock(pchan->ms_mtx);
+    /* the references of the queue / ring are carried over */
+    while ((ftick = STAILQ_FIRST(stale))) {
+        STAILQ_REMOVE_HEAD(stale, tk_ms_link);
+        fuse_ms_enqueue(pchan, ftick);
+    }
+    fchan_notify(pchan);
+    fuse_lck_mtx_unlock(pchan->ms_mtx);
+}
+
+/*
+ * Add chan to the channels of data. Needs the FUSE lock.
+ */
+int
+fdata_attach_chan(struct fuse_data *data, struct fuse_chan *chan)
+{
+    debug_printf("data=%p, chan=%p\n", data, chan);
+
+    mtx_assert(&fuse_mtx, MA_OWNED);
+
+    if (fdata_get_dead(data))
+        return ENXIO;
+    if (data->nchans >= FUSE_MAXCHANS)
+        return ENOSPC;
+
+    chan->ch_data = data;
+    data->chans[data->nchans] = chan;
+    /* publish the channel only once it's fully set up */
+    atomic_store_rel_int(&data->nchans, data->nchans + 1);
+
+    return 0;
+}
+
+/*
+ * Pick the channel a message is to be queued on. Routing by CPU keeps
+ * the submitter and the daemon thread reading the channel on the same
+ * core (given the daemon binds its readers accordingly); routing by
+ * nodeid keeps the requests of a given file in order on one channel.
+ */
+static struct fuse_chan *
+fchan_route(struct fuse_ticket *ftick)
+{
+    struct fuse_data *data = ftick->tk_data;
+    u_int nchans, idx;
+
+    nchans = atomic_load_acq_int(&data->nchans);
+    if (nchans == 1)
+        return data->chans[0];
+
+    switch (fuse_chan_route) {
+    case FUSE_CHAN_ROUTE_NODEID:
+        idx = ((struct fuse_in_header *)ftick->tk_ms_fiov.base)->nodeid %
+              nchans;
+        break;
+    default:
+        idx = curcpu % nchans;
+        break;
+    }
+
+    return data->chans[idx];
+}
+
 struct fuse_data *
 fdata_alloc(struct cdev *fdev, struct ucred *cred)
 {
     struct fuse_data *data;
+    int i;
 
     debug_printf("fdev=%p\n", fdev);
 
     data = malloc(sizeof(struct fuse_data), M_FUSEMSG, M_WAITOK | M_ZERO);
 
     data->fdev = fdev;
-    mtx_init(&data->ms_mtx, "fuse message list mutex", NULL, MTX_DEF);
-    STAILQ_INIT(&data->ms_head);
-    mtx_init(&data->aw_mtx, "fuse answer list mutex", NULL, MTX_DEF);
-    TAILQ_INIT(&data->aw_head);
+    data->chans[0] = fchan_alloc(data, fdev);
+    data->nchans = 1;
+    for (i = 0; i < FUSE_AW_HASHSIZE; i++) {
+        mtx_init(&data->aw_hash[i].awb_mtx, "fuse answer list mutex", NULL,
+                 MTX_DEF);
+        TAILQ_INIT(&data->aw_hash[i].awb_head);
+    }
     data->daemoncred = crhold(cred);
     data->daemon_timeout = FUSE_DEFAULT_DAEMON_TIMEOUT;
+    data->pcpu = malloc(sizeof(struct fuse_pcpu) * (mp_maxid + 1),
+                        M_FUSEMSG, M_WAITOK | M_ZERO);
+    for (i = 0; i <= mp_maxid; i++)
+        SLIST_INIT(&data->pcpu[i].pc_free);
+    fdata_set_max_free_tickets(data, FUSE_DEFAULT_MAX_FREE_TICKETS);
     sx_init(&data->rename_lock, "fuse rename lock");
+    mtx_init(&data->bg_mtx, "fuse background mutex", NULL, MTX_DEF);
+    data->max_background = FUSE_DEFAULT_MAX_BACKGROUND;
+    data->congestion_threshold = FUSE_DEFAULT_CONGESTION_THRESHOLD;
+    callout_init_mtx(&data->bg_callout, &data->bg_mtx, 0);
+    TASK_INIT(&data->bg_task, 0, fdata_bg_timeout_task, data);
+    sx_init(&data->forget_lock, "fuse forget lock");
+    callout_init(&data->forget_callout, CALLOUT_MPSAFE);
+    TASK_INIT(&data->forget_task, 0, fuse_internal_forget_task, data);
 
     return data;
 }
 
+/*
+ * Let the cpu caches of data keep about max tickets in all.
+ */
+void
+fdata_set_max_free_tickets(struct fuse_data *data, u_int max)
+{
+    data->pcpu_max_free = howmany(max, mp_ncpus);
+}
+
+static void
+fdata_free_tickets(struct fuse_data *data)
+{
+    struct fuse_ticket *ftick;
+    int i;
+
+    for (i = 0; i <= mp_maxid; i++) {
+        while ((ftick = SLIST_FIRST(&data->pcpu[i].pc_free))) {
+            SLIST_REMOVE_HEAD(&data->pcpu[i].pc_free, tk_free_link);
+            uma_zfree(ticket_zone, ftick);
+        }
+    }
+    free(data->pcpu, M_FUSEMSG);
+}
+
 void
 fdata_trydestroy(struct fuse_data *data)
 {
+    int i;
+
     DEBUG("data=%p data.mp=%p data.fdev=%p data.flags=%04x\n",
 	data, data->mp, data->fdev, data->dataflags);
 
@@ -364,18 +1084,31 @@ fdata_trydestroy(struct fuse_data *data)
         return;
     }
 
-    if (data->fdev->si_drv1 != NULL) {
-        MPASS(data->fdev->si_drv1 == data);
+    if (data->fdev->si_drv1 == data)
         return;
+
+    for (i = 1; i < data->nchans; i++) {
+        if (data->chans[i]->ch_dev != NULL)
+            return;
     }
 
     DEBUG("destroy: data=%p\n", data);
     MPASS((data->dataflags & FSESS_OPENED) == 0);
 
     /* Driving off stage all that stuff thrown at device... */
-    mtx_destroy(&data->ms_mtx);
-    mtx_destroy(&data->aw_mtx);
+    for (i = 0; i < data->nchans; i++)
+        fchan_destroy(data->chans[i]);
+    for (i = 0; i < FUSE_AW_HASHSIZE; i++) {
+        MPASS(TAILQ_EMPTY(&data->aw_hash[i].awb_head));
+        mtx_destroy(&data->aw_hash[i].awb_mtx);
+    }
     sx_destroy(&data->rename_lock);
+    MPASS(data->forget_count == 0);
+    sx_destroy(&data->forget_lock);
+    MPASS(data->num_background == 0);
+    mtx_destroy(&data->bg_mtx);
+    fuse_stats_free(data);
+    fdata_free_tickets(data);
 
     crfree(data->daemoncred);
 
@@ -385,6 +1118,9 @@ fdata_trydestroy(struct fuse_data *data)
 void
 fdata_set_dead(struct fuse_data *data)
 {
+    struct fuse_chan *chan;
+    int i;
+
     debug_printf("data=%p\n", data);
 
     FUSE_LOCK();
@@ -393,15 +1129,73 @@ fdata_set_dead(struct fuse_data *data)
         return;
     }
 
-    fuse_lck_mtx_lock(data->ms_mtx);
     data->dataflags |= FSESS_DEAD;
-    wakeup_one(data);
-    selwakeuppri(&data->ks_rsel, PZERO + 1);
     wakeup(&data->ticketer);
-    fuse_lck_mtx_unlock(data->ms_mtx);
+    /*
+     * Readers check for death under the channel lock before going to
+     * sleep, so passing through the lock is enough to not miss anyone.
+     */
+    for (i = 0; i < data->nchans; i++) {
+        chan = data->chans[i];
+        fuse_lck_mtx_lock(chan->ms_mtx);
+        wakeup(chan);
+        selwakeuppri(&chan->ks_rsel, PZERO + 1);
+        KNOTE_LOCKED(&chan->ks_rsel.si_note, 0);
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+    }
+    /* nor for the background queue to drain */
+    fuse_lck_mtx_lock(data->bg_mtx);
+    wakeup(&data->num_background);
+    fuse_lck_mtx_unlock(data->bg_mtx);
     FUSE_UNLOCK();
 }
 
+/*
+ * Fail every ticket which waits for an answer with err. Synchronous
+ * requesters are woken up, asynchronous ones get their completion called.
+ * To be used once the session is dead, so that no answer can come anymore.
+ */
+void
+fdata_abort_answers(struct fuse_data *data, int err)
+{
+    TAILQ_HEAD(, fuse_ticket) abort_head;
+    struct fuse_aw_bucket *awb;
+    struct fuse_ticket *ftick;
+    int i;
+
+    debug_printf("data=%p, err=%d\n", data, err);
+
+    MPASS(fdata_get_dead(data));
+
+    TAILQ_INIT(&abort_head);
+    for (i = 0; i < FUSE_AW_HASHSIZE; i++) {
+        awb = &data->aw_hash[i];
+        fuse_lck_mtx_lock(awb->awb_mtx);
+        while ((ftick = fuse_aw_pop(awb)))
+            TAILQ_INSERT_TAIL(&abort_head, ftick, tk_aw_link);
+        fuse_lck_mtx_unlock(awb->awb_mtx);
+    }
+
+    /* completions may take sleepable locks, so call them unlocked */
+    while ((ftick = TAILQ_FIRST(&abort_head))) {
+        TAILQ_REMOVE(&abort_head, ftick, tk_aw_link);
+#ifdef INVARIANTS
+        ftick->tk_aw_link.tqe_next = NULL;
+        ftick->tk_aw_link.tqe_prev = NULL;
+#endif
+        if (ftick->tk_aw_handler == fuse_async_handler) {
+            fuse_async_complete(ftick, err);
+        } else {
+            fuse_lck_mtx_lock(ftick->tk_aw_mtx);
+            fticket_set_answered(ftick);
+            ftick->tk_aw_errno = err;
+            wakeup(ftick);
+            fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+        }
+        fuse_ticket_drop(ftick);
+    }
+}
+
 struct fuse_ticket *
 fuse_ticket_fetch(struct fuse_data *data)
 {
@@ -411,17 +1205,22 @@ fuse_ticket_fetch(struct fuse_data *data)
     debug_printf("data=%p\n", data);
 
     ftick = fticket_alloc(data);
+    SDT_PROBE2(fuse, , ticket, fetch, ftick->tk_unique, data);
 
     if (!(data->dataflags & FSESS_INITED)) {
         /* Sleep until get answer for INIT messsage */
         FUSE_LOCK();
-        if (!(data->dataflags & FSESS_INITED) && data->ticketer > 2) {
+        if (!(data->dataflags & FSESS_INITED) &&
+            (data->dataflags & FSESS_INIT_SENT)) {
             err = msleep(&data->ticketer, &fuse_mtx, PCATCH | PDROP,
                          "fu_ini", 0);
             if (err)
                 fdata_set_dead(data);
-        } else
+        } else {
+            /* the first ticket is that of INIT */
+            data->dataflags |= FSESS_INIT_SENT;
             FUSE_UNLOCK();
+        }
     }
 
     return ftick;
@@ -434,15 +1233,46 @@ fuse_ticket_drop(struct fuse_ticket *ftick)
 
     die = refcount_release(&ftick->tk_refcount);
     debug_printf("ftick=%p refcount=%d\n", ftick, ftick->tk_refcount);
-    if (die)
+    if (die) {
+        FUSE_TICKET_PROBE(ticket, drop, ftick, ftick->tk_flag);
         fticket_destroy(ftick);
+    }
 
     return die;
 }
 
+/*
+ * Look up the ticket waiting for the answer with the given unique id and
+ * take it off the answer list. The reference of the list is passed over
+ * to the caller.
+ */
+struct fuse_ticket *
+fuse_aw_lookup(struct fuse_data *data, uint64_t unique)
+{
+    struct fuse_aw_bucket *awb;
+    struct fuse_ticket *ftick;
+
+    debug_printf("data=%p, unique=%ju\n", data, (uintmax_t)unique);
+
+    awb = fuse_aw_bucket(data, unique);
+
+    fuse_lck_mtx_lock(awb->awb_mtx);
+    TAILQ_FOREACH(ftick, &awb->awb_head, tk_aw_link) {
+        if (ftick->tk_unique == unique) {
+            fuse_aw_remove(ftick);
+            break;
+        }
+    }
+    fuse_lck_mtx_unlock(awb->awb_mtx);
+
+    return ftick;
+}
+
 void
 fuse_insert_callback(struct fuse_ticket *ftick, fuse_handler_t *handler)
 {
+    struct fuse_aw_bucket *awb;
+
     debug_printf("ftick=%p, handler=%p data=%p\n", ftick, ftick->tk_data, handler);
 
     if (fdata_get_dead(ftick->tk_data)) {
@@ -451,14 +1281,19 @@ fuse_insert_callback(struct fuse_ticket *ftick, fuse_handler_t *handler)
 
     ftick->tk_aw_handler = handler;
 
-    fuse_lck_mtx_lock(ftick->tk_data->aw_mtx);
+    awb = fuse_aw_bucket(ftick->tk_data, ftick->tk_unique);
+    fuse_lck_mtx_lock(awb->awb_mtx);
     fuse_aw_push(ftick);
-    fuse_lck_mtx_unlock(ftick->tk_data->aw_mtx);
+    fuse_lck_mtx_unlock(awb->awb_mtx);
 }
 
 void
 fuse_insert_message(struct fuse_ticket *ftick)
 {
+    struct fuse_chan *chan;
+    struct fuse_ring *ring;
+    uint32_t pos;
+
     debug_printf("ftick=%p\n", ftick);
 
     if (ftick->tk_flag & FT_DIRTY) {
@@ -471,11 +1306,282 @@ fuse_insert_message(struct fuse_ticket *ftick)
         return;
     }
 
-    fuse_lck_mtx_lock(ftick->tk_data->ms_mtx);
-    fuse_ms_push(ftick);
-    wakeup_one(ftick->tk_data);
-    selwakeuppri(&ftick->tk_data->ks_rsel, PZERO + 1);
-    fuse_lck_mtx_unlock(ftick->tk_data->ms_mtx);
+    chan = fchan_route(ftick);
+    fuse_stats_queued(ftick);
+    FUSE_TICKET_PROBE(ticket, queue, ftick, fticket_lane(ftick));
+
+    if (fuse_lockless_submit && chan->ch_ring == NULL) {
+        struct fuse_ms_head stale;
+
+        /*
+         * Readers who find the stage empty go to sleep, so only the
+         * message which makes it non-empty has to wake them up. The
+         * ticket is not to be touched once it's staged.
+         */
+        if (!fchan_stage(chan, ftick))
+            return;
+        /*
+         * The closing of an extra channel marks it and takes the stage
+         * in one go under the message list mutex. So if the mark is not
+         * there once we hold the mutex, the closing is yet to come and
+         * takes our message (and any staged after it) along. If it is
+         * there, the closing may have missed the message, and it's up
+         * to us to hand it over. Either way, whoever makes the stage
+         * non-empty afterwards goes through here too.
+         */
+        fuse_lck_mtx_lock(chan->ms_mtx);
+        if (chan->ch_flags & FCH_CLOSED) {
+            fuse_lck_mtx_unlock(chan->ms_mtx);
+            STAILQ_INIT(&stale);
+            fchan_handover(chan, &stale);
+            return;
+        }
+        fchan_notify(chan);
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+        return;
+    }
+
+    fuse_lck_mtx_lock(chan->ms_mtx);
+    if (chan->ch_flags & FCH_CLOSED) {
+        /* lost a race against the closing of an extra channel */
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+        chan = ftick->tk_data->chans[0];
+        fuse_lck_mtx_lock(chan->ms_mtx);
+    }
+    /* the ring is strictly FIFO, so control messages don't go there */
+    if ((ring = chan->ch_ring) == NULL ||
+        fticket_lane(ftick) == FUSE_LANE_CTL ||
+        fring_reserve(ring, ftick, &pos) != 0) {
+        fuse_ms_push(chan, ftick);
+        fchan_notify(chan);
+        fuse_lck_mtx_unlock(chan->ms_mtx);
+        return;
+    }
+    /* a slot can take a whole MAXPHYS write, so don't copy it locked */
+    fuse_lck_mtx_unlock(chan->ms_mtx);
+    fring_fill(ring, ftick, pos);
+    fuse_lck_mtx_lock(chan->ms_mtx);
+    if (fring_publish(ring, ftick, pos) == 0) {
+        fuse_stats_sent(ftick);
+        FUSE_TICKET_PROBE(device, read, ftick, fticket_lane(ftick));
+        fchan_notify(chan);
+    }
+    fuse_lck_mtx_unlock(chan->ms_mtx);
+}
+
+/*
+ * Send the message of ftick without waiting for the answer: done is called
+ * with arg once the answer has been processed, or the session has died.
+ * It's called exactly once, possibly from within this function, and in
+ * the context of the daemon's write(2) otherwise, so it must not sleep
+ * for long and must not expect any vnode to be locked.
+ *
+ * err is 0 if the answer has been pulled in, in which case the out header
+ * and the body are at hand through the ticket as usual. Otherwise it's the
+ * error sent by the daemon, the one which came up while processing the
+ * answer, or ENOTCONN if there will be no answer.
+ *
+ * The answer list holds a reference of its own on the ticket until done
+ * returns; the caller is still to drop hers (eg. by fdisp_destroy()).
+ */
+void
+fuse_ticket_submit_async(struct fuse_ticket *ftick, fuse_async_done_t *done,
+                         void *arg)
+{
+    struct fuse_data *data = ftick->tk_data;
+    struct fuse_aw_bucket *awb;
+
+    debug_printf("ftick=%p, done=%p, arg=%p\n", ftick, done, arg);
+
+    ftick->tk_async_done = done;
+    ftick->tk_async_arg = arg;
+
+    if (fdata_get_dead(data)) {
+        ftick->tk_flag |= FT_DIRTY;
+        fuse_async_complete(ftick, ENOTCONN);
+        return;
+    }
+
+    ftick->tk_aw_handler = fuse_async_handler;
+
+    awb = fuse_aw_bucket(data, ftick->tk_unique);
+    fuse_lck_mtx_lock(awb->awb_mtx);
+    fuse_aw_push(ftick);
+    fuse_lck_mtx_unlock(awb->awb_mtx);
+
+    fuse_insert_message(ftick);
+
+    /*
+     * If the session died meanwhile, the ticket may have missed the
+     * draining of the answer list. Whoever takes it off the list
+     * completes it.
+     */
+    if (fdata_get_dead(data) &&
+        (ftick = fuse_aw_lookup(data, ftick->tk_unique)) != NULL) {
+        fuse_async_complete(ftick, ENOTCONN);
+        fuse_ticket_drop(ftick);
+    }
+}
+
+/*
+ * Same as fuse_ticket_submit_async(), but for requests which are not
+ * waited for by anyone, eg. the write-out of asynchronous buffers. These
+ * count against the max_background limit of the session: we sleep until
+ * the number of outstanding ones goes below it. So this is not to be
+ * called from a completion routine, which would hold up the daemon.
+ *
+ * As with synchronous requests, the daemon is given daemon_timeout: that
+ * long we wait at most for our turn, and that long the request may be
+ * outstanding, else it's completed with ETIMEDOUT (see
+ * fdata_bg_timeout_task()). A signal cuts the wait short with EINTR.
+ */
+void
+fuse_ticket_submit_background(struct fuse_ticket *ftick,
+                              fuse_async_done_t *done, void *arg)
+{
+    struct fuse_data *data = ftick->tk_data;
+    int err = 0, timo, deadline;
+
+    debug_printf("ftick=%p, done=%p, arg=%p\n", ftick, done, arg);
+
+    deadline = ticks + data->daemon_timeout * hz;
+    fuse_lck_mtx_lock(data->bg_mtx);
+    while (data->num_background >= data->max_background &&
+           !fdata_get_dead(data) && err == 0) {
+        timo = 0;
+        if (data->daemon_timeout > 0 && (timo = deadline - ticks) <= 0) {
+            err = EWOULDBLOCK;
+            break;
+        }
+        err = msleep(&data->num_background, &data->bg_mtx, PCATCH | PVFS,
+                     "fu_bg", timo);
+    }
+    if (err == 0) {
+        data->num_background++;
+        if (data->daemon_timeout > 0 && !callout_pending(&data->bg_callout))
+            callout_reset(&data->bg_callout, hz, fdata_bg_timeout, data);
+    }
+    fuse_lck_mtx_unlock(data->bg_mtx);
+
+    if (err) {
+        ftick->tk_async_done = done;
+        ftick->tk_async_arg = arg;
+        ftick->tk_flag |= FT_DIRTY;
+        fuse_async_complete(ftick, err == EWOULDBLOCK ? ETIMEDOUT : EINTR);
+        return;
+    }
+
+    ftick->tk_flag |= FT_BG;
+    ftick->tk_bg_ticks = ticks;
+    fuse_ticket_submit_async(ftick, done, arg);
+}
+
+/*
+ * Writers which would add to the background load call this before they
+ * do, to wait while the session is congested, ie. more than
+ * congestion_threshold background requests are outstanding. So they are
+ * throttled by the pace of the daemon, instead of piling up dirty
+ * buffers, and foreground requests get through meanwhile.
+ *
+ * The count is peeked at unlocked first, so that writers of an
+ * uncongested session don't contend for the background mutex.
+ */
+int
+fdata_bg_throttle(struct fuse_data *data)
+{
+    int err = 0;
+
+    if (data->num_background < data->congestion_threshold)
+        return 0;
+
+    fuse_lck_mtx_lock(data->bg_mtx);
+    while (data->num_background >= data->congestion_threshold &&
+           !fdata_get_dead(data) && err == 0)
+        err = msleep(&data->num_background, &data->bg_mtx, PCATCH | PVFS,
+                     "fu_cong", 0);
+    fuse_lck_mtx_unlock(data->bg_mtx);
+
+    return err;
+}
+
+static void
+fdata_bg_done(struct fuse_data *data)
+{
+    fuse_lck_mtx_lock(data->bg_mtx);
+    MPASS(data->num_background > 0);
+    data->num_background--;
+    wakeup(&data->num_background);
+    fuse_lck_mtx_unlock(data->bg_mtx);
+}
+
+/*
+ * While background requests are outstanding, look for those which have
+ * been for longer than daemon_timeout once a second, and complete them
+ * with ETIMEDOUT. They are taken off the answer list, so an answer which
+ * comes in late is refused, as with synchronous requests. No INTERRUPT
+ * is sent, there would be nobody to reap it.
+ */
+static void
+fdata_bg_timeout_task(void *arg, int pending)
+{
+    struct fuse_data *data = arg;
+    TAILQ_HEAD(, fuse_ticket) expired;
+    struct fuse_aw_bucket *awb;
+    struct fuse_ticket *ftick, *next;
+    int i, timeout;
+
+    timeout = data->daemon_timeout * hz;
+    TAILQ_INIT(&expired);
+    for (i = 0; i < FUSE_AW_HASHSIZE; i++) {
+        awb = &data->aw_hash[i];
+        fuse_lck_mtx_lock(awb->awb_mtx);
+        TAILQ_FOREACH_SAFE(ftick, &awb->awb_head, tk_aw_link, next) {
+            if ((ftick->tk_flag & FT_BG) &&
+                ticks - ftick->tk_bg_ticks >= timeout) {
+                fuse_aw_remove(ftick);
+                TAILQ_INSERT_TAIL(&expired, ftick, tk_aw_link);
+            }
+        }
+        fuse_lck_mtx_unlock(awb->awb_mtx);
+    }
+
+    while ((ftick = TAILQ_FIRST(&expired))) {
+        TAILQ_REMOVE(&expired, ftick, tk_aw_link);
+#ifdef INVARIANTS
+        ftick->tk_aw_link.tqe_next = NULL;
+        ftick->tk_aw_link.tqe_prev = NULL;
+#endif
+        FUSE_TICKET_PROBE(ticket, timeout, ftick, data->daemon_timeout);
+        fuse_async_complete(ftick, ETIMEDOUT);
+        fuse_ticket_drop(ftick);
+    }
+
+    fuse_lck_mtx_lock(data->bg_mtx);
+    if (data->num_background > 0 && !fdata_get_dead(data))
+        callout_reset(&data->bg_callout, hz, fdata_bg_timeout, data);
+    fuse_lck_mtx_unlock(data->bg_mtx);
+}
+
+/* we can't sleep here, so look from the thread taskqueue */
+static void
+fdata_bg_timeout(void *arg)
+{
+    struct fuse_data *data = arg;
+
+    taskqueue_enqueue(taskqueue_thread, &data->bg_task);
+}
+
+/*
+ * Stop looking for timed out background requests, before the session
+ * goes away. It must be dead by then, so that no more are sent.
+ */
+void
+fdata_bg_drain(struct fuse_data *data)
+{
+    MPASS(fdata_get_dead(data));
+
+    callout_drain(&data->bg_callout);
+    taskqueue_drain(taskqueue_thread, &data->bg_task);
 }
 
 static int
@@ -497,6 +1603,10 @@ fuse_body_audit(struct fuse_ticket *ftick, size_t blen)
         panic("FUSE: a handler has been intalled for FUSE_FORGET");
         break;
 
+    case FUSE_BATCH_FORGET:
+        panic("FUSE: a handler has been intalled for FUSE_BATCH_FORGET");
+        break;
+
     case FUSE_GETATTR:
         err = (blen == sizeof(struct fuse_attr_out)) ? 0 : EINVAL;
         break;
@@ -553,7 +1663,7 @@ fuse_body_audit(struct fuse_ticket *ftick, size_t blen)
         break;
 
     case FUSE_STATFS:
-        if (fuse_libabi_geq(ftick->tk_data, 7, 4)) {
+        if (fuse_proto_geq(ftick->tk_data, 7, 4)) {
             err = (blen == sizeof(struct fuse_statfs_out)) ? 0 : EINVAL;
         } else {
             err = (blen == FUSE_COMPAT_STATFS_SIZE) ? 0 : EINVAL;
@@ -640,6 +1750,10 @@ fuse_body_audit(struct fuse_ticket *ftick, size_t blen)
         err = (blen == 0) ? 0 : EINVAL;
         break;
 
+    case FUSE_INTERRUPT:
+        err = (blen == 0) ? 0 : EINVAL;
+        break;
+
     default:
         panic("FUSE: opcodes out of sync (%d)\n", opcode);
     }
@@ -679,24 +1793,182 @@ static int
 fuse_standard_handler(struct fuse_ticket *ftick, struct uio *uio)
 {
     int err = 0;
+    uint64_t iunique;
 
     debug_printf("ftick=%p, uio=%p\n", ftick, uio);
 
+    if (ftick->tk_aw_type == FT_A_BUF) {
+        /*
+         * tk_aw_bufdata belongs to the requester, so it's only to be
+         * written as long as she is waiting.
+         */
+        fuse_lck_mtx_lock(ftick->tk_aw_mtx);
+        if (fticket_answered(ftick)) {
+            iunique = fticket_intr_clear(ftick);
+            fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+            if (iunique)
+                fuse_interrupt_reap(ftick->tk_data, iunique);
+            return 0;
+        }
+        ftick->tk_flag |= FT_PULLING;
+        fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+    }
+
     err = fticket_pull(ftick, uio);
 
     fuse_lck_mtx_lock(ftick->tk_aw_mtx);
 
+    if (ftick->tk_flag & FT_PULLING) {
+        ftick->tk_flag &= ~FT_PULLING;
+        MPASS(!fticket_answered(ftick));
+    }
+
     if (!fticket_answered(ftick)) {
         fticket_set_answered(ftick);
         ftick->tk_aw_errno = err;
         wakeup(ftick);
     }
+    iunique = fticket_intr_clear(ftick);
 
     fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
 
+    if (iunique)
+        fuse_interrupt_reap(ftick->tk_data, iunique);
+
+    return err;
+}
+
+static void
+fuse_async_complete(struct fuse_ticket *ftick, int err)
+{
+    debug_printf("ftick=%p, err=%d\n", ftick, err);
+
+    fuse_lck_mtx_lock(ftick->tk_aw_mtx);
+    MPASS(!fticket_answered(ftick));
+    /* the buffer of the message is given back to the sender by done */
+    fticket_ms_abandon(ftick);
+    fticket_set_answered(ftick);
+    ftick->tk_aw_errno = err;
+    fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+
+    ftick->tk_async_done(ftick, ftick->tk_async_arg, err);
+
+    if (ftick->tk_flag & FT_BG)
+        fdata_bg_done(ftick->tk_data);
+}
+
+static int
+fuse_async_handler(struct fuse_ticket *ftick, struct uio *uio)
+{
+    int err = 0;
+
+    debug_printf("ftick=%p, uio=%p\n", ftick, uio);
+
+    err = fticket_pull(ftick, uio);
+    fuse_async_complete(ftick, err ? err : ftick->tk_aw_ohead.error);
+
     return err;
 }
 
+/*
+ * Interrupts.
+ *
+ * When the requester of a ticket gives up on waiting, an INTERRUPT is
+ * queued ahead of everything else, so that the daemon can abandon the
+ * request. The INTERRUPT is not answered unless the daemon can't handle
+ * it yet (EAGAIN, eg. if it has not read the request yet), in which case
+ * it's sent anew as long as the request is outstanding, or not at all
+ * (ENOSYS), in which case we stop sending them. So the INTERRUPT ticket
+ * is taken off the answer list by the handler of the interrupted request.
+ */
+
+static void
+fuse_interrupt_reap(struct fuse_data *data, uint64_t unique)
+{
+    struct fuse_ticket *itick;
+
+    if ((itick = fuse_aw_lookup(data, unique)) != NULL) {
+        fuse_async_complete(itick, ECANCELED);
+        fuse_ticket_drop(itick);
+    }
+}
+
+static void
+fuse_interrupt_done(struct fuse_ticket *itick, void *arg, int err)
+{
+    struct fuse_data *data = itick->tk_data;
+    struct fuse_interrupt_in *fii;
+    struct fuse_aw_bucket *awb;
+    struct fuse_ticket *otick;
+
+    debug_printf("itick=%p, err=%d\n", itick, err);
+
+    switch (err) {
+    case ENOSYS:
+        data->notimpl |= (1ULL << FUSE_INTERRUPT);
+        break;
+    case EAGAIN:
+        fii = (struct fuse_interrupt_in *)
+              ((struct fuse_in_header *)itick->tk_ms_fiov.base + 1);
+        awb = fuse_aw_bucket(data, fii->unique);
+        fuse_lck_mtx_lock(awb->awb_mtx);
+        TAILQ_FOREACH(otick, &awb->awb_head, tk_aw_link) {
+            if (otick->tk_unique == fii->unique) {
+                refcount_acquire(&otick->tk_refcount);
+                break;
+            }
+        }
+        fuse_lck_mtx_unlock(awb->awb_mtx);
+        if (otick) {
+            /* still outstanding, try again */
+            fuse_interrupt_send(otick);
+            fuse_ticket_drop(otick);
+        }
+        break;
+    }
+}
+
+static void
+fuse_interrupt_send(struct fuse_ticket *otick)
+{
+    struct fuse_data *data = otick->tk_data;
+    struct fuse_interrupt_in *fii;
+    struct fuse_dispatcher fdi;
+    uint64_t iunique;
+    int stale;
+
+    debug_printf("otick=%p\n", otick);
+
+    if (data->notimpl & (1ULL << FUSE_INTERRUPT) || fdata_get_dead(data))
+        return;
+
+    fdisp_init(&fdi, sizeof(*fii));
+    fdi.tick = fuse_ticket_fetch(data);
+    FUSE_DIMALLOC(&fdi.tick->tk_ms_fiov, fdi.finh, fdi.indata, fdi.iosize);
+    fuse_setup_ihead(fdi.finh, fdi.tick, 0, FUSE_INTERRUPT, fdi.iosize,
+                     ((struct fuse_in_header *)otick->tk_ms_fiov.base)->pid,
+                     curthread->td_ucred);
+
+    fii = fdi.indata;
+    fii->unique = otick->tk_unique;
+
+    iunique = fdi.tick->tk_unique;
+    fuse_ticket_submit_async(fdi.tick, fuse_interrupt_done, NULL);
+    fdisp_destroy(&fdi);
+
+    /*
+     * If the answer of the request has come in meanwhile, its handler
+     * has missed our INTERRUPT, so take care of it here.
+     */
+    fuse_lck_mtx_lock(otick->tk_aw_mtx);
+    if ((stale = !(otick->tk_flag & FT_INTR)) == 0)
+        otick->tk_interrupt = iunique;
+    fuse_lck_mtx_unlock(otick->tk_aw_mtx);
+
+    if (stale)
+        fuse_interrupt_reap(data, iunique);
+}
+
 void
 fdisp_make_pid(struct fuse_dispatcher *fdip,
                enum fuse_opcode op,
@@ -748,41 +2020,87 @@ fdisp_make_vp(struct fuse_dispatcher *fdip,
                           td->td_proc->p_pid, cred);
 }
 
-int
-fdisp_wait_answ(struct fuse_dispatcher *fdip)
+/*
+ * fdisp_wait_answ() comes in two halves, so that a requester can have
+ * several messages outstanding: fdisp_send() passes on the message,
+ * fdisp_wait_sent() waits for the answer (and processes it the same way).
+ * Each message sent so is to be either waited for or cancelled.
+ */
+void
+fdisp_send(struct fuse_dispatcher *fdip)
 {
-    int err = 0;
-
     fdip->answ_stat = 0;
     fuse_insert_callback(fdip->tick, fuse_standard_handler);
     fuse_insert_message(fdip->tick);
+}
+
+int
+fdisp_wait_answ(struct fuse_dispatcher *fdip)
+{
+    fdisp_send(fdip);
+
+    return fdisp_wait_sent(fdip);
+}
+
+/*
+ * Give up on the answer of a sent message. Once this returns, the handler
+ * won't touch the buffers of the requester any more, and the daemon is
+ * asked to abandon the request unless it has not got it at all. Returns 0
+ * if the answer has come in meanwhile (which is then at hand as usual),
+ * ECANCELED otherwise.
+ */
+int
+fdisp_cancel(struct fuse_dispatcher *fdip)
+{
+    fuse_lck_mtx_lock(fdip->tick->tk_aw_mtx);
+
+    while (fdip->tick->tk_flag & FT_PULLING)
+        msleep(fdip->tick, &fdip->tick->tk_aw_mtx, 0, "fu_pull", 0);
+    fticket_ms_abandon(fdip->tick);
+
+    if (fticket_answered(fdip->tick)) {
+        /*
+         * Just between deciding to give up and getting here, the
+         * standard handler has completed his job.
+         */
+        debug_printf("IPC: already answered\n");
+        fuse_lck_mtx_unlock(fdip->tick->tk_aw_mtx);
+        return 0;
+    }
+
+    /*
+     * So we were faster than the standard handler. Then by setting the
+     * answered flag we get *him* to drop the ticket.
+     */
+    debug_printf("IPC: setting to answered\n");
+    fticket_set_answered(fdip->tick);
+    if (fdip->tick->tk_flag & FT_MSDROP) {
+        /* the message won't ever get to the daemon */
+        fuse_lck_mtx_unlock(fdip->tick->tk_aw_mtx);
+        return ECANCELED;
+    }
+    fdip->tick->tk_flag |= FT_INTR;
+    fuse_lck_mtx_unlock(fdip->tick->tk_aw_mtx);
+    /* let the daemon know she can give up too */
+    fuse_interrupt_send(fdip->tick);
+
+    return ECANCELED;
+}
+
+int
+fdisp_wait_sent(struct fuse_dispatcher *fdip)
+{
+    int err = 0;
 
     if ((err = fticket_wait_answer(fdip->tick))) { // interrupted
 
         debug_printf("IPC: interrupted, err = %d\n", err);
 
-        fuse_lck_mtx_lock(fdip->tick->tk_aw_mtx);
-
-        if (fticket_answered(fdip->tick)) {
-            /*
-             * Just between noticing the interrupt and getting here,
-             * the standard handler has completed his job.
-             * So we drop the ticket and exit as usual.
-             */
-            debug_printf("IPC: already answered\n");
-            fuse_lck_mtx_unlock(fdip->tick->tk_aw_mtx);
+        if (fdisp_cancel(fdip) == 0) {
+            /* we drop the ticket and exit as usual */
             goto out;
-        } else {
-            /*
-             * So we were faster than the standard handler.
-             * Then by setting the answered flag we get *him*
-             * to drop the ticket.
-             */
-            debug_printf("IPC: setting to answered\n");
-            fticket_set_answered(fdip->tick);
-            fuse_lck_mtx_unlock(fdip->tick->tk_aw_mtx);
-            return err;
         }
+        return err;
     }
 
     debug_printf("IPC: not interrupted, err = %d\n", err);
@@ -810,8 +2128,13 @@ fdisp_wait_answ(struct fuse_dispatcher *fdip)
         goto out;
     }
 
-    fdip->answ = fticket_resp(fdip->tick)->base;
-    fdip->iosize = fticket_resp(fdip->tick)->len;
+    if (fdip->tick->tk_aw_type == FT_A_BUF) {
+        fdip->answ = fdip->tick->tk_aw_bufdata;
+        fdip->iosize = fdip->tick->tk_aw_bufsize;
+    } else {
+        fdip->answ = fticket_resp(fdip->tick)->base;
+        fdip->iosize = fticket_resp(fdip->tick)->len;
+    }
 
     debug_printf("IPC: all is well\n");
 
@@ -826,6 +2149,13 @@ out:
 void
 fuse_ipc_init(void)
 {
+    int class;
+
+    for (class = 0; class < FIOV_NCLASSES; class++)
+        fiov_classes[class].fc_zone = uma_zcreate(
+            fiov_classes[class].fc_name, fiov_classes[class].fc_size,
+            NULL, NULL, NULL, NULL, UMA_ALIGN_CACHE, 0);
+    fuse_ticket_count = counter_u64_alloc(M_WAITOK);
     ticket_zone = uma_zcreate("fuse_ticket", sizeof(struct fuse_ticket),
         fticket_ctor, fticket_dtor, fticket_init, fticket_fini,
         UMA_ALIGN_PTR, 0);
@@ -834,5 +2164,10 @@ fuse_ipc_init(void)
 void
 fuse_ipc_destroy(void)
 {
+    int class;
+
     uma_zdestroy(ticket_zone);
+    counter_u64_free(fuse_ticket_count);
+    for (class = 0; class < FIOV_NCLASSES; class++)
+        uma_zdestroy(fiov_classes[class].fc_zone);
 }
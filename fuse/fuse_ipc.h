@@ -10,12 +10,14 @@
 
 #include <sys/param.h>
 #include <sys/refcount.h>
+#include <sys/_callout.h>
+#include <sys/_task.h>
 
 struct fuse_iov {
     void   *base;
     size_t  len;
     size_t  allocated_size;
-    int     credit;
+    int     class;
 };
 
 void fiov_init(struct fuse_iov *fiov, size_t size);
@@ -26,6 +28,7 @@ void fiov_adjust(struct fuse_iov *fiov, size_t size);
 #define FUSE_DIMALLOC(fiov, spc1, spc2, amnt)          \
 do {                                                   \
     fiov_adjust(fiov, (sizeof(*(spc1)) + (amnt)));     \
+    bzero((fiov)->base, (fiov)->len);                  \
     (spc1) = (fiov)->base;                             \
     (spc2) = (char *)(fiov)->base + (sizeof(*(spc1))); \
 } while (0)
@@ -43,8 +46,11 @@ do {                                                   \
 
 struct fuse_ticket;
 struct fuse_data;
+struct fuse_stats;
+struct fuse_ring;
 
 typedef int fuse_handler_t(struct fuse_ticket *ftick, struct uio *uio);
+typedef void fuse_async_done_t(struct fuse_ticket *ftick, void *arg, int err);
 
 struct fuse_ticket {
     /* fields giving the identity of the ticket */
@@ -59,6 +65,8 @@ struct fuse_ticket {
     size_t                       tk_ms_bufsize;
     enum { FT_M_FIOV, FT_M_BUF } tk_ms_type;
     STAILQ_ENTRY(fuse_ticket)    tk_ms_link;
+    int                          tk_ms_lane;
+    int                          tk_ms_ticks;  /* when queued, or popped */
 
     /* fields for handling answers coming from userspace */
     struct fuse_iov              tk_aw_fiov;
@@ -71,10 +79,29 @@ struct fuse_ticket {
     struct mtx                   tk_aw_mtx;
     fuse_handler_t              *tk_aw_handler;
     TAILQ_ENTRY(fuse_ticket)     tk_aw_link;
+    uint64_t                     tk_interrupt; /* unique of our INTERRUPT */
+
+    /* timestamps for the statistics, see fuse_stats.h */
+    uint64_t                     tk_ts_queued;
+    uint64_t                     tk_ts_sent;
+
+    /* completion of asynchronously submitted tickets */
+    fuse_async_done_t           *tk_async_done;
+    void                        *tk_async_arg;
+    int                          tk_bg_ticks;  /* when sent in background */
+
+    SLIST_ENTRY(fuse_ticket)     tk_free_link; /* on a per cpu cache */
 };
 
-#define FT_ANSW  0x01  // request of ticket has already been answered
-#define FT_DIRTY 0x04  // ticket has been used
+#define FT_ANSW    0x01  // request of ticket has already been answered
+#define FT_DIRTY   0x04  // ticket has been used
+#define FT_PULLING 0x08  // answer is being copied to tk_aw_bufdata
+#define FT_MSCOPY  0x10  // message is being copied from tk_ms_bufdata
+#define FT_MSSENT  0x20  // message has been passed to the daemon
+#define FT_MSWANT  0x40  // somebody waits for FT_MSCOPY to clear
+#define FT_MSDROP  0x80  // sender is gone, tk_ms_bufdata is not to be used
+#define FT_INTR    0x100 // requester is gone, an INTERRUPT has been sent
+#define FT_BG      0x200 // counts against the background limit
 
 static __inline__
 struct fuse_iov *
@@ -109,10 +136,104 @@ fticket_opcode(struct fuse_ticket *ftick)
     return (((struct fuse_in_header *)(ftick->tk_ms_fiov.base))->opcode);
 }
 
+static __inline__
+size_t
+fticket_ms_len(struct fuse_ticket *ftick)
+{
+    return (ftick->tk_ms_fiov.len +
+        (ftick->tk_ms_type == FT_M_BUF ? ftick->tk_ms_bufsize : 0));
+}
+
 int fticket_pull(struct fuse_ticket *ftick, struct uio *uio);
+int fticket_ms_claim(struct fuse_ticket *ftick);
+void fticket_ms_release(struct fuse_ticket *ftick, int sent);
 
 enum mountpri { FM_NOMOUNTED, FM_PRIMARY, FM_SECONDARY };
 
+/*
+ * Tickets waiting for an answer are hashed by their unique id, so that
+ * matching a reply to its ticket does not need a walk over all the
+ * outstanding requests. Unique ids are handed out sequentially, so the
+ * low bits spread them evenly. Each bucket has its own lock.
+ */
+#define FUSE_AW_HASHSIZE 64 /* must be a power of two */
+
+struct fuse_aw_bucket {
+    struct mtx                 awb_mtx;
+    TAILQ_HEAD(, fuse_ticket)  awb_head;
+} __aligned(CACHE_LINE_SIZE);
+
+/*
+ * A channel is an open fuse device a session is served through. Each
+ * channel has its own queue of messages to be read by the daemon. The
+ * device the session was opened on is the primary channel (chans[0]);
+ * the daemon can attach further devices as extra channels.
+ */
+#define FUSE_MAXCHANS 64
+
+/* max number of FORGETs sent in a BATCH_FORGET */
+#define FUSE_FORGET_BATCH 128
+
+/*
+ * The message queue of a channel is made of priority lanes. Control
+ * messages (INTERRUPT, FORGET) are always passed up first; metadata and
+ * data requests take turns by the weights of their lanes (see the
+ * vfs.fuse.lane sysctls), so that bulk I/O can't hold up a LOOKUP for
+ * long.
+ */
+#define FUSE_LANE_CTL  0
+#define FUSE_LANE_META 1
+#define FUSE_LANE_DATA 2
+#define FUSE_NLANES    3
+
+STAILQ_HEAD(fuse_ms_head, fuse_ticket);
+
+struct fuse_ms_lane {
+    struct fuse_ms_head        ml_head;
+    int                        ml_credit;  /* turns left in this round */
+
+    /* statistics, exported per mount by fuse_stats_attach() */
+    u_long                     ml_depth;   /* messages on the lane */
+    u_long                     ml_count;   /* messages taken off */
+    u_long                     ml_wait;    /* usecs they spent on it */
+    u_long                     ml_maxwait; /* most usecs spent by one */
+};
+
+struct fuse_chan {
+    struct fuse_data          *ch_data;
+    struct cdev               *ch_dev;
+    int                        ch_flags;
+
+    int                        ch_feat;
+
+    struct mtx                 ms_mtx;
+    struct fuse_ms_lane        ms_lane[FUSE_NLANES];
+    int                        ms_count;
+    struct fuse_ticket *volatile ch_stage; /* see fchan_stage() */
+    struct fuse_ring          *ch_ring;
+
+    int                        ch_sleepers; /* readers asleep on chan */
+    int                        ch_spinning; /* a reader spins for news */
+
+    struct selinfo             ks_rsel;
+} __aligned(CACHE_LINE_SIZE);
+
+#define FCH_CLOSED 0x01 // channel device has been closed
+
+/*
+ * Per cpu ticket cache of a session: the unique ids are taken from the
+ * session in ranges, and released tickets are kept for reuse, with their
+ * buffers. Only to be touched in a critical section on the given cpu.
+ */
+#define FUSE_UNIQUE_BATCH 256
+
+struct fuse_pcpu {
+    u_long                     pc_unique;
+    u_long                     pc_unique_end;
+    SLIST_HEAD(, fuse_ticket)  pc_free;
+    u_int                      pc_nfree;
+} __aligned(CACHE_LINE_SIZE);
+
 /*
  * The data representing a FUSE session.
  */
@@ -123,13 +244,12 @@ struct fuse_data {
     struct ucred              *daemoncred;
     int                        dataflags;
 
-    struct mtx                 ms_mtx;
-    STAILQ_HEAD(, fuse_ticket) ms_head;
-
-    struct mtx                 aw_mtx;
-    TAILQ_HEAD(, fuse_ticket)  aw_head;
+    struct fuse_chan          *chans[FUSE_MAXCHANS];
+    int                        nchans;
 
-    u_long                     ticketer;
+    u_long                     ticketer;    /* next range of uniques */
+    struct fuse_pcpu          *pcpu;        /* [mp_maxid + 1] */
+    u_int                      pcpu_max_free;
 
     struct sx                  rename_lock;
 
@@ -138,13 +258,31 @@ struct fuse_data {
 
     uint32_t                   max_write;
     uint32_t                   max_read;
+    uint32_t                   max_readahead;
     uint32_t                   subtype;
     char                       volname[MAXPATHLEN];
 
-    struct selinfo ks_rsel;
-
     int                        daemon_timeout;
     uint64_t                   notimpl;
+
+    struct fuse_aw_bucket      aw_hash[FUSE_AW_HASHSIZE];
+
+    /* background requests, see fuse_ticket_submit_background() */
+    struct mtx                 bg_mtx;
+    u_int                      max_background;
+    u_int                      congestion_threshold;
+    u_int                      num_background;
+    struct callout             bg_callout;  /* times out background ones */
+    struct task                bg_task;
+
+    /* FORGETs held back to be sent in a BATCH_FORGET */
+    struct sx                  forget_lock;
+    u_int                      forget_count;
+    struct fuse_forget_one     forget_buf[FUSE_FORGET_BATCH];
+    struct callout             forget_callout;
+    struct task                forget_task;
+
+    struct fuse_stats         *stats;   /* NULL if not kept */
 };
 
 #define FSESS_DEAD                0x0001 // session is to be closed
@@ -160,6 +298,11 @@ struct fuse_data {
 #define FSESS_NO_NAMECACHE        0x0400 // disable name cache
 #define FSESS_NO_MMAP             0x0800 // disable mmap
 #define FSESS_BROKENIO            0x1000 // fix broken io
+#define FSESS_BATCH_FORGET        0x2000 // daemon takes BATCH_FORGETs
+#define FSESS_MAX_BACKGROUND_SET  0x4000 // max_background set on mount
+#define FSESS_CONGESTION_SET      0x8000 // congestion_threshold set on mount
+#define FSESS_INIT_SENT           0x10000 // INIT ticket has been fetched
+#define FSESS_WRITEBACK_CACHE     0x20000 // delay writes in the buffer cache
 
 extern int fuse_data_cache_enable;
 extern int fuse_data_cache_invalidate;
@@ -174,6 +317,13 @@ fuse_get_devdata(struct cdev *fdev)
     return fdev->si_drv1;
 }
 
+static __inline__
+struct fuse_chan *
+fuse_get_devchan(struct cdev *fdev)
+{
+    return fdev->si_drv2;
+}
+
 static __inline__
 struct fuse_data *
 fuse_get_mpdata(struct mount *mp)
@@ -217,62 +367,60 @@ fsess_opt_mmap(struct mount *mp)
 }
 
 static __inline int
-fsess_opt_brokenio(struct mount *mp)
+fsess_opt_writeback(struct mount *mp)
 {
     struct fuse_data *data = fuse_get_mpdata(mp);
 
-    return (fuse_fix_broken_io || (data->dataflags & FSESS_BROKENIO));
+    return (fsess_opt_datacache(mp) &&
+        (data->dataflags & FSESS_WRITEBACK_CACHE) != 0);
 }
 
-static __inline__
-void
-fuse_ms_push(struct fuse_ticket *ftick)
+static __inline int
+fsess_opt_brokenio(struct mount *mp)
 {
-    DEBUGX(FUSE_DEBUG_IPC, "ftick=%p refcount=%d\n",
-        ftick, ftick->tk_refcount + 1);
-    mtx_assert(&ftick->tk_data->ms_mtx, MA_OWNED);
-    refcount_acquire(&ftick->tk_refcount);
-    STAILQ_INSERT_TAIL(&ftick->tk_data->ms_head, ftick, tk_ms_link);
+    struct fuse_data *data = fuse_get_mpdata(mp);
+
+    return (fuse_fix_broken_io || (data->dataflags & FSESS_BROKENIO));
 }
 
+void fuse_ms_push(struct fuse_chan *chan, struct fuse_ticket *ftick);
+int fuse_ms_count(struct fuse_chan *chan);
+struct fuse_ticket *fuse_ms_peek(struct fuse_chan *chan);
+struct fuse_ticket *fuse_ms_pop(struct fuse_chan *chan);
+void fuse_ms_requeue(struct fuse_chan *chan, struct fuse_ms_head *head);
+
 static __inline__
-struct fuse_ticket *
-fuse_ms_pop(struct fuse_data *data)
+struct fuse_aw_bucket *
+fuse_aw_bucket(struct fuse_data *data, uint64_t unique)
 {
-    struct fuse_ticket *ftick = NULL;
-
-    mtx_assert(&data->ms_mtx, MA_OWNED);
-
-    if ((ftick = STAILQ_FIRST(&data->ms_head))) {
-        STAILQ_REMOVE_HEAD(&data->ms_head, tk_ms_link);
-#ifdef INVARIANTS
-        ftick->tk_ms_link.stqe_next = NULL;
-#endif
-    }
-    DEBUGX(FUSE_DEBUG_IPC, "ftick=%p refcount=%d\n",
-        ftick, ftick ? ftick->tk_refcount : -1);
-
-    return ftick;
+    return (&data->aw_hash[unique & (FUSE_AW_HASHSIZE - 1)]);
 }
 
 static __inline__
 void
 fuse_aw_push(struct fuse_ticket *ftick)
 {
+    struct fuse_aw_bucket *awb;
+
     DEBUGX(FUSE_DEBUG_IPC, "ftick=%p refcount=%d\n",
         ftick, ftick->tk_refcount + 1);
-    mtx_assert(&ftick->tk_data->aw_mtx, MA_OWNED);
+    awb = fuse_aw_bucket(ftick->tk_data, ftick->tk_unique);
+    mtx_assert(&awb->awb_mtx, MA_OWNED);
     refcount_acquire(&ftick->tk_refcount);
-    TAILQ_INSERT_TAIL(&ftick->tk_data->aw_head, ftick, tk_aw_link);
+    TAILQ_INSERT_TAIL(&awb->awb_head, ftick, tk_aw_link);
 }
 
 static __inline__
 void
 fuse_aw_remove(struct fuse_ticket *ftick)
 {
+    struct fuse_aw_bucket *awb;
+
     DEBUGX(FUSE_DEBUG_IPC, "ftick=%p refcount=%d\n",
         ftick, ftick->tk_refcount);
-    TAILQ_REMOVE(&ftick->tk_data->aw_head, ftick, tk_aw_link);
+    awb = fuse_aw_bucket(ftick->tk_data, ftick->tk_unique);
+    mtx_assert(&awb->awb_mtx, MA_OWNED);
+    TAILQ_REMOVE(&awb->awb_head, ftick, tk_aw_link);
 #ifdef INVARIANTS
     ftick->tk_aw_link.tqe_next = NULL;
     ftick->tk_aw_link.tqe_prev = NULL;
@@ -281,13 +429,13 @@ fuse_aw_remove(struct fuse_ticket *ftick)
 
 static __inline__
 struct fuse_ticket *
-fuse_aw_pop(struct fuse_data *data)
+fuse_aw_pop(struct fuse_aw_bucket *awb)
 {
     struct fuse_ticket *ftick = NULL;
 
-    mtx_assert(&data->aw_mtx, MA_OWNED);
+    mtx_assert(&awb->awb_mtx, MA_OWNED);
 
-    if ((ftick = TAILQ_FIRST(&data->aw_head))) {
+    if ((ftick = TAILQ_FIRST(&awb->awb_head))) {
         fuse_aw_remove(ftick);
     }
     DEBUGX(FUSE_DEBUG_IPC, "ftick=%p refcount=%d\n",
@@ -296,10 +444,18 @@ fuse_aw_pop(struct fuse_data *data)
     return ftick;
 }
 
+struct fuse_ticket *fuse_aw_lookup(struct fuse_data *data, uint64_t unique);
+
 struct fuse_ticket *fuse_ticket_fetch(struct fuse_data *data);
 int fuse_ticket_drop(struct fuse_ticket *ftick);
 void fuse_insert_callback(struct fuse_ticket *ftick, fuse_handler_t *handler);
 void fuse_insert_message(struct fuse_ticket *ftick);
+void fuse_ticket_submit_async(struct fuse_ticket *ftick,
+                              fuse_async_done_t *done, void *arg);
+void fuse_ticket_submit_background(struct fuse_ticket *ftick,
+                                   fuse_async_done_t *done, void *arg);
+int  fdata_bg_throttle(struct fuse_data *data);
+void fdata_bg_drain(struct fuse_data *data);
 
 static __inline__
 int
@@ -309,9 +465,29 @@ fuse_libabi_geq(struct fuse_data *data, uint32_t abi_maj, uint32_t abi_min)
             (data->fuse_libabi_major == abi_maj && data->fuse_libabi_minor >= abi_min));
 }
 
+/*
+ * The daemon answers INIT with the version it speaks, which may be above
+ * the one we offered; the session speaks the lower of the two.
+ */
+static __inline__
+int
+fuse_proto_geq(struct fuse_data *data, uint32_t abi_maj, uint32_t abi_min)
+{
+    return (FUSE_KERNELABI_GEQ(abi_maj, abi_min) &&
+            fuse_libabi_geq(data, abi_maj, abi_min));
+}
+
+struct fuse_chan *fchan_alloc(struct fuse_data *data, struct cdev *dev);
+void fchan_destroy(struct fuse_chan *chan);
+void fchan_close(struct fuse_chan *chan);
+void fchan_notify(struct fuse_chan *chan);
+int  fdata_attach_chan(struct fuse_data *data, struct fuse_chan *chan);
+
 struct fuse_data *fdata_alloc(struct cdev *dev, struct ucred *cred);
 void fdata_trydestroy(struct fuse_data *data);
+void fdata_set_max_free_tickets(struct fuse_data *data, u_int max);
 void fdata_set_dead(struct fuse_data *data);
+void fdata_abort_answers(struct fuse_data *data, int err);
 
 static __inline__
 int
@@ -364,6 +540,9 @@ void fdisp_make_vp(struct fuse_dispatcher *fdip, enum fuse_opcode op,
                    struct vnode *vp, struct thread *td, struct ucred *cred);
 
 int  fdisp_wait_answ(struct fuse_dispatcher *fdip);
+void fdisp_send(struct fuse_dispatcher *fdip);
+int  fdisp_wait_sent(struct fuse_dispatcher *fdip);
+int  fdisp_cancel(struct fuse_dispatcher *fdip);
 
 static __inline__
 int
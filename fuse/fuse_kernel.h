@@ -36,7 +36,9 @@
 #include <sys/types.h>
 #define __u64 uint64_t
 #define __u32 uint32_t
+#define __u16 uint16_t
 #define __s32 int32_t
+#define __s64 int64_t
 #else
 #include <asm/types.h>
 #include <linux/major.h>
@@ -45,7 +47,15 @@
 /** Version number of this interface */
 #define FUSE_KERNEL_VERSION 7
 
-/** Minor version number of this interface */
+/**
+ * Minor version number of this interface
+ *
+ * The messages we build still have the 7.8 layout, so that's what we offer
+ * in INIT.  A daemon answers with min(this, its own minor), hence anything
+ * it may only use from a later minor on (notifications: 7.12, background
+ * limits in fuse_init_out: 7.13, BATCH_FORGET: 7.16) is never used by
+ * libfuse based daemons until this is raised along with those layouts.
+ */
 #define FUSE_KERNEL_MINOR_VERSION 8
 
 /** The node ID of the root inode */
@@ -119,9 +129,12 @@ struct fuse_file_lock {
 
 /**
  * INIT request/reply flags
+ *
+ * FUSE_WRITEBACK_CACHE: use writeback cache for buffered writes (7.23)
  */
 #define FUSE_ASYNC_READ		(1 << 0)
 #define FUSE_POSIX_LOCKS	(1 << 1)
+#define FUSE_WRITEBACK_CACHE	(1 << 16)
 
 /**
  * Release flags
@@ -165,6 +178,18 @@ enum fuse_opcode {
 	FUSE_INTERRUPT     = 36,
 	FUSE_BMAP          = 37,
 	FUSE_DESTROY       = 38,
+	FUSE_BATCH_FORGET  = 42,  /* no reply, since 7.16 */
+};
+
+/*
+ * Messages the daemon sends on its own, with a zero unique and the code
+ * in the error field of the out header (since 7.12)
+ */
+enum fuse_notify_code {
+	FUSE_NOTIFY_POLL   = 1,
+	FUSE_NOTIFY_INVAL_INODE = 2,
+	FUSE_NOTIFY_INVAL_ENTRY = 3,
+	FUSE_NOTIFY_CODE_MAX,
 };
 
 /* The read buffer is required to be at least 8k, but may be much larger */
@@ -185,6 +210,16 @@ struct fuse_forget_in {
 	__u64	nlookup;
 };
 
+struct fuse_forget_one {
+	__u64	nodeid;
+	__u64	nlookup;
+};
+
+struct fuse_batch_forget_in {
+	__u32	count;
+	__u32	dummy;
+};
+
 struct fuse_attr_out {
 	__u64	attr_valid;	/* Cache timeout for the attributes */
 	__u32	attr_valid_nsec;
@@ -327,7 +362,8 @@ struct fuse_init_out {
 	__u32	minor;
 	__u32	max_readahead;
 	__u32	flags;
-	__u32	unused;
+	__u16	max_background;		/* since 7.13, unused before */
+	__u16	congestion_threshold;	/* since 7.13, unused before */
 	__u32	max_write;
 };
 
@@ -362,6 +398,18 @@ struct fuse_out_header {
 	__u64	unique;
 };
 
+struct fuse_notify_inval_inode_out {
+	__u64	ino;
+	__s64	off;
+	__s64	len;
+};
+
+struct fuse_notify_inval_entry_out {
+	__u64	parent;
+	__u32	namelen;
+	__u32	padding;
+};
+
 struct fuse_dirent {
 	__u64	ino;
 	__u64	off;
@@ -20,6 +20,7 @@
 #include <sys/sysctl.h>
 
 #include "fuse.h"
+#include "fuse_sdt.h"
 
 static void			 fuse_bringdown(eventhandler_tag eh_tag);
 static int			 fuse_loader(struct module *m, int what, void *arg);
@@ -49,6 +50,29 @@ SYSCTL_INT(_vfs_fuse, OID_AUTO, kernelabi_major, CTLFLAG_RD,
 SYSCTL_INT(_vfs_fuse, OID_AUTO, kernelabi_minor, CTLFLAG_RD,
             0, FUSE_KERNEL_MINOR_VERSION, "FUSE kernel abi minor version");
 
+SDT_PROVIDER_DEFINE(fuse);
+FUSE_SDT_PROBE_DEFINE2(ticket, fetch, "uint64_t", "struct fuse_data *");
+FUSE_SDT_PROBE_DEFINE5(ticket, queue, "uint64_t", "int", "uint64_t", "size_t",
+    "int");
+FUSE_SDT_PROBE_DEFINE5(ticket, dispatch, "uint64_t", "int", "uint64_t",
+    "size_t", "int");
+FUSE_SDT_PROBE_DEFINE5(ticket, wakeup, "uint64_t", "int", "uint64_t", "size_t",
+    "int");
+FUSE_SDT_PROBE_DEFINE5(ticket, timeout, "uint64_t", "int", "uint64_t",
+    "size_t", "int");
+FUSE_SDT_PROBE_DEFINE5(ticket, drop, "uint64_t", "int", "uint64_t", "size_t",
+    "int");
+FUSE_SDT_PROBE_DEFINE5(device, read, "uint64_t", "int", "uint64_t", "size_t",
+    "int");
+FUSE_SDT_PROBE_DEFINE3(device, reply, "uint64_t", "int", "uint32_t");
+FUSE_SDT_PROBE_DEFINE3(vnop, entry, "char *", "struct vnode *", "uint64_t");
+FUSE_SDT_PROBE_DEFINE4(vnop, return, "char *", "struct vnode *", "uint64_t",
+    "int");
+FUSE_SDT_PROBE_DEFINE5(io, start, "uint64_t", "struct buf *", "int",
+    "off_t", "long");
+FUSE_SDT_PROBE_DEFINE5(io, done, "uint64_t", "struct buf *", "int", "int",
+    "long");
+
 /******************************
  *
  * >>> Module management stuff
@@ -179,6 +179,19 @@ fuse_vnode_alloc(struct mount *mp,
     return (0);
 }
 
+/*
+ * Look up the vnode of nodeid among the ones in use, without asking the
+ * daemon. *vpp is set to NULL if there is none.
+ */
+int
+fuse_vnode_find(struct mount *mp, uint64_t nodeid, int lkflags,
+                struct vnode **vpp)
+{
+    *vpp = NULL;
+    return (vfs_hash_get(mp, fuse_vnode_hash(nodeid), lkflags, curthread,
+        vpp, fuse_vnode_cmp, &nodeid));
+}
+
 int
 fuse_vnode_get(struct mount         *mp,
                uint64_t              nodeid,
@@ -246,6 +259,8 @@ fuse_vnode_savesize(struct vnode *vp, struct ucred *cred)
     struct fuse_filehandle *fufh = NULL;
     struct fuse_dispatcher  fdi;
     struct fuse_setattr_in *fsai;
+    struct bufobj *bo;
+    int mtimechange;
     int err = 0;
 
     DEBUG("inode=%jd size=%jd\n", VTOI(vp), fvdat->filesize);
@@ -276,6 +291,23 @@ fuse_vnode_savesize(struct vnode *vp, struct ucred *cred)
     fsai->size = fvdat->filesize;
     fsai->valid |= FATTR_SIZE;
 
+    /*
+     * With write-back caching the mtime of the data written is ours to
+     * tell, once it's all with the daemon (whose writes would bump it):
+     * no buffer is to be dirty, nor to be on its way out (as left behind
+     * by a MNT_NOWAIT fsync).
+     */
+    bo = &vp->v_bufobj;
+    BO_LOCK(bo);
+    mtimechange = (fvdat->flag & FN_MTIMECHANGE) != 0 &&
+        bo->bo_dirty.bv_cnt == 0 && bo->bo_numoutput == 0;
+    BO_UNLOCK(bo);
+    if (mtimechange) {
+        fsai->mtime = fvdat->local_mtime.tv_sec;
+        fsai->mtimensec = fvdat->local_mtime.tv_nsec;
+        fsai->valid |= FATTR_MTIME;
+    }
+
     fuse_filehandle_getrw(vp, FUFH_WRONLY, &fufh);
     if (fufh) {
         fsai->fh = fufh->fh_id;
@@ -284,8 +316,11 @@ fuse_vnode_savesize(struct vnode *vp, struct ucred *cred)
 
     err = fdisp_wait_answ(&fdi);
     fdisp_destroy(&fdi);
-    if (err == 0)
+    if (err == 0) {
 	    fvdat->flag &= ~FN_SIZECHANGE;
+	    if (mtimechange)
+		    fvdat->flag &= ~FN_MTIMECHANGE;
+    }
 
     fuse_invalidate_attr(vp);
 
@@ -16,6 +16,7 @@
 #define FN_FLUSHINPROG       0x00000040
 #define FN_FLUSHWANT         0x00000080
 #define FN_SIZECHANGE        0x00000100
+#define FN_MTIMECHANGE       0x00000200
 
 struct fuse_vnode_data {
     /** self **/
@@ -27,6 +28,9 @@ struct fuse_vnode_data {
 
     /** I/O **/
     struct     fuse_filehandle fufh[FUFH_MAXTYPE];
+    off_t      read_nextoff;    /* where a sequential read would go on */
+    int        read_seqcount;   /* see fuse_io_seqcount() */
+    u_int      wb_error;        /* see fuse_io_wberror() */
 
     /** flags **/
     uint32_t   flag;
@@ -35,6 +39,7 @@ struct fuse_vnode_data {
     struct timespec   cached_attrs_valid;
     struct vattr      cached_attrs;
     off_t             filesize;
+    struct timespec   local_mtime;   /* of cached writes, see FN_MTIMECHANGE */
     uint64_t          nlookup;
     enum vtype        vtype;
 };
@@ -71,6 +76,11 @@ int fuse_isvalid_attr(struct vnode *vp);
 
 void fuse_vnode_destroy(struct vnode *vp);
 
+int fuse_vnode_find(struct mount *mp,
+                    uint64_t nodeid,
+                    int lkflags,
+                    struct vnode **vpp);
+
 int fuse_vnode_get(struct mount         *mp,
                    uint64_t              nodeid,
                    struct vnode         *dvp,
@@ -33,7 +33,13 @@
  */
 #define FUSE_DEFAULT_IOSIZE                4096
 
-#ifdef KERNEL
+/*
+ * This is the read-ahead we offer the daemon on INIT, ie. the most we read
+ * of a file ahead of what has been asked for. The daemon may cut it down.
+ */
+#define FUSE_DEFAULT_MAX_READAHEAD         (FUSE_DEFAULT_IOSIZE * 16)
+
+#ifdef _KERNEL
 
 /*
  * This is the soft upper limit on the number of "request tickets" FUSE's
@@ -41,6 +47,7 @@
  * through the fuse.* sysctl interface.
  */
 #define FUSE_DEFAULT_MAX_FREE_TICKETS      1024
+#define FUSE_MAX_MAX_FREE_TICKETS          4096
 
 #define FUSE_DEFAULT_IOV_PERMANENT_BUFSIZE (1L << 19)
 #define FUSE_DEFAULT_IOV_CREDIT            16
@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#include <sys/types.h>
+#include <sys/module.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/conf.h>
+#include <sys/uio.h>
+#include <sys/malloc.h>
+#include <sys/queue.h>
+#include <sys/lock.h>
+#include <sys/sx.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/mount.h>
+#include <sys/selinfo.h>
+
+#include <vm/vm.h>
+#include <vm/vm_extern.h>
+#include <vm/vm_map.h>
+#include <vm/vm_object.h>
+#include <vm/vm_pager.h>
+
+#include "fuse.h"
+#include "fuse_ipc.h"
+#include "fuse_ring.h"
+
+#define FUSE_DEBUG_MODULE IPC
+#include "fuse_debug.h"
+
+MALLOC_DEFINE(M_FUSERING, "fuse_ring", "fuse shared memory ring");
+
+static int
+fring_alloc(struct fuse_ring_setup *fs, struct ucred *cred,
+            struct fuse_ring **ringp)
+{
+    struct fuse_ring *ring;
+    vm_object_t obj;
+    vm_offset_t kva;
+    vm_size_t qsize, mapsize;
+    uint32_t nslots, slotsize, i;
+    int err;
+
+    if (fs->fs_nslots == 0 || fs->fs_nslots > FUSE_RING_MAXSLOTS)
+        return EINVAL;
+    for (nslots = 1; nslots < fs->fs_nslots; nslots <<= 1)
+        ;
+    slotsize = round_page(max(fs->fs_slotsize, PAGE_SIZE));
+    if (slotsize > MAXPHYS + PAGE_SIZE)
+        return EINVAL;
+
+    qsize = round_page(sizeof(struct fuse_ring_hdr) +
+                       nslots * sizeof(struct fuse_ring_ent));
+    mapsize = 2 * qsize + (vm_size_t)nslots * slotsize;
+    if (mapsize > FUSE_RING_MAXMAPSIZE)
+        return EINVAL;
+
+    obj = vm_pager_allocate(OBJT_PHYS, NULL, mapsize, VM_PROT_DEFAULT, 0,
+                            cred);
+    if (obj == NULL)
+        return ENOMEM;
+
+    /* the kernel map consumes the reference we got from the allocation */
+    vm_object_reference(obj);
+    kva = vm_map_min(kernel_map);
+#if __FreeBSD_version >= 1000000
+    err = vm_map_find(kernel_map, obj, 0, &kva, mapsize, 0, VMFS_ANY_SPACE,
+                      VM_PROT_RW, VM_PROT_RW, 0);
+#else
+    err = vm_map_find(kernel_map, obj, 0, &kva, mapsize, VMFS_ANY_SPACE,
+                      VM_PROT_RW, VM_PROT_RW, 0);
+#endif
+    if (err != KERN_SUCCESS) {
+        vm_object_deallocate(obj);
+        vm_object_deallocate(obj);
+        return ENOMEM;
+    }
+    err = vm_map_wire(kernel_map, kva, kva + mapsize,
+                      VM_MAP_WIRE_SYSTEM | VM_MAP_WIRE_NOHOLES);
+    if (err != KERN_SUCCESS) {
+        vm_map_remove(kernel_map, kva, kva + mapsize);
+        vm_object_deallocate(obj);
+        return ENOMEM;
+    }
+
+    ring = malloc(sizeof(*ring), M_FUSERING, M_WAITOK | M_ZERO);
+    ring->fr_obj = obj;
+    ring->fr_kva = kva;
+    ring->fr_mapsize = mapsize;
+    ring->fr_nslots = nslots;
+    ring->fr_slotsize = slotsize;
+    ring->fr_sq = (struct fuse_ring_hdr *)kva;
+    ring->fr_sqe = (struct fuse_ring_ent *)(ring->fr_sq + 1);
+    ring->fr_cq = (struct fuse_ring_hdr *)(kva + qsize);
+    ring->fr_cqe = (struct fuse_ring_ent *)(ring->fr_cq + 1);
+    ring->fr_slots = (char *)(kva + 2 * qsize);
+    ring->fr_tick = malloc(nslots * sizeof(*ring->fr_tick), M_FUSERING,
+                           M_WAITOK | M_ZERO);
+    ring->fr_free = malloc(nslots * sizeof(*ring->fr_free), M_FUSERING,
+                           M_WAITOK);
+    ring->fr_sqslot = malloc(nslots * sizeof(*ring->fr_sqslot), M_FUSERING,
+                             M_WAITOK);
+    ring->fr_sqready = malloc(nslots * sizeof(*ring->fr_sqready), M_FUSERING,
+                              M_WAITOK | M_ZERO);
+    for (i = 0; i < nslots; i++)
+        ring->fr_free[i] = nslots - 1 - i;
+    ring->fr_nfree = nslots;
+
+    fs->fs_nslots = nslots;
+    fs->fs_slotsize = slotsize;
+    fs->fs_mapsize = mapsize;
+    fs->fs_sq_off = 0;
+    fs->fs_cq_off = qsize;
+    fs->fs_slots_off = 2 * qsize;
+
+    *ringp = ring;
+    return 0;
+}
+
+static void
+fring_destroy(struct fuse_ring *ring)
+{
+    /* Mappings of the daemon hold their own references to the object. */
+    vm_map_remove(kernel_map, ring->fr_kva, ring->fr_kva + ring->fr_mapsize);
+    vm_object_deallocate(ring->fr_obj);
+    free(ring->fr_tick, M_FUSERING);
+    free(ring->fr_free, M_FUSERING);
+    free(ring->fr_sqslot, M_FUSERING);
+    free(ring->fr_sqready, M_FUSERING);
+    free(ring, M_FUSERING);
+}
+
+int
+fring_setup(struct fuse_chan *chan, struct fuse_ring_setup *fs,
+            struct ucred *cred)
+{
+    struct fuse_ring *ring;
+    int err;
+
+    debug_printf("chan=%p, nslots=%u, slotsize=%u\n", chan, fs->fs_nslots,
+                 fs->fs_slotsize);
+
+    if ((err = fring_alloc(fs, cred, &ring)))
+        return err;
+
+    fuse_lck_mtx_lock(chan->ms_mtx);
+    if (chan->ch_ring != NULL || (chan->ch_flags & FCH_CLOSED))
+        err = EBUSY;
+    else
+        chan->ch_ring = ring;
+    fuse_lck_mtx_unlock(chan->ms_mtx);
+
+    if (err)
+        fring_destroy(ring);
+
+    return err;
+}
+
+/*
+ * Take the ring off chan and destroy it, once the posts being copied are
+ * through. The tickets of requests posted but not completed yet are put
+ * on pending if that's given, else they are dropped.
+ */
+void
+fring_teardown(struct fuse_chan *chan, struct fuse_ms_head *pending)
+{
+    struct fuse_ring *ring;
+    struct fuse_ticket *ftick;
+    struct fuse_ms_head posted;
+    uint32_t i;
+
+    debug_printf("chan=%p\n", chan);
+
+    STAILQ_INIT(&posted);
+
+    fuse_lck_mtx_lock(chan->ms_mtx);
+    ring = chan->ch_ring;
+    chan->ch_ring = NULL;
+    if (ring != NULL) {
+        ring->fr_dying = 1;
+        while (ring->fr_busy > 0)
+            msleep(ring, &chan->ms_mtx, PVFS, "fu_rngdn", 0);
+        for (i = 0; i < ring->fr_nslots; i++) {
+            if ((ftick = ring->fr_tick[i])) {
+                ring->fr_tick[i] = NULL;
+                STAILQ_INSERT_TAIL(&posted, ftick, tk_ms_link);
+            }
+        }
+    }
+    fuse_lck_mtx_unlock(chan->ms_mtx);
+
+    if (ring == NULL)
+        return;
+
+    while ((ftick = STAILQ_FIRST(&posted))) {
+        STAILQ_REMOVE_HEAD(&posted, tk_ms_link);
+        if (pending) {
+            STAILQ_INSERT_TAIL(pending, ftick, tk_ms_link);
+        } else {
+#ifdef INVARIANTS
+            ftick->tk_ms_link.stqe_next = NULL;
+#endif
+            fuse_ticket_drop(ftick);
+        }
+    }
+
+    fring_destroy(ring);
+}
+
+/*
+ * Set aside a free slot and the next submission entry for the message of
+ * ftick; *posp is where the entry is. The ring holds a reference to the
+ * ticket until the slot is completed, and the caller is to go on with
+ * fring_fill() and fring_publish().
+ */
+int
+fring_reserve(struct fuse_ring *ring, struct fuse_ticket *ftick,
+              uint32_t *posp)
+{
+    uint32_t slot, pos;
+    size_t len;
+
+    len = fticket_ms_len(ftick);
+    if (ring->fr_dying || len > ring->fr_slotsize || ring->fr_nfree == 0)
+        return ENOSPC;
+
+    slot = ring->fr_free[--ring->fr_nfree];
+    refcount_acquire(&ftick->tk_refcount);
+    ring->fr_tick[slot] = ftick;
+
+    pos = ring->fr_sqresv++;
+    ring->fr_sqslot[pos & (ring->fr_nslots - 1)] = slot;
+    ring->fr_busy++;
+
+    *posp = pos;
+    return 0;
+}
+
+/*
+ * Copy the message of ftick into the slot reserved for it at pos. Called
+ * without the message list mutex; the slot is ours until it's published,
+ * and the ring stays mapped as long as there are posts being copied.
+ */
+void
+fring_fill(struct fuse_ring *ring, struct fuse_ticket *ftick, uint32_t pos)
+{
+    char *p;
+
+    p = fring_slot(ring, ring->fr_sqslot[pos & (ring->fr_nslots - 1)]);
+    memcpy(p, ftick->tk_ms_fiov.base, ftick->tk_ms_fiov.len);
+    if (ftick->tk_ms_type == FT_M_BUF)
+        memcpy(p + ftick->tk_ms_fiov.len, ftick->tk_ms_bufdata,
+               ftick->tk_ms_bufsize);
+}
+
+/*
+ * Hand the filled entry at pos over to the daemon, along with the entries
+ * after it which were only held back by it. Returns ENXIO if the ring is
+ * being torn down, which takes care of the ticket then.
+ */
+int
+fring_publish(struct fuse_ring *ring, struct fuse_ticket *ftick,
+              uint32_t pos)
+{
+    struct fuse_ring_ent *ent;
+    uint32_t mask = ring->fr_nslots - 1;
+
+    MPASS(ring->fr_busy > 0);
+
+    if (ring->fr_dying) {
+        if (--ring->fr_busy == 0)
+            wakeup(ring);
+        return ENXIO;
+    }
+    ring->fr_busy--;
+
+    if (ftick->tk_ms_type == FT_M_BUF) {
+        /* the daemon has it all, see fticket_ms_abandon() */
+        fuse_lck_mtx_lock(ftick->tk_aw_mtx);
+        ftick->tk_flag |= FT_MSSENT;
+        fuse_lck_mtx_unlock(ftick->tk_aw_mtx);
+    }
+
+    ent = &ring->fr_sqe[pos & mask];
+    ent->fe_slot = ring->fr_sqslot[pos & mask];
+    ent->fe_len = fticket_ms_len(ftick);
+    ring->fr_sqready[pos & mask] = 1;
+
+    if (pos != ring->fr_sqtail)
+        return 0;
+    while (ring->fr_sqtail != ring->fr_sqresv &&
+           ring->fr_sqready[ring->fr_sqtail & mask]) {
+        ring->fr_sqready[ring->fr_sqtail & mask] = 0;
+        ring->fr_sqtail++;
+    }
+    atomic_store_rel_32(&ring->fr_sq->fr_tail, ring->fr_sqtail);
+
+    return 0;
+}
+
+/*
+ * Take the next entry off the completion queue. The slot is not given
+ * back until fring_slot_free() is called on it; the reference of the ring
+ * to the ticket of the slot is passed over to the caller.
+ *
+ * Returns ENOENT if there is no completion, EINVAL if the daemon posted
+ * garbage.
+ */
+int
+fring_cq_pop(struct fuse_ring *ring, uint32_t *slotp, uint32_t *lenp,
+             struct fuse_ticket **ftickp)
+{
+    struct fuse_ring_ent *ent;
+    uint32_t slot, len;
+
+    if (atomic_load_acq_32(&ring->fr_cq->fr_tail) == ring->fr_cqhead)
+        return ENOENT;
+
+    ent = &ring->fr_cqe[ring->fr_cqhead & (ring->fr_nslots - 1)];
+    slot = ent->fe_slot;
+    len = ent->fe_len;
+    atomic_store_rel_32(&ring->fr_cq->fr_head, ++ring->fr_cqhead);
+
+    if (slot >= ring->fr_nslots || ring->fr_tick[slot] == NULL ||
+        len > ring->fr_slotsize)
+        return EINVAL;
+
+    *slotp = slot;
+    *lenp = len;
+    *ftickp = ring->fr_tick[slot];
+    ring->fr_tick[slot] = NULL;
+
+    return 0;
+}
+
+void
+fring_slot_free(struct fuse_ring *ring, uint32_t slot)
+{
+    MPASS(ring->fr_tick[slot] == NULL);
+    MPASS(ring->fr_nfree < ring->fr_nslots);
+
+    ring->fr_free[ring->fr_nfree++] = slot;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#ifndef _FUSE_RING_H_
+#define _FUSE_RING_H_
+
+#include "fuse_ioctl.h"
+
+/*
+ * Kernel side of the shared memory rings of a channel (see fuse_ioctl.h
+ * for the layout). The ring area is backed by a VM object which is wired
+ * into the kernel map and handed out to the daemon by d_mmap_single.
+ *
+ * Fields are protected by the message list mutex of the channel, except
+ * for the mapping itself which stays in place as long as the ring lives.
+ * Messages are copied into their slots without holding the mutex: a post
+ * reserves the next submission entry along with a slot, fills the slot,
+ * then publishes the entry, which the daemon gets to see once all the
+ * entries reserved before it are published too.
+ */
+struct fuse_ring {
+    vm_object_t            fr_obj;
+    vm_offset_t            fr_kva;
+    vm_size_t              fr_mapsize;
+
+    uint32_t               fr_nslots;
+    uint32_t               fr_slotsize;
+
+    struct fuse_ring_hdr  *fr_sq;
+    struct fuse_ring_ent  *fr_sqe;
+    struct fuse_ring_hdr  *fr_cq;
+    struct fuse_ring_ent  *fr_cqe;
+    char                  *fr_slots;
+
+    /* private copies of the indices the kernel owns */
+    uint32_t               fr_sqtail;
+    uint32_t               fr_cqhead;
+
+    /* submission entries reserved, and their slots and readiness */
+    uint32_t               fr_sqresv;
+    uint32_t              *fr_sqslot;
+    uint8_t               *fr_sqready;
+    int                    fr_busy;     /* posts being copied */
+    int                    fr_dying;
+
+    /* ticket of the request in each slot, and stack of free slots */
+    struct fuse_ticket   **fr_tick;
+    uint32_t              *fr_free;
+    uint32_t               fr_nfree;
+};
+
+static __inline__
+char *
+fring_slot(struct fuse_ring *ring, uint32_t slot)
+{
+    return (ring->fr_slots + (size_t)slot * ring->fr_slotsize);
+}
+
+static __inline__
+int
+fring_sq_pending(struct fuse_ring *ring)
+{
+    return (atomic_load_acq_32(&ring->fr_sq->fr_head) != ring->fr_sqtail);
+}
+
+/* the head is the daemon's to move, so don't trust it too much */
+static __inline__
+uint32_t
+fring_sq_count(struct fuse_ring *ring)
+{
+    uint32_t n;
+
+    n = ring->fr_sqtail - atomic_load_acq_32(&ring->fr_sq->fr_head);
+    return (n > ring->fr_nslots ? ring->fr_nslots : n);
+}
+
+int  fring_setup(struct fuse_chan *chan, struct fuse_ring_setup *fs,
+                 struct ucred *cred);
+void fring_teardown(struct fuse_chan *chan, struct fuse_ms_head *pending);
+int  fring_reserve(struct fuse_ring *ring, struct fuse_ticket *ftick,
+                   uint32_t *posp);
+void fring_fill(struct fuse_ring *ring, struct fuse_ticket *ftick,
+                uint32_t pos);
+int  fring_publish(struct fuse_ring *ring, struct fuse_ticket *ftick,
+                   uint32_t pos);
+int  fring_cq_pop(struct fuse_ring *ring, uint32_t *slotp, uint32_t *lenp,
+                  struct fuse_ticket **ftickp);
+void fring_slot_free(struct fuse_ring *ring, uint32_t slot);
+
+#endif /* _FUSE_RING_H_ */
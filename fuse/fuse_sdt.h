@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#ifndef _FUSE_SDT_H_
+#define _FUSE_SDT_H_
+
+#include <sys/sdt.h>
+
+/*
+ * Statically defined tracing probes of the "fuse" DTrace provider. They
+ * are defined in fuse_main.c; see the dtrace/ directory for how they are
+ * meant to be used.
+ *
+ * The arguments of a probe are only evaluated when the probe is enabled,
+ * but for the vnode and nodeid of the vnop probes, which are cheap.
+ *
+ * fuse::ticket:fetch     unique, fuse_data
+ * fuse::ticket:queue     unique, opcode, nodeid, length, lane
+ * fuse::ticket:dispatch  unique, opcode, nodeid, length, error
+ * fuse::ticket:wakeup    unique, opcode, nodeid, length, errno
+ * fuse::ticket:timeout   unique, opcode, nodeid, length, timeout (secs)
+ * fuse::ticket:drop      unique, opcode, nodeid, length, flags
+ * fuse::device:read      unique, opcode, nodeid, length, lane
+ * fuse::device:reply     unique, error, length
+ * fuse::vnop:entry       vnop name, vnode, nodeid
+ * fuse::vnop:return      vnop name, vnode, nodeid, errno
+ * fuse::io:start         nodeid, buf, iocmd, offset, size
+ * fuse::io:done          nodeid, buf, iocmd, errno, resid
+ *
+ * Lengths are those of the whole message, headers included. Opcode and
+ * nodeid are those of the message last built in the ticket, thus fetch
+ * can't tell them. The vnode and nodeid of vnop:return are those the vnop
+ * was entered with; the vnode may be no longer referenced (rename) or
+ * reclaimed by then.
+ */
+
+/* SDT dropped the separate probe name string in 10.1 */
+#if __FreeBSD_version >= 1001000
+#define FUSE_SDT_PROBE_DEFINE2(func, name, a0, a1) \
+    SDT_PROBE_DEFINE2(fuse, , func, name, a0, a1)
+#define FUSE_SDT_PROBE_DEFINE3(func, name, a0, a1, a2) \
+    SDT_PROBE_DEFINE3(fuse, , func, name, a0, a1, a2)
+#define FUSE_SDT_PROBE_DEFINE4(func, name, a0, a1, a2, a3) \
+    SDT_PROBE_DEFINE4(fuse, , func, name, a0, a1, a2, a3)
+#define FUSE_SDT_PROBE_DEFINE5(func, name, a0, a1, a2, a3, a4) \
+    SDT_PROBE_DEFINE5(fuse, , func, name, a0, a1, a2, a3, a4)
+#else
+#define FUSE_SDT_PROBE_DEFINE2(func, name, a0, a1) \
+    SDT_PROBE_DEFINE2(fuse, , func, name, name, a0, a1)
+#define FUSE_SDT_PROBE_DEFINE3(func, name, a0, a1, a2) \
+    SDT_PROBE_DEFINE3(fuse, , func, name, name, a0, a1, a2)
+#define FUSE_SDT_PROBE_DEFINE4(func, name, a0, a1, a2, a3) \
+    SDT_PROBE_DEFINE4(fuse, , func, name, name, a0, a1, a2, a3)
+#define FUSE_SDT_PROBE_DEFINE5(func, name, a0, a1, a2, a3, a4) \
+    SDT_PROBE_DEFINE5(fuse, , func, name, name, a0, a1, a2, a3, a4)
+#endif
+
+SDT_PROVIDER_DECLARE(fuse);
+SDT_PROBE_DECLARE(fuse, , ticket, fetch);
+SDT_PROBE_DECLARE(fuse, , ticket, queue);
+SDT_PROBE_DECLARE(fuse, , ticket, dispatch);
+SDT_PROBE_DECLARE(fuse, , ticket, wakeup);
+SDT_PROBE_DECLARE(fuse, , ticket, timeout);
+SDT_PROBE_DECLARE(fuse, , ticket, drop);
+SDT_PROBE_DECLARE(fuse, , device, read);
+SDT_PROBE_DECLARE(fuse, , device, reply);
+SDT_PROBE_DECLARE(fuse, , vnop, entry);
+SDT_PROBE_DECLARE(fuse, , vnop, return);
+SDT_PROBE_DECLARE(fuse, , io, start);
+SDT_PROBE_DECLARE(fuse, , io, done);
+
+/* for the probes which describe a ticket by its message */
+#define FUSE_TICKET_PROBE(func, name, ftick, arg)                         \
+    SDT_PROBE5(fuse, , func, name, (ftick)->tk_unique,                    \
+        fticket_opcode(ftick),                                           \
+        ((struct fuse_in_header *)(ftick)->tk_ms_fiov.base)->nodeid,     \
+        fticket_ms_len(ftick), (arg))
+
+#endif /* _FUSE_SDT_H_ */
@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#include <sys/types.h>
+#include <sys/module.h>
+#include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <sys/kernel.h>
+#include <sys/conf.h>
+#include <sys/uio.h>
+#include <sys/malloc.h>
+#include <sys/queue.h>
+#include <sys/lock.h>
+#include <sys/sx.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/mount.h>
+#include <sys/selinfo.h>
+#include <sys/sbuf.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+
+#include "fuse.h"
+#include "fuse_ipc.h"
+#include "fuse_stats.h"
+
+#define FUSE_DEBUG_MODULE IPC
+#include "fuse_debug.h"
+
+MALLOC_DEFINE(M_FUSESTATS, "fuse_stats", "fuse per mount statistics");
+
+static int fuse_stats_enable = 1;
+SYSCTL_INT(_vfs_fuse, OID_AUTO, stats, CTLFLAG_RW,
+           &fuse_stats_enable, 0,
+           "keep request statistics for mounts made from now on");
+
+SYSCTL_NODE(_vfs_fuse, OID_AUTO, mounts, CTLFLAG_RD, 0,
+            "per mount statistics");
+
+static const char *fuse_opnames[FUSE_STATS_NOPS] = {
+    [FUSE_LOOKUP]       = "lookup",
+    [FUSE_FORGET]       = "forget",
+    [FUSE_GETATTR]      = "getattr",
+    [FUSE_SETATTR]      = "setattr",
+    [FUSE_READLINK]     = "readlink",
+    [FUSE_SYMLINK]      = "symlink",
+    [FUSE_MKNOD]        = "mknod",
+    [FUSE_MKDIR]        = "mkdir",
+    [FUSE_UNLINK]       = "unlink",
+    [FUSE_RMDIR]        = "rmdir",
+    [FUSE_RENAME]       = "rename",
+    [FUSE_LINK]         = "link",
+    [FUSE_OPEN]         = "open",
+    [FUSE_READ]         = "read",
+    [FUSE_WRITE]        = "write",
+    [FUSE_STATFS]       = "statfs",
+    [FUSE_RELEASE]      = "release",
+    [FUSE_FSYNC]        = "fsync",
+    [FUSE_SETXATTR]     = "setxattr",
+    [FUSE_GETXATTR]     = "getxattr",
+    [FUSE_LISTXATTR]    = "listxattr",
+    [FUSE_REMOVEXATTR]  = "removexattr",
+    [FUSE_FLUSH]        = "flush",
+    [FUSE_INIT]         = "init",
+    [FUSE_OPENDIR]      = "opendir",
+    [FUSE_READDIR]      = "readdir",
+    [FUSE_RELEASEDIR]   = "releasedir",
+    [FUSE_FSYNCDIR]     = "fsyncdir",
+    [FUSE_GETLK]        = "getlk",
+    [FUSE_SETLK]        = "setlk",
+    [FUSE_SETLKW]       = "setlkw",
+    [FUSE_ACCESS]       = "access",
+    [FUSE_CREATE]       = "create",
+    [FUSE_INTERRUPT]    = "interrupt",
+    [FUSE_BMAP]         = "bmap",
+    [FUSE_DESTROY]      = "destroy",
+    [FUSE_BATCH_FORGET] = "batch_forget",
+};
+
+static const char *fuse_lanenames[FUSE_NLANES] = {
+    [FUSE_LANE_CTL]  = "ctl",
+    [FUSE_LANE_META] = "meta",
+    [FUSE_LANE_DATA] = "data",
+};
+
+static __inline struct fuse_opstats *
+fuse_stats_op(struct fuse_ticket *ftick)
+{
+    struct fuse_stats *st = ftick->tk_data->stats;
+    int op;
+
+    if (st == NULL)
+        return NULL;
+    op = fticket_opcode(ftick);
+    if (op < 0 || op >= FUSE_STATS_NOPS)
+        return NULL;
+
+    return &st->st_ops[op];
+}
+
+static __inline void
+fuse_stats_hist(u_long *hist, uint64_t usecs)
+{
+    int i;
+
+    i = flsll(usecs);
+    if (i >= FUSE_STATS_NBUCKETS)
+        i = FUSE_STATS_NBUCKETS - 1;
+    atomic_add_long(&hist[i], 1);
+}
+
+/*
+ * The message of ftick has been passed to the daemon.
+ */
+void
+fuse_stats_sent(struct fuse_ticket *ftick)
+{
+    struct fuse_opstats *os;
+    uint64_t now;
+
+    if ((os = fuse_stats_op(ftick)) == NULL)
+        return;
+
+    now = fuse_stats_now();
+    ftick->tk_ts_sent = now;
+    atomic_add_long(&os->os_count, 1);
+    atomic_add_long(&os->os_bytes,
+                    fticket_ms_len(ftick) - sizeof(struct fuse_in_header));
+    fuse_stats_hist(os->os_qwait, now - ftick->tk_ts_queued);
+}
+
+/*
+ * The answer of ftick, with header ohead, has come in.
+ */
+void
+fuse_stats_answered(struct fuse_ticket *ftick, struct fuse_out_header *ohead)
+{
+    struct fuse_opstats *os;
+
+    if ((os = fuse_stats_op(ftick)) == NULL)
+        return;
+
+    if (ohead->error)
+        atomic_add_long(&os->os_errors, 1);
+    atomic_add_long(&os->os_bytes, ohead->len - sizeof(*ohead));
+    fuse_stats_hist(os->os_service, fuse_stats_now() - ftick->tk_ts_sent);
+}
+
+static int
+fuse_stats_hist_sysctl(SYSCTL_HANDLER_ARGS)
+{
+    u_long *hist = arg1;
+    struct sbuf sb;
+    int err, i, first = 1;
+
+    sbuf_new_for_sysctl(&sb, NULL, 256, req);
+    for (i = 0; i < FUSE_STATS_NBUCKETS; i++) {
+        if (hist[i] == 0)
+            continue;
+        if (i == 0)
+            sbuf_printf(&sb, "0: %lu", hist[i]);
+        else if (i == FUSE_STATS_NBUCKETS - 1)
+            sbuf_printf(&sb, "%s%ju-: %lu", first ? "" : "\n",
+                        (uintmax_t)1 << (i - 1), hist[i]);
+        else
+            sbuf_printf(&sb, "%s%ju-%ju: %lu", first ? "" : "\n",
+                        (uintmax_t)1 << (i - 1), ((uintmax_t)1 << i) - 1,
+                        hist[i]);
+        first = 0;
+    }
+    err = sbuf_finish(&sb);
+    sbuf_delete(&sb);
+
+    return (err);
+}
+
+/*
+ * The lane statistics are kept by the channels, under their message list
+ * mutexes (see fuse_ms_pop()); add them up over the channels of the
+ * session. arg2 is the offset of the counter in the lanes of a channel.
+ */
+static int
+fuse_stats_lane_sysctl(SYSCTL_HANDLER_ARGS)
+{
+    struct fuse_data *data = arg1;
+    u_long val = 0, v;
+    u_int i, nchans;
+    int max;
+
+    max = arg2 % sizeof(struct fuse_ms_lane) ==
+          offsetof(struct fuse_ms_lane, ml_maxwait);
+    nchans = atomic_load_acq_int(&data->nchans);
+    for (i = 0; i < nchans; i++) {
+        /* channels stay in place as long as the session */
+        v = *(volatile u_long *)((char *)data->chans[i]->ms_lane + arg2);
+        val = max ? MAX(val, v) : val + v;
+    }
+
+    return (sysctl_handle_long(oidp, &val, 0, req));
+}
+
+#define FUSE_STATS_LANE_SYSCTL(ctx, oid, data, lane, field, name, descr) \
+    SYSCTL_ADD_PROC(ctx, SYSCTL_CHILDREN(oid), OID_AUTO, name,           \
+        CTLTYPE_ULONG | CTLFLAG_RD | CTLFLAG_MPSAFE, data,               \
+        (lane) * sizeof(struct fuse_ms_lane) +                           \
+        offsetof(struct fuse_ms_lane, field),                            \
+        fuse_stats_lane_sysctl, "LU", descr)
+
+/*
+ * Set up the statistics of the session mounted on mp, and publish them
+ * under the fsid of mp (so this is to be called once it's got one).
+ */
+void
+fuse_stats_attach(struct fuse_data *data, struct mount *mp)
+{
+    struct fuse_stats *st;
+    struct sysctl_oid *mnt_oid, *ops_oid, *op_oid, *lanes_oid, *lane_oid;
+    struct fuse_opstats *os;
+    char name[16];
+    int op, lane;
+
+    if (!fuse_stats_enable || data->stats != NULL)
+        return;
+
+    st = malloc(sizeof(*st), M_FUSESTATS, M_WAITOK | M_ZERO);
+    sysctl_ctx_init(&st->st_ctx);
+
+    snprintf(name, sizeof(name), "%u", (u_int)mp->mnt_stat.f_fsid.val[0]);
+    mnt_oid = SYSCTL_ADD_NODE(&st->st_ctx,
+        SYSCTL_STATIC_CHILDREN(_vfs_fuse_mounts), OID_AUTO, name,
+        CTLFLAG_RD, 0, "statistics of a fuse mount");
+    SYSCTL_ADD_STRING(&st->st_ctx, SYSCTL_CHILDREN(mnt_oid), OID_AUTO,
+        "mntonname", CTLFLAG_RD, mp->mnt_stat.f_mntonname, 0,
+        "mount point");
+    ops_oid = SYSCTL_ADD_NODE(&st->st_ctx, SYSCTL_CHILDREN(mnt_oid),
+        OID_AUTO, "ops", CTLFLAG_RD, 0, "per opcode statistics");
+
+    for (op = 0; op < FUSE_STATS_NOPS; op++) {
+        if (fuse_opnames[op] == NULL)
+            continue;
+        os = &st->st_ops[op];
+        op_oid = SYSCTL_ADD_NODE(&st->st_ctx, SYSCTL_CHILDREN(ops_oid),
+            OID_AUTO, fuse_opnames[op], CTLFLAG_RD, 0, "");
+        SYSCTL_ADD_ULONG(&st->st_ctx, SYSCTL_CHILDREN(op_oid), OID_AUTO,
+            "count", CTLFLAG_RD, &os->os_count,
+            "requests passed to the daemon");
+        SYSCTL_ADD_ULONG(&st->st_ctx, SYSCTL_CHILDREN(op_oid), OID_AUTO,
+            "errors", CTLFLAG_RD, &os->os_errors,
+            "requests answered with an error");
+        SYSCTL_ADD_ULONG(&st->st_ctx, SYSCTL_CHILDREN(op_oid), OID_AUTO,
+            "bytes", CTLFLAG_RD, &os->os_bytes,
+            "bytes of request and answer bodies");
+        SYSCTL_ADD_PROC(&st->st_ctx, SYSCTL_CHILDREN(op_oid), OID_AUTO,
+            "queue_wait", CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+            os->os_qwait, 0, fuse_stats_hist_sysctl, "A",
+            "histogram of time spent queued, in usecs");
+        SYSCTL_ADD_PROC(&st->st_ctx, SYSCTL_CHILDREN(op_oid), OID_AUTO,
+            "service_time", CTLTYPE_STRING | CTLFLAG_RD | CTLFLAG_MPSAFE,
+            os->os_service, 0, fuse_stats_hist_sysctl, "A",
+            "histogram of time spent with the daemon, in usecs");
+    }
+
+    lanes_oid = SYSCTL_ADD_NODE(&st->st_ctx, SYSCTL_CHILDREN(mnt_oid),
+        OID_AUTO, "lanes", CTLFLAG_RD, 0,
+        "message queue lanes, over all channels");
+    for (lane = 0; lane < FUSE_NLANES; lane++) {
+        lane_oid = SYSCTL_ADD_NODE(&st->st_ctx, SYSCTL_CHILDREN(lanes_oid),
+            OID_AUTO, fuse_lanenames[lane], CTLFLAG_RD, 0, "");
+        FUSE_STATS_LANE_SYSCTL(&st->st_ctx, lane_oid, data, lane,
+            ml_depth, "depth", "messages queued in the lane");
+        FUSE_STATS_LANE_SYSCTL(&st->st_ctx, lane_oid, data, lane,
+            ml_count, "count", "messages taken off the lane");
+        FUSE_STATS_LANE_SYSCTL(&st->st_ctx, lane_oid, data, lane,
+            ml_wait, "wait_us",
+            "total time spent in the lane by messages, in usecs");
+        FUSE_STATS_LANE_SYSCTL(&st->st_ctx, lane_oid, data, lane,
+            ml_maxwait, "maxwait_us",
+            "longest time spent in the lane by a message, in usecs");
+    }
+
+    data->stats = st;
+}
+
+/*
+ * Take down the sysctls as the mount goes away. The counters stay, for
+ * answers which may still come in, until the session is destroyed.
+ */
+void
+fuse_stats_detach(struct fuse_data *data)
+{
+    if (data->stats != NULL)
+        sysctl_ctx_free(&data->stats->st_ctx);
+}
+
+void
+fuse_stats_free(struct fuse_data *data)
+{
+    free(data->stats, M_FUSESTATS);
+    data->stats = NULL;
+}
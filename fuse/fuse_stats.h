@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#ifndef _FUSE_STATS_H_
+#define _FUSE_STATS_H_
+
+#include <sys/time.h>
+
+/*
+ * Per session request statistics, exported under
+ * vfs.fuse.mounts.<fsid>.ops.<opcode>. For each opcode we count the
+ * requests passed to the daemon, the ones answered with an error and
+ * the bytes moved both ways, and keep log2 histograms (in usecs) of
+ * the time requests spend queued (insert to device read) and with the
+ * daemon (device read to reply).
+ *
+ * Counters are updated without locking, so they can be slightly off
+ * under concurrency.
+ *
+ * Next to them, under vfs.fuse.mounts.<fsid>.lanes.<lane>, are the
+ * statistics of the message queue lanes, which the channels keep under
+ * their own locks; they are added up over the channels when read.
+ */
+#define FUSE_STATS_NOPS     (FUSE_BATCH_FORGET + 1)
+#define FUSE_STATS_NBUCKETS 24  /* bucket i counts [2^(i-1), 2^i) usecs */
+
+struct fuse_opstats {
+    u_long os_count;
+    u_long os_errors;
+    u_long os_bytes;
+    u_long os_qwait[FUSE_STATS_NBUCKETS];
+    u_long os_service[FUSE_STATS_NBUCKETS];
+};
+
+struct fuse_stats {
+    struct fuse_opstats    st_ops[FUSE_STATS_NOPS];
+    struct sysctl_ctx_list st_ctx;
+};
+
+static __inline uint64_t
+fuse_stats_now(void)
+{
+    struct bintime bt;
+
+    binuptime(&bt);
+    return ((uint64_t)bt.sec * 1000000 +
+            (((uint64_t)1000000 * (uint32_t)(bt.frac >> 32)) >> 32));
+}
+
+static __inline void
+fuse_stats_queued(struct fuse_ticket *ftick)
+{
+    /* sent is reset once it's passed on, but the answer may race that */
+    if (ftick->tk_data->stats != NULL)
+        ftick->tk_ts_queued = ftick->tk_ts_sent = fuse_stats_now();
+}
+
+void fuse_stats_sent(struct fuse_ticket *ftick);
+void fuse_stats_answered(struct fuse_ticket *ftick,
+                         struct fuse_out_header *ohead);
+
+void fuse_stats_attach(struct fuse_data *data, struct mount *mp);
+void fuse_stats_detach(struct fuse_data *data);
+void fuse_stats_free(struct fuse_data *data);
+
+#endif /* _FUSE_STATS_H_ */
@@ -29,6 +29,7 @@
 #include "fuse_node.h"
 #include "fuse_ipc.h"
 #include "fuse_internal.h"
+#include "fuse_stats.h"
 
 #include <sys/priv.h>
 #include <security/mac/mac_framework.h>
@@ -158,6 +159,9 @@ fuse_vfsop_mount(struct mount *mp)
     int max_read_set = 0;
     uint32_t max_read = ~0;
     int daemon_timeout;
+    u_int max_background = FUSE_DEFAULT_MAX_BACKGROUND;
+    u_int congestion_threshold = FUSE_DEFAULT_CONGESTION_THRESHOLD;
+    u_int max_free_tickets = FUSE_DEFAULT_MAX_FREE_TICKETS;
 
     size_t len;
 
@@ -206,6 +210,7 @@ fuse_vfsop_mount(struct mount *mp)
     FUSE_FLAGOPT(no_namecache, FSESS_NO_NAMECACHE);
     FUSE_FLAGOPT(no_mmap, FSESS_NO_MMAP);
     FUSE_FLAGOPT(brokenio, FSESS_BROKENIO);
+    FUSE_FLAGOPT(writeback_cache, FSESS_WRITEBACK_CACHE);
 
     if (vfs_scanopt(opts, "max_read=", "%u", &max_read) == 1)
     max_read_set = 1;
@@ -217,6 +222,22 @@ fuse_vfsop_mount(struct mount *mp)
     } else {
         daemon_timeout = FUSE_DEFAULT_DAEMON_TIMEOUT;
     }
+    if (vfs_scanopt(opts, "max_background=", "%u", &max_background) == 1) {
+        if (max_background == 0)
+            max_background = 1;
+        mntopts |= FSESS_MAX_BACKGROUND_SET;
+    }
+    if (vfs_scanopt(opts, "congestion_threshold=", "%u",
+                    &congestion_threshold) == 1) {
+        if (congestion_threshold == 0)
+            congestion_threshold = 1;
+        mntopts |= FSESS_CONGESTION_SET;
+    }
+    if (congestion_threshold > max_background)
+        congestion_threshold = max_background;
+    if (vfs_scanopt(opts, "max_free_tickets=", "%u", &max_free_tickets) == 1 &&
+        max_free_tickets > FUSE_MAX_MAX_FREE_TICKETS)
+        max_free_tickets = FUSE_MAX_MAX_FREE_TICKETS;
     subtype = vfs_getopts(opts, "subtype=", &err);
     err = 0;
 
@@ -224,7 +245,7 @@ fuse_vfsop_mount(struct mount *mp)
 
     FUSE_LOCK();
     data = fuse_get_devdata(fdev);
-    if (data == NULL || data->mp != NULL ||
+    if (data == NULL || data->mp != NULL || data->fdev != fdev ||
         (data->dataflags & FSESS_OPENED) == 0) {
         DEBUG("invalid or not opened device: data=%p data.mp=%p\n",
 	    data, data != NULL ? data->mp : NULL);
@@ -262,6 +283,9 @@ fuse_vfsop_mount(struct mount *mp)
     data->dataflags |= mntopts;
     data->max_read = max_read;
     data->daemon_timeout = daemon_timeout;
+    data->max_background = max_background;
+    data->congestion_threshold = congestion_threshold;
+    fdata_set_max_free_tickets(data, max_free_tickets);
 #ifdef XXXIP
     if (!priv_check(td, PRIV_VFS_FUSE_SYNC_UNMOUNT))
         data->dataflags |= FSESS_CAN_SYNC_UNMOUNT;
@@ -279,6 +303,9 @@ fuse_vfsop_mount(struct mount *mp)
     bzero(mp->mnt_stat.f_mntfromname + len, MNAMELEN - len);
     DEBUG2G("mp %p: %s\n", mp, mp->mnt_stat.f_mntfromname);
 
+    /* needs the fsid, and has to be there by the first message */
+    fuse_stats_attach(data, mp);
+
     /* Now handshaking with daemon */
     fuse_internal_send_init(data, td);
 
@@ -335,6 +362,9 @@ fuse_vfsop_unmount(struct mount *mp, int mntflags)
         return err;
     }
 
+    /* the FORGETs of the vnodes just reclaimed go out before DESTROY */
+    fuse_internal_forget_drain(data);
+
     if (fdata_get_dead(data)) {
         goto alreadydead;
     }
@@ -346,8 +376,13 @@ fuse_vfsop_unmount(struct mount *mp, int mntflags)
     fdisp_destroy(&fdi);
 
     fdata_set_dead(data);
+    /* complete what is still in flight, eg. asynchronous RELEASEs */
+    fdata_abort_answers(data, ENOTCONN);
 
 alreadydead:
+    fdata_bg_drain(data);
+    fuse_stats_detach(data);
+
     FUSE_LOCK();
     data->mp = NULL;
     fdev = data->fdev;
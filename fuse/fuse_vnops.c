@@ -48,6 +48,7 @@
 #include "fuse_node.h"
 #include "fuse_param.h"
 #include "fuse_io.h"
+#include "fuse_sdt.h"
 
 #include <sys/priv.h>
 
@@ -56,6 +57,7 @@
 
 /* vnode ops */
 static vop_access_t   fuse_vnop_access;
+static vop_bmap_t     fuse_vnop_bmap;
 static vop_close_t    fuse_vnop_close;
 static vop_create_t   fuse_vnop_create;
 static vop_fsync_t    fuse_vnop_fsync;
@@ -81,34 +83,101 @@ static vop_getpages_t fuse_vnop_getpages;
 static vop_putpages_t fuse_vnop_putpages;
 static vop_print_t    fuse_vnop_print;
 
+#ifdef KDTRACE_HOOKS
+/*
+ * With DTrace in the kernel, the vnops are entered through trampolines
+ * which fire fuse::vnop:entry and fuse::vnop:return. The vnode and its
+ * nodeid are taken before the vnop is called, and handed to the return
+ * probe as they were: by then the vnop may have let go of the vnode (as
+ * rename does with fdvp) or torn it down (reclaim).
+ */
+static __inline struct vnode *
+fuse_vnop_probe_vp(struct vop_generic_args *ap)
+{
+	int off = ap->a_desc->vdesc_vp_offsets[0];
+
+	if (off == VDESC_NO_OFFSET)
+		return (NULL);
+	return (*VOPARG_OFFSETTO(struct vnode **, off, ap));
+}
+
+#define FUSE_VNOP_PROBED(op)						\
+static int								\
+fuse_vnop_##op##_probed(struct vop_##op##_args *ap)			\
+{									\
+	struct vnode *vp = fuse_vnop_probe_vp(&ap->a_gen);		\
+	uint64_t nid = vp != NULL ? VTOILLU(vp) : 0;			\
+	int err;							\
+									\
+	SDT_PROBE3(fuse, , vnop, entry, ap->a_gen.a_desc->vdesc_name,	\
+	    vp, nid);							\
+	err = fuse_vnop_##op(ap);					\
+	SDT_PROBE4(fuse, , vnop, return, ap->a_gen.a_desc->vdesc_name,	\
+	    vp, nid, err);						\
+	return (err);							\
+}
+
+FUSE_VNOP_PROBED(access)
+FUSE_VNOP_PROBED(bmap)
+FUSE_VNOP_PROBED(close)
+FUSE_VNOP_PROBED(create)
+FUSE_VNOP_PROBED(fsync)
+FUSE_VNOP_PROBED(getattr)
+FUSE_VNOP_PROBED(inactive)
+FUSE_VNOP_PROBED(link)
+FUSE_VNOP_PROBED(lookup)
+FUSE_VNOP_PROBED(mkdir)
+FUSE_VNOP_PROBED(mknod)
+FUSE_VNOP_PROBED(open)
+FUSE_VNOP_PROBED(read)
+FUSE_VNOP_PROBED(readdir)
+FUSE_VNOP_PROBED(readlink)
+FUSE_VNOP_PROBED(reclaim)
+FUSE_VNOP_PROBED(remove)
+FUSE_VNOP_PROBED(rename)
+FUSE_VNOP_PROBED(rmdir)
+FUSE_VNOP_PROBED(setattr)
+FUSE_VNOP_PROBED(strategy)
+FUSE_VNOP_PROBED(symlink)
+FUSE_VNOP_PROBED(write)
+FUSE_VNOP_PROBED(getpages)
+FUSE_VNOP_PROBED(putpages)
+FUSE_VNOP_PROBED(print)
+
+#define FUSE_VOP(op)	fuse_vnop_##op##_probed
+#else
+#define FUSE_VOP(op)	fuse_vnop_##op
+#endif
+
 struct vop_vector fuse_vnops = {
 	.vop_default       = &default_vnodeops,
-	.vop_access        = fuse_vnop_access,
-	.vop_close         = fuse_vnop_close,
-	.vop_create        = fuse_vnop_create,
-	.vop_fsync         = fuse_vnop_fsync,
-	.vop_getattr       = fuse_vnop_getattr,
-	.vop_inactive      = fuse_vnop_inactive,
-	.vop_link          = fuse_vnop_link,
-	.vop_lookup        = fuse_vnop_lookup,
-	.vop_mkdir         = fuse_vnop_mkdir,
-	.vop_mknod         = fuse_vnop_mknod,
-	.vop_open          = fuse_vnop_open,
+	.vop_access        = FUSE_VOP(access),
+	.vop_bmap          = FUSE_VOP(bmap),
+	.vop_close         = FUSE_VOP(close),
+	.vop_create        = FUSE_VOP(create),
+	.vop_fsync         = FUSE_VOP(fsync),
+	.vop_getattr       = FUSE_VOP(getattr),
+	.vop_inactive      = FUSE_VOP(inactive),
+	.vop_link          = FUSE_VOP(link),
+	.vop_lookup        = FUSE_VOP(lookup),
+	.vop_mkdir         = FUSE_VOP(mkdir),
+	.vop_mknod         = FUSE_VOP(mknod),
+	.vop_open          = FUSE_VOP(open),
 	.vop_pathconf      = vop_stdpathconf,
-	.vop_read          = fuse_vnop_read,
-	.vop_readdir       = fuse_vnop_readdir,
-	.vop_readlink      = fuse_vnop_readlink,
-	.vop_reclaim       = fuse_vnop_reclaim,
-	.vop_remove        = fuse_vnop_remove,
-	.vop_rename        = fuse_vnop_rename,
-	.vop_rmdir         = fuse_vnop_rmdir,
-	.vop_setattr       = fuse_vnop_setattr,
-	.vop_strategy      = fuse_vnop_strategy,
-	.vop_symlink       = fuse_vnop_symlink,
-	.vop_write         = fuse_vnop_write,
-	.vop_getpages      = fuse_vnop_getpages,
-	.vop_putpages      = fuse_vnop_putpages,
-	.vop_print         = fuse_vnop_print,
+	.vop_read          = FUSE_VOP(read),
+	.vop_readdir       = FUSE_VOP(readdir),
+	.vop_readlink      = FUSE_VOP(readlink),
+	.vop_reclaim       = FUSE_VOP(reclaim),
+	.vop_remove        = FUSE_VOP(remove),
+	.vop_rename        = FUSE_VOP(rename),
+	.vop_rmdir         = FUSE_VOP(rmdir),
+	.vop_setattr       = FUSE_VOP(setattr),
+	.vop_strategy      = FUSE_VOP(strategy),
+	.vop_symlink       = FUSE_VOP(symlink),
+	.vop_write         = FUSE_VOP(write),
+	.vop_getpages      = FUSE_VOP(getpages),
+	.vop_putpages      = FUSE_VOP(putpages),
+	.vop_print         = FUSE_VOP(print),
 };
 
 static u_long fuse_lookup_cache_hits = 0;
@@ -195,6 +264,51 @@ fuse_vnop_access(struct vop_access_args *ap)
     return err;
 }
 
+/*
+    struct vnop_bmap_args {
+	struct vnode *a_vp;
+	daddr_t a_bn;
+	struct bufobj **a_bop;
+	daddr_t *a_bnp;
+	int *a_runp;
+	int *a_runb;
+    };
+*/
+static int
+fuse_vnop_bmap(struct vop_bmap_args *ap)
+{
+    struct vnode *vp = ap->a_vp;
+    int biosize, maxrun;
+
+    if (fuse_isdeadfs(vp)) {
+        return ENXIO;
+    }
+
+    /*
+     * The file is a run of iosize blocks on a virtual device, so all of it
+     * is contiguous. Block numbers are in DEV_BSIZE units, as the clustering
+     * code expects; that's why fuse_io_strategy() goes by b_lblkno. Runs
+     * are cut at mnt_iosize_max, the most we put into one READ or WRITE
+     * (see fuse_internal_init_callback()); how far we read ahead is up to
+     * fuse_io_seqcount().
+     */
+    biosize = fuse_iosize(vp);
+    maxrun = vnode_mount(vp)->mnt_iosize_max / biosize;
+    if (maxrun > 0)
+        maxrun--;
+
+    if (ap->a_bop != NULL)
+        *ap->a_bop = &vp->v_bufobj;
+    if (ap->a_bnp != NULL)
+        *ap->a_bnp = ap->a_bn * btodb(biosize);
+    if (ap->a_runp != NULL)
+        *ap->a_runp = maxrun;
+    if (ap->a_runb != NULL)
+        *ap->a_runb = MIN(ap->a_bn, maxrun);
+
+    return 0;
+}
+
 /*
     struct vnop_close_args {
 	struct vnode *a_vp;
@@ -210,6 +324,7 @@ fuse_vnop_close(struct vop_close_args *ap)
     struct ucred *cred    = ap->a_cred;
     int           fflag   = ap->a_fflag;
     fufh_type_t fufh_type;
+    int err = 0;
 
     fuse_trace_printf_vnop();
 
@@ -240,11 +355,18 @@ fuse_vnop_close(struct vop_close_args *ap)
                 fufh_type, fflag);
     }
 
+    if ((fflag & FWRITE) && vnode_vtype(vp) == VREG &&
+        fsess_opt_writeback(vnode_mount(vp))) {
+        /* push cached data out, and own up if an earlier write-out failed */
+        if ((err = fuse_io_flushbuf(vp, MNT_WAIT, ap->a_td)) == 0)
+            err = fuse_io_wberror(vp);
+    }
+
     if ((VTOFUD(vp)->flag & FN_SIZECHANGE) != 0) {
         fuse_vnode_savesize(vp, cred);
     }
 
-    return 0;
+    return err;
 }
 
 /*
@@ -423,6 +545,16 @@ fuse_vnop_fsync(struct vop_fsync_args *ap)
     if ((err = vop_stdfsync(ap)))
         return err;
 
+    /* data the buffer cache wrote out on its own may have gone astray */
+    if (vnode_vtype(vp) == VREG)
+        err = fuse_io_wberror(vp);
+
+    /* with the data out, let the daemon know of the size and mtime, too */
+    if (vnode_vtype(vp) == VREG &&
+        (fvdat->flag & (FN_SIZECHANGE | FN_MTIMECHANGE)) != 0) {
+        fuse_vnode_savesize(vp, NULL);
+    }
+
     if (!fsess_isimpl(vnode_mount(vp),
         (vnode_vtype(vp) == VDIR ? FUSE_FSYNCDIR : FUSE_FSYNC))) {
         goto out;
@@ -436,7 +568,7 @@ fuse_vnop_fsync(struct vop_fsync_args *ap)
     }
 
 out:
-    return 0;
+    return err;
 }
 
 /*
@@ -474,6 +606,9 @@ fuse_vnop_getattr(struct vop_getattr_args *ap)
         if ((fvdat->flag & FN_SIZECHANGE) != 0) {
             vap->va_size = fvdat->filesize;
         }
+        if ((fvdat->flag & FN_MTIMECHANGE) != 0) {
+            vap->va_mtime = vap->va_ctime = fvdat->local_mtime;
+        }
         debug_printf("return cached: inode=%jd\n", VTOI(vp));
         return 0;
     }
@@ -508,6 +643,8 @@ fuse_vnop_getattr(struct vop_getattr_args *ap)
     }
     if ((fvdat->flag & FN_SIZECHANGE) != 0)
         vap->va_size = fvdat->filesize;
+    if ((fvdat->flag & FN_MTIMECHANGE) != 0)
+        vap->va_mtime = vap->va_ctime = fvdat->local_mtime;
 
     if (vnode_isreg(vp) && (fvdat->flag & FN_SIZECHANGE) == 0) {
         /*
@@ -566,6 +703,9 @@ fuse_vnop_inactive(struct vop_inactive_args *ap)
                     fuse_io_invalbuf(vp, td);
                 else
                     fuse_io_flushbuf(vp, MNT_WAIT, td);
+                if ((fvdat->flag & FN_MTIMECHANGE) != 0) {
+                    fuse_vnode_savesize(vp, NULL);
+                }
                 need_flush = 0;
             }
             fuse_filehandle_close(vp, type, td, NULL);
@@ -1643,6 +1783,13 @@ fuse_vnop_setattr(struct vop_setattr_args *ap)
         goto out;
     }
 
+    if ((fsai->valid & FATTR_MTIME) && vtyp == VREG &&
+        fsess_opt_writeback(vnode_mount(vp))) {
+        /* write out cached data first, lest it move mtime past this */
+        fuse_io_flushbuf(vp, MNT_WAIT, td);
+        VTOFUD(vp)->flag &= ~FN_MTIMECHANGE;
+    }
+
     if ((err = fdisp_wait_answ(&fdi))) {
         fuse_invalidate_attr(vp);
         goto out;
@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * Reply matching: depth requests are kept in flight, and each reply
+ * takes its ticket off the answer list by fuse_aw_lookup(), as
+ * fuse_device_write() does. The slot is then taken by a new request,
+ * put on the list by fuse_insert_callback(), as fdisp_send() does.
+ *
+ * The same is done with the single, linearly searched answer list the
+ * module had before it got hashed, for comparison.
+ *
+ * Replies come in random order, or with -f, in the order the requests
+ * were sent, which is the best case for the linear list. With -t, the
+ * requests are spread over that many threads.
+ */
+
+#include <sys/types.h>
+#include <sys/module.h>
+#include <sys/systm.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/queue.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+
+#include <err.h>
+#include <unistd.h>
+
+#include "fuse.h"
+#include "fuse_ipc.h"
+#include "fuse_ipcbench.h"
+
+struct aw_run {
+	struct fuse_data		*ar_data;
+	int				 ar_linear;
+	int				 ar_fifo;
+	u_long				 ar_unique;	/* for new requests */
+
+	/* the answer list as it was before it got hashed */
+	struct mtx			 ar_mtx;
+	TAILQ_HEAD(, fuse_ticket)	 ar_head;
+};
+
+struct aw_thread {
+	struct aw_run	*at_run;
+	int		 at_depth;
+	long		 at_ops;
+	uint32_t	 at_seed;
+};
+
+static int
+aw_handler(struct fuse_ticket *ftick, struct uio *uio)
+{
+	return (0);
+}
+
+static void
+aw_push(struct aw_run *ar, struct fuse_ticket *ftick)
+{
+	if (!ar->ar_linear) {
+		fuse_insert_callback(ftick, aw_handler);
+		return;
+	}
+
+	ftick->tk_aw_handler = aw_handler;
+	mtx_lock(&ar->ar_mtx);
+	refcount_acquire(&ftick->tk_refcount);
+	TAILQ_INSERT_TAIL(&ar->ar_head, ftick, tk_aw_link);
+	mtx_unlock(&ar->ar_mtx);
+}
+
+static struct fuse_ticket *
+aw_lookup(struct aw_run *ar, uint64_t unique)
+{
+	struct fuse_ticket *ftick, *x_ftick;
+
+	if (!ar->ar_linear)
+		return (fuse_aw_lookup(ar->ar_data, unique));
+
+	mtx_lock(&ar->ar_mtx);
+	TAILQ_FOREACH_SAFE(ftick, &ar->ar_head, tk_aw_link, x_ftick) {
+		if (ftick->tk_unique == unique) {
+			TAILQ_REMOVE(&ar->ar_head, ftick, tk_aw_link);
+#ifdef INVARIANTS
+			ftick->tk_aw_link.tqe_next = NULL;
+			ftick->tk_aw_link.tqe_prev = NULL;
+#endif
+			break;
+		}
+	}
+	mtx_unlock(&ar->ar_mtx);
+
+	return (ftick);
+}
+
+static void *
+aw_thread(void *arg)
+{
+	struct aw_thread *at = arg;
+	struct aw_run *ar = at->at_run;
+	struct fuse_ticket **tk, *ftick;
+	long op;
+	int i;
+
+	tk = malloc(sizeof(*tk) * at->at_depth, M_TEMP, M_WAITOK);
+	for (i = 0; i < at->at_depth; i++) {
+		tk[i] = fuse_ticket_fetch(ar->ar_data);
+		aw_push(ar, tk[i]);
+	}
+
+	bench_sync();
+	for (op = 0; op < at->at_ops; op++) {
+		if (ar->ar_fifo)
+			i = op % at->at_depth;
+		else
+			i = bench_random(&at->at_seed) % at->at_depth;
+		ftick = aw_lookup(ar, tk[i]->tk_unique);
+		if (ftick != tk[i])
+			errx(1, "reply of #%ju matched to %p instead of %p",
+			    (uintmax_t)tk[i]->tk_unique, ftick, tk[i]);
+		ftick->tk_unique = atomic_fetchadd_long(&ar->ar_unique, 1);
+		aw_push(ar, ftick);
+		/* the reference of the list we took it off */
+		fuse_ticket_drop(ftick);
+	}
+	bench_sync();
+
+	for (i = 0; i < at->at_depth; i++) {
+		ftick = aw_lookup(ar, tk[i]->tk_unique);
+		fuse_ticket_drop(ftick);
+		fuse_ticket_drop(ftick);
+	}
+	free(tk, M_TEMP);
+
+	return (NULL);
+}
+
+/* nsecs a thread spends on a reply, on average */
+static double
+aw_measure(struct aw_run *ar, int depth, int nthreads, long ops)
+{
+	struct aw_thread *at;
+	uint64_t nsecs;
+	int i;
+
+	ar->ar_data = bench_session();
+	/* well beyond the uniques given out by fuse_ticket_fetch() */
+	ar->ar_unique = 1UL << 40;
+	mtx_init(&ar->ar_mtx, "aw_run list mutex", NULL, MTX_DEF);
+	TAILQ_INIT(&ar->ar_head);
+
+	at = malloc(sizeof(*at) * nthreads, M_TEMP, M_WAITOK | M_ZERO);
+	for (i = 0; i < nthreads; i++) {
+		at[i].at_run = ar;
+		at[i].at_depth = depth / nthreads;
+		at[i].at_ops = ops;
+		at[i].at_seed = 2463534242U + i;
+	}
+	nsecs = bench_run(nthreads, aw_thread, at, sizeof(*at));
+	free(at, M_TEMP);
+
+	MPASS(TAILQ_EMPTY(&ar->ar_head));
+	mtx_destroy(&ar->ar_mtx);
+	bench_session_done(ar->ar_data);
+
+	return ((double)nsecs / ops);
+}
+
+int
+aw_main(int argc, char **argv)
+{
+	static const int depths[] =
+	    { 1, 4, 16, 64, 256, 1024, 4096, 16384 };
+	struct aw_run ar;
+	long ops = 100000, lops;
+	int nthreads = 1;
+	int ch, depth, i, n;
+
+	memset(&ar, 0, sizeof(ar));
+	while ((ch = getopt(argc, argv, "fn:t:")) != -1) {
+		switch (ch) {
+		case 'f':
+			ar.ar_fifo = 1;
+			break;
+		case 'n':
+			ops = bench_number(optarg, "number of ops", 1);
+			break;
+		case 't':
+			nthreads = bench_number(optarg, "number of threads", 1);
+			break;
+		default:
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	printf("%8s %14s %14s\n", "depth", "hashed ns/op", "linear ns/op");
+	n = argc > 0 ? argc : (int)nitems(depths);
+	for (i = 0; i < n; i++) {
+		depth = argc > 0 ? bench_number(argv[i], "depth", 1) :
+		    depths[i];
+		depth = roundup(depth, nthreads);
+
+		ar.ar_linear = 0;
+		printf("%8d %14.1f", depth,
+		    aw_measure(&ar, depth, nthreads, ops));
+		fflush(stdout);
+
+		/* the linear list takes ages at depth, so do fewer ops */
+		lops = MIN(ops, MAX(ops * 64 / depth, 1000));
+		ar.ar_linear = 1;
+		printf(" %14.1f\n", aw_measure(&ar, depth, nthreads, lops));
+	}
+
+	return (0);
+}
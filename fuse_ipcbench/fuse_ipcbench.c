@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * Userland benchmarks of the message passing code of the module:
+ * fuse_ipc.c is built as is against the kernel shims of kshim.h, and
+ * driven by threads standing in for requesters and daemon threads.
+ *
+ *   aw  cost of matching a reply to its ticket vs. the number of
+ *       requests in flight (see awbench.c)
+ *   ms  throughput of the message queue between requesters and daemon
+ *       threads, checking that nothing gets lost (see msbench.c)
+ */
+
+#include <sys/types.h>
+#include <sys/module.h>
+#include <sys/systm.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/queue.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+
+#include <err.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fuse.h"
+#include "fuse_ipc.h"
+#include "fuse_ipcbench.h"
+
+static const struct bench {
+	const char	*b_name;
+	int		(*b_main)(int argc, char **argv);
+	const char	*b_usage;
+} benches[] = {
+	{ "aw", aw_main, "[-f] [-n ops] [-t threads] [depth ...]" },
+	{ "ms", ms_main,
+	    "[-x] [-c chans] [-m consumers] [-n msgs] [producers ...]" },
+};
+
+static struct cdev bench_dev;
+static pthread_barrier_t bench_barrier;
+
+static void
+usage(void)
+{
+	u_int i;
+
+	for (i = 0; i < nitems(benches); i++)
+		fprintf(stderr, "%s %s %s %s\n", i == 0 ? "usage:" : "      ",
+		    getprogname(), benches[i].b_name, benches[i].b_usage);
+	exit(1);
+}
+
+struct fuse_data *
+bench_session(void)
+{
+	struct fuse_data *data;
+
+	data = fdata_alloc(&bench_dev, curthread->td_ucred);
+	data->dataflags |= FSESS_OPENED | FSESS_INITED;
+	bench_dev.si_drv1 = data;
+	bench_dev.si_drv2 = data->chans[0];
+
+	return (data);
+}
+
+void
+bench_session_done(struct fuse_data *data)
+{
+	data->dataflags &= ~FSESS_OPENED;
+	bench_dev.si_drv1 = NULL;
+	bench_dev.si_drv2 = NULL;
+	fdata_trydestroy(data);
+}
+
+long
+bench_number(const char *s, const char *what, long min)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, 0);
+	if (errno != 0 || *s == '\0' || *end != '\0' || n < min)
+		errx(1, "bad %s: %s", what, s);
+
+	return (n);
+}
+
+uint64_t
+bench_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* xorshift32, state must not be 0 */
+uint32_t
+bench_random(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+void
+bench_sync(void)
+{
+	pthread_barrier_wait(&bench_barrier);
+}
+
+uint64_t
+bench_run(int nthreads, void *(*fn)(void *), void *args, size_t size)
+{
+	pthread_t *threads;
+	uint64_t start;
+	int i, error;
+
+	threads = malloc(sizeof(*threads) * nthreads, M_TEMP, M_WAITOK);
+	pthread_barrier_init(&bench_barrier, NULL, nthreads + 1);
+	for (i = 0; i < nthreads; i++) {
+		error = pthread_create(&threads[i], NULL, fn,
+		    (char *)args + i * size);
+		if (error != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+
+	bench_sync();
+	start = bench_nsecs();
+	bench_sync();
+	start = bench_nsecs() - start;
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_barrier_destroy(&bench_barrier);
+	free(threads, M_TEMP);
+
+	return (start);
+}
+
+int
+main(int argc, char **argv)
+{
+	u_int i;
+
+	if (argc < 2)
+		usage();
+
+	kshim_init();
+	mtx_init(&fuse_mtx, "fuse_mtx", NULL, MTX_DEF);
+	fuse_ipc_init();
+
+	for (i = 0; i < nitems(benches); i++)
+		if (strcmp(argv[1], benches[i].b_name) == 0)
+			break;
+	if (i == nitems(benches))
+		usage();
+	if (benches[i].b_main(argc - 1, argv + 1) != 0)
+		usage();
+
+	fuse_ipc_destroy();
+	mtx_destroy(&fuse_mtx);
+
+	return (0);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#ifndef _FUSE_IPCBENCH_H_
+#define _FUSE_IPCBENCH_H_
+
+struct fuse_data;
+
+/* a session with no mount and no daemon, past INIT */
+struct fuse_data *bench_session(void);
+void		  bench_session_done(struct fuse_data *data);
+
+long		  bench_number(const char *s, const char *what, long min);
+uint64_t	  bench_nsecs(void);
+uint32_t	  bench_random(uint32_t *state);
+
+/*
+ * Run fn in nthreads threads, each given its own slot of args, which is
+ * an array of elements of size bytes. The threads call bench_sync() right
+ * before and right after the part to be measured; the wall clock time in
+ * between, in nsecs, is returned.
+ */
+uint64_t	  bench_run(int nthreads, void *(*fn)(void *), void *args,
+		      size_t size);
+void		  bench_sync(void);
+
+int		  aw_main(int argc, char **argv);
+int		  ms_main(int argc, char **argv);
+
+#endif /* _FUSE_IPCBENCH_H_ */
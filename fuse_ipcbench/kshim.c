@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * The kernel primitives of kshim.h.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <err.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <kshim.h>
+
+int hz = 1000;
+int tick = 1000;		/* usecs */
+int mp_ncpus = 1;
+u_int mp_maxid = KSHIM_MAXCPU - 1;
+
+static struct ucred kshim_cred;
+static struct kshim_sysctl *kshim_sysctls;
+
+/*
+ * What the kernel keeps of a thread: its identity, its cpu and the
+ * condition variable it sleeps on.
+ */
+struct kshim_td {
+	struct thread		 kt_td;
+	struct proc		 kt_proc;
+	u_int			 kt_cpu;
+	void			*kt_chan;	/* NULL if not asleep */
+	pthread_cond_t		 kt_cv;
+	TAILQ_ENTRY(kshim_td)	 kt_link;
+};
+
+static __thread struct kshim_td *kshim_td;
+static pthread_key_t kshim_td_key;
+
+/* cpus of exited threads, to be handed out again */
+static pthread_mutex_t kshim_cpu_mtx = PTHREAD_MUTEX_INITIALIZER;
+static u_int kshim_cpu_free[KSHIM_MAXCPU];
+static u_int kshim_cpu_nfree;
+static u_int kshim_cpu_next;
+
+/*
+ * Sleeping threads are hashed by their wait channel, like in the
+ * kernel's sleep queues.
+ */
+#define KSHIM_SQ_HASHSIZE	128
+
+static struct kshim_sq {
+	pthread_mutex_t		 sq_mtx;
+	TAILQ_HEAD(, kshim_td)	 sq_head;
+} __aligned(CACHE_LINE_SIZE) kshim_sq[KSHIM_SQ_HASHSIZE];
+
+void
+panic(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	fprintf(stderr, "panic: ");
+	vfprintf(stderr, fmt, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+	abort();
+}
+
+static void
+kshim_td_exit(void *arg)
+{
+	struct kshim_td *kt = arg;
+
+	pthread_mutex_lock(&kshim_cpu_mtx);
+	kshim_cpu_free[kshim_cpu_nfree++] = kt->kt_cpu;
+	pthread_mutex_unlock(&kshim_cpu_mtx);
+	pthread_cond_destroy(&kt->kt_cv);
+	(free)(kt);
+}
+
+void
+kshim_init(void)
+{
+	long n;
+	int i;
+
+	if ((n = sysconf(_SC_NPROCESSORS_ONLN)) > 0)
+		mp_ncpus = MIN(n, KSHIM_MAXCPU);
+	for (i = 0; i < KSHIM_SQ_HASHSIZE; i++) {
+		pthread_mutex_init(&kshim_sq[i].sq_mtx, NULL);
+		TAILQ_INIT(&kshim_sq[i].sq_head);
+	}
+	kshim_cred.cr_uid = kshim_cred.cr_ruid = kshim_cred.cr_svuid =
+	    getuid();
+	kshim_cred.cr_groups[0] = kshim_cred.cr_rgid = kshim_cred.cr_svgid =
+	    getgid();
+	pthread_key_create(&kshim_td_key, kshim_td_exit);
+}
+
+/*
+ * Every thread is its own cpu, as long as there are cpus left. The cpu
+ * of an exited thread is handed out again, along with the tickets left
+ * in its cache.
+ */
+static struct kshim_td *
+kshim_td_get(void)
+{
+	struct kshim_td *kt;
+
+	if ((kt = kshim_td) != NULL)
+		return (kt);
+
+	if ((kt = calloc(1, sizeof(*kt))) == NULL)
+		err(1, "calloc");
+	pthread_mutex_lock(&kshim_cpu_mtx);
+	if (kshim_cpu_nfree > 0)
+		kt->kt_cpu = kshim_cpu_free[--kshim_cpu_nfree];
+	else if (kshim_cpu_next <= mp_maxid)
+		kt->kt_cpu = kshim_cpu_next++;
+	else
+		errx(1, "more than %d threads", KSHIM_MAXCPU);
+	pthread_mutex_unlock(&kshim_cpu_mtx);
+	kt->kt_proc.p_pid = getpid();
+	kt->kt_td.td_proc = &kt->kt_proc;
+	kt->kt_td.td_ucred = &kshim_cred;
+	pthread_cond_init(&kt->kt_cv, NULL);
+	pthread_setspecific(kshim_td_key, kt);
+	kshim_td = kt;
+
+	return (kt);
+}
+
+struct thread *
+kshim_curthread(void)
+{
+	return (&kshim_td_get()->kt_td);
+}
+
+u_int
+kshim_curcpu(void)
+{
+	return (kshim_td_get()->kt_cpu);
+}
+
+int
+kshim_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int)(ts.tv_sec * hz + ts.tv_nsec / (1000000000 / hz)));
+}
+
+void
+binuptime(struct bintime *bt)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	bt->sec = ts.tv_sec;
+	/* 2^64 / 10^9, rounded down */
+	bt->frac = (uint64_t)ts.tv_nsec * 18446744073ULL;
+}
+
+void
+nanouptime(struct timespec *ts)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+/* memory */
+
+MALLOC_DEFINE(M_TEMP, "temp", "misc temporary data buffers");
+
+void *
+kshim_malloc(size_t size, int flags)
+{
+	void *p;
+
+	if ((p = (malloc)(size)) == NULL) {
+		if (flags & M_WAITOK)
+			err(1, "malloc");
+		return (NULL);
+	}
+	if (flags & M_ZERO)
+		memset(p, 0, size);
+
+	return (p);
+}
+
+/*
+ * Zones keep freed items as they are, that is, initialized; the
+ * constructor and the destructor are run on each allocation and free.
+ * Like in the kernel, each cpu caches a bucket to allocate from and one
+ * to free to, and full buckets are traded with the zone, so that the
+ * zone lock is only taken once per UMA_BUCKET_SIZE items.
+ */
+#define UMA_BUCKET_SIZE	64
+
+struct uma_bucket {
+	struct uma_bucket	*ub_next;
+	int			 ub_cnt;
+	void			*ub_items[UMA_BUCKET_SIZE];
+};
+
+struct uma_cache {
+	struct uma_bucket	*uc_alloc;
+	struct uma_bucket	*uc_free;
+} __aligned(CACHE_LINE_SIZE);
+
+struct uma_zone {
+	const char		*uz_name;
+	size_t			 uz_size;
+	size_t			 uz_align;
+	uma_ctor		 uz_ctor;
+	uma_dtor		 uz_dtor;
+	uma_init		 uz_init;
+	uma_fini		 uz_fini;
+	pthread_mutex_t		 uz_mtx;
+	struct uma_bucket	*uz_full;
+	struct uma_bucket	*uz_empty;
+	struct uma_cache	 uz_cache[KSHIM_MAXCPU];
+};
+
+uma_zone_t
+uma_zcreate(const char *name, size_t size, uma_ctor ctor, uma_dtor dtor,
+    uma_init uminit, uma_fini fini, int align, uint32_t flags)
+{
+	struct uma_zone *zone;
+
+	if (posix_memalign((void **)&zone, CACHE_LINE_SIZE,
+	    sizeof(*zone)) != 0)
+		err(1, "%s: posix_memalign", name);
+	memset(zone, 0, sizeof(*zone));
+	zone->uz_name = name;
+	zone->uz_align = MAX((size_t)align + 1, sizeof(void *));
+	zone->uz_size = roundup(size, zone->uz_align);
+	zone->uz_ctor = ctor;
+	zone->uz_dtor = dtor;
+	zone->uz_init = uminit;
+	zone->uz_fini = fini;
+	pthread_mutex_init(&zone->uz_mtx, NULL);
+
+	return (zone);
+}
+
+static void
+uma_bucket_free(uma_zone_t zone, struct uma_bucket *bucket)
+{
+	int i;
+
+	if (bucket == NULL)
+		return;
+	for (i = 0; i < bucket->ub_cnt; i++) {
+		if (zone->uz_fini != NULL)
+			zone->uz_fini(bucket->ub_items[i], zone->uz_size);
+		(free)(bucket->ub_items[i]);
+	}
+	(free)(bucket);
+}
+
+void
+uma_zdestroy(uma_zone_t zone)
+{
+	struct uma_bucket *bucket;
+	int i;
+
+	for (i = 0; i < KSHIM_MAXCPU; i++) {
+		uma_bucket_free(zone, zone->uz_cache[i].uc_alloc);
+		uma_bucket_free(zone, zone->uz_cache[i].uc_free);
+	}
+	while ((bucket = zone->uz_full) != NULL) {
+		zone->uz_full = bucket->ub_next;
+		uma_bucket_free(zone, bucket);
+	}
+	while ((bucket = zone->uz_empty) != NULL) {
+		zone->uz_empty = bucket->ub_next;
+		uma_bucket_free(zone, bucket);
+	}
+	pthread_mutex_destroy(&zone->uz_mtx);
+	(free)(zone);
+}
+
+void *
+uma_zalloc_arg(uma_zone_t zone, void *arg, int flags)
+{
+	struct uma_cache *cache = &zone->uz_cache[curcpu];
+	struct uma_bucket *bucket;
+	void *item = NULL;
+
+	if ((bucket = cache->uc_alloc) == NULL || bucket->ub_cnt == 0) {
+		if (cache->uc_free != NULL && cache->uc_free->ub_cnt > 0) {
+			cache->uc_alloc = cache->uc_free;
+			cache->uc_free = bucket;
+		} else {
+			/* trade the empty bucket for a full one */
+			pthread_mutex_lock(&zone->uz_mtx);
+			if (zone->uz_full != NULL) {
+				if (bucket != NULL) {
+					bucket->ub_next = zone->uz_empty;
+					zone->uz_empty = bucket;
+				}
+				cache->uc_alloc = zone->uz_full;
+				zone->uz_full = zone->uz_full->ub_next;
+			}
+			pthread_mutex_unlock(&zone->uz_mtx);
+		}
+		bucket = cache->uc_alloc;
+	}
+	if (bucket != NULL && bucket->ub_cnt > 0)
+		item = bucket->ub_items[--bucket->ub_cnt];
+
+	if (item == NULL) {
+		if (posix_memalign(&item, zone->uz_align, zone->uz_size) != 0)
+			err(1, "%s: posix_memalign", zone->uz_name);
+		if (zone->uz_init != NULL)
+			zone->uz_init(item, zone->uz_size, flags);
+	}
+	if (zone->uz_ctor != NULL)
+		zone->uz_ctor(item, zone->uz_size, arg, flags);
+
+	return (item);
+}
+
+void
+uma_zfree_arg(uma_zone_t zone, void *mem, void *arg)
+{
+	struct uma_cache *cache = &zone->uz_cache[curcpu];
+	struct uma_bucket *bucket;
+
+	if (zone->uz_dtor != NULL)
+		zone->uz_dtor(mem, zone->uz_size, arg);
+
+	if ((bucket = cache->uc_free) == NULL ||
+	    bucket->ub_cnt == UMA_BUCKET_SIZE) {
+		/* trade the full bucket for an empty one */
+		pthread_mutex_lock(&zone->uz_mtx);
+		if (bucket != NULL) {
+			bucket->ub_next = zone->uz_full;
+			zone->uz_full = bucket;
+		}
+		if ((bucket = zone->uz_empty) != NULL)
+			zone->uz_empty = bucket->ub_next;
+		pthread_mutex_unlock(&zone->uz_mtx);
+		if (bucket == NULL)
+			bucket = kshim_malloc(sizeof(*bucket), M_WAITOK);
+		bucket->ub_cnt = 0;
+		cache->uc_free = bucket;
+	}
+	bucket->ub_items[bucket->ub_cnt++] = mem;
+}
+
+counter_u64_t
+counter_u64_alloc(int flags)
+{
+	return (kshim_malloc(sizeof(uint64_t), flags | M_ZERO));
+}
+
+void
+counter_u64_free(counter_u64_t c)
+{
+	(free)(c);
+}
+
+/* locks */
+
+void
+mtx_init(struct mtx *m, const char *name, const char *type, int opts)
+{
+	pthread_mutex_init(&m->mtx_lock, NULL);
+	m->mtx_owner = NULL;
+	m->mtx_name = name;
+}
+
+void
+mtx_destroy(struct mtx *m)
+{
+	mtx_assert(m, MA_NOTOWNED);
+	pthread_mutex_destroy(&m->mtx_lock);
+}
+
+void
+mtx_lock(struct mtx *m)
+{
+	struct thread *td = curthread;
+
+	KASSERT(m->mtx_owner != td, ("mutex %s recursed", m->mtx_name));
+	pthread_mutex_lock(&m->mtx_lock);
+	m->mtx_owner = td;
+}
+
+void
+mtx_unlock(struct mtx *m)
+{
+	mtx_assert(m, MA_OWNED);
+	m->mtx_owner = NULL;
+	pthread_mutex_unlock(&m->mtx_lock);
+}
+
+/* sleeping */
+
+static struct kshim_sq *
+kshim_sq_lookup(void *chan)
+{
+	return (&kshim_sq[((uintptr_t)chan >> 6) % KSHIM_SQ_HASHSIZE]);
+}
+
+/*
+ * The sleeper gets on the queue before it lets go of the interlock, and
+ * wakers take it off under the queue lock, so no wakeup gets lost. There
+ * are no signals here, so PCATCH has no effect.
+ */
+int
+msleep(void *chan, struct mtx *m, int pri, const char *wmesg, int timo)
+{
+	struct kshim_td *kt = kshim_td_get();
+	struct kshim_sq *sq = kshim_sq_lookup(chan);
+	struct timespec ts;
+	int error = 0;
+
+	mtx_assert(m, MA_OWNED);
+
+	if (timo > 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timo / hz;
+		ts.tv_nsec += (long)(timo % hz) * (1000000000 / hz);
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&sq->sq_mtx);
+	kt->kt_chan = chan;
+	TAILQ_INSERT_TAIL(&sq->sq_head, kt, kt_link);
+	mtx_unlock(m);
+
+	while (kt->kt_chan != NULL && error == 0) {
+		if (timo > 0)
+			error = pthread_cond_timedwait(&kt->kt_cv,
+			    &sq->sq_mtx, &ts);
+		else
+			pthread_cond_wait(&kt->kt_cv, &sq->sq_mtx);
+	}
+	if (kt->kt_chan != NULL) {
+		/* timed out */
+		TAILQ_REMOVE(&sq->sq_head, kt, kt_link);
+		kt->kt_chan = NULL;
+		error = EWOULDBLOCK;
+	} else
+		error = 0;
+	pthread_mutex_unlock(&sq->sq_mtx);
+
+	if (!(pri & PDROP))
+		mtx_lock(m);
+
+	return (error);
+}
+
+static void
+kshim_wakeup(void *chan, int all)
+{
+	struct kshim_sq *sq = kshim_sq_lookup(chan);
+	struct kshim_td *kt, *next;
+
+	pthread_mutex_lock(&sq->sq_mtx);
+	for (kt = TAILQ_FIRST(&sq->sq_head); kt != NULL; kt = next) {
+		next = TAILQ_NEXT(kt, kt_link);
+		if (kt->kt_chan != chan)
+			continue;
+		TAILQ_REMOVE(&sq->sq_head, kt, kt_link);
+		kt->kt_chan = NULL;
+		pthread_cond_signal(&kt->kt_cv);
+		if (!all)
+			break;
+	}
+	pthread_mutex_unlock(&sq->sq_mtx);
+}
+
+void
+wakeup(void *chan)
+{
+	kshim_wakeup(chan, 1);
+}
+
+void
+wakeup_one(void *chan)
+{
+	kshim_wakeup(chan, 0);
+}
+
+/* uio, kernel space only */
+
+int
+uiomove(void *cp, int n, struct uio *uio)
+{
+	struct iovec *iov;
+	size_t cnt;
+
+	KASSERT(uio->uio_segflg == UIO_SYSSPACE, ("uiomove: not UIO_SYSSPACE"));
+
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		cnt = iov->iov_len;
+		if (cnt == 0) {
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			continue;
+		}
+		if (cnt > (size_t)n)
+			cnt = n;
+		if (uio->uio_rw == UIO_READ)
+			memcpy(iov->iov_base, cp, cnt);
+		else
+			memcpy(cp, iov->iov_base, cnt);
+		iov->iov_base = (char *)iov->iov_base + cnt;
+		iov->iov_len -= cnt;
+		uio->uio_resid -= cnt;
+		uio->uio_offset += cnt;
+		cp = (char *)cp + cnt;
+		n -= cnt;
+	}
+
+	return (0);
+}
+
+/* sysctls */
+
+void
+kshim_sysctl_register(struct kshim_sysctl *ks)
+{
+	ks->ks_next = kshim_sysctls;
+	kshim_sysctls = ks;
+}
+
+/*
+ * Look up a sysctl by its name, like "vfs.fuse.lockless_submit". The
+ * parents are known by their C names, like _vfs_fuse.
+ */
+void *
+kshim_sysctl(const char *name, int *typep)
+{
+	struct kshim_sysctl *ks;
+	char buf[256];
+	char *p;
+
+	for (ks = kshim_sysctls; ks != NULL; ks = ks->ks_next) {
+		snprintf(buf, sizeof(buf), "%s.%s", ks->ks_parent + 1,
+		    ks->ks_name);
+		for (p = buf; *p != '.'; p++)
+			if (*p == '_')
+				*p = '.';
+		if (strcmp(buf, name) == 0) {
+			if (typep != NULL)
+				*typep = ks->ks_type;
+			return (ks->ks_ptr);
+		}
+	}
+
+	return (NULL);
+}
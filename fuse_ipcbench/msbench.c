@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * Message queue: producers send messages by fuse_insert_message(), as
+ * requesters do through fdisp_send(), while consumers take them off the
+ * channels as fuse_device_read() does, going to sleep on the channel
+ * when it's empty. This is done once with the lockless submission path
+ * and once with the locked one, and the messages per second are given.
+ *
+ * Each run is a stress test of the queue, too: every message has to be
+ * delivered exactly once, and those of a given producer in the order
+ * sent (per lane, as lanes take turns). A consumer which times out in
+ * its sleep while messages are queued on its channel reports a lost
+ * wakeup. The lane statistics of the channels have to add up to the
+ * messages delivered, and tickets leaked by a reference count going
+ * astray are caught as the session is torn down.
+ *
+ * With -c, the session has that many channels, read by the consumers in
+ * turn. With -x, the extra channels are closed halfway through, racing
+ * the producers which still send to them; messages are then handed over
+ * to the primary channel in no particular order, so only delivery is
+ * checked.
+ */
+
+#include <sys/types.h>
+#include <sys/module.h>
+#include <sys/systm.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/queue.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+
+#include <err.h>
+#include <unistd.h>
+
+#include "fuse.h"
+#include "fuse_ipc.h"
+#include "fuse_ipcbench.h"
+
+/* long enough not to go off while the queue is busy */
+#define MS_LOSTWAKEUP_SECS	5
+
+struct ms_msg {
+	uint32_t	mm_producer;
+	uint32_t	mm_pad;
+	uint64_t	mm_seq;
+};
+
+struct ms_run {
+	struct fuse_data	*mr_data;
+	struct mount		 mr_mount;
+	int			 mr_nchans;
+	int			 mr_close;
+	int			 mr_nproducers;
+	long			 mr_msgs;	/* per producer */
+	long			 mr_total;
+	volatile long		 mr_consumed;
+	volatile u_int		 mr_producing;
+	u_int			*mr_seen;	/* by producer and seq */
+	uint64_t		*mr_next;	/* by producer and lane */
+	struct cdev		 mr_devs[FUSE_MAXCHANS];
+};
+
+struct ms_thread {
+	struct ms_run	*mt_run;
+	int		 mt_id;
+	int		 mt_producer;
+};
+
+static void
+ms_produce(struct ms_thread *mt)
+{
+	struct ms_run *mr = mt->mt_run;
+	struct fuse_dispatcher fdi;
+	struct ms_msg *mm;
+	enum fuse_opcode op;
+	long seq;
+
+	bench_sync();
+	for (seq = 0; seq < mr->mr_msgs; seq++) {
+		/* a mix of the lanes: control, data and metadata */
+		if (seq % 16 == 15)
+			op = FUSE_FORGET;
+		else if (seq % 4 == 3)
+			op = FUSE_READ;
+		else
+			op = FUSE_GETATTR;
+		fdisp_init(&fdi, sizeof(*mm));
+		fdisp_make_pid(&fdi, op, &mr->mr_mount, mt->mt_id + 1,
+		    curthread->td_proc->p_pid, curthread->td_ucred);
+		mm = fdi.indata;
+		mm->mm_producer = mt->mt_id;
+		mm->mm_seq = seq;
+		fuse_insert_message(fdi.tick);
+		fdisp_destroy(&fdi);
+	}
+	/* the last one out lets the consumers go once they're done */
+	if (atomic_fetchadd_int(&mr->mr_producing, -1) == 1)
+		fdata_set_dead(mr->mr_data);
+	bench_sync();
+}
+
+/* Called with the message list mutex of the channel ftick came from. */
+static void
+ms_check_order(struct ms_run *mr, struct fuse_ticket *ftick)
+{
+	struct fuse_in_header *ihead = ftick->tk_ms_fiov.base;
+	struct ms_msg *mm = (struct ms_msg *)(ihead + 1);
+	uint64_t *next;
+
+	next = &mr->mr_next[mm->mm_producer * FUSE_NLANES +
+	    ftick->tk_ms_lane];
+	if (mm->mm_seq < *next)
+		errx(1, "message #%ju of producer %u overtaken on lane %d",
+		    (uintmax_t)mm->mm_seq, mm->mm_producer, ftick->tk_ms_lane);
+	*next = mm->mm_seq + 1;
+}
+
+static void
+ms_check_delivery(struct ms_run *mr, struct fuse_ticket *ftick)
+{
+	char buf[sizeof(struct fuse_in_header) + sizeof(struct ms_msg)];
+	struct fuse_in_header *ihead = (struct fuse_in_header *)buf;
+	struct ms_msg *mm = (struct ms_msg *)(ihead + 1);
+
+	/* what the copyout would see */
+	if (ftick->tk_ms_fiov.len != sizeof(buf))
+		errx(1, "message of %zu bytes instead of %zu",
+		    ftick->tk_ms_fiov.len, sizeof(buf));
+	memcpy(buf, ftick->tk_ms_fiov.base, sizeof(buf));
+
+	if (ihead->unique != ftick->tk_unique ||
+	    ihead->nodeid != mm->mm_producer + 1 ||
+	    mm->mm_producer >= (u_int)mr->mr_nproducers ||
+	    mm->mm_seq >= (uint64_t)mr->mr_msgs)
+		errx(1, "garbled message #%ju", (uintmax_t)ihead->unique);
+	if (atomic_fetchadd_int(&mr->mr_seen[mm->mm_producer * mr->mr_msgs +
+	    mm->mm_seq], 1) != 0)
+		errx(1, "message #%ju of producer %u delivered twice",
+		    (uintmax_t)mm->mm_seq, mm->mm_producer);
+}
+
+/*
+ * Take an extra channel out of service, as fuse_device_close() does, and
+ * get the other consumers off it.
+ */
+static void
+ms_close(struct fuse_chan *chan)
+{
+	fchan_close(chan);
+	fuse_lck_mtx_lock(chan->ms_mtx);
+	wakeup(chan);
+	fuse_lck_mtx_unlock(chan->ms_mtx);
+
+	FUSE_LOCK();
+	chan->ch_dev = NULL;
+	FUSE_UNLOCK();
+}
+
+static void
+ms_consume(struct ms_thread *mt)
+{
+	struct ms_run *mr = mt->mt_run;
+	struct fuse_data *data = mr->mr_data;
+	struct fuse_chan *chan = data->chans[mt->mt_id % mr->mr_nchans];
+	struct fuse_ticket *ftick;
+	long consumed;
+	int err;
+
+	bench_sync();
+	fuse_lck_mtx_lock(chan->ms_mtx);
+	for (;;) {
+		if ((ftick = fuse_ms_pop(chan)) != NULL) {
+			if (!mr->mr_close)
+				ms_check_order(mr, ftick);
+			fuse_lck_mtx_unlock(chan->ms_mtx);
+
+			ms_check_delivery(mr, ftick);
+			fuse_ticket_drop(ftick);
+			consumed = atomic_fetchadd_long(&mr->mr_consumed, 1);
+
+			/* the first consumer of a channel closes it */
+			if (mr->mr_close && chan != data->chans[0] &&
+			    mt->mt_id < mr->mr_nchans &&
+			    consumed >= mr->mr_total / 2) {
+				ms_close(chan);
+				chan = data->chans[0];
+			}
+			fuse_lck_mtx_lock(chan->ms_mtx);
+			continue;
+		}
+		if (chan->ch_flags & FCH_CLOSED) {
+			fuse_lck_mtx_unlock(chan->ms_mtx);
+			chan = data->chans[0];
+			fuse_lck_mtx_lock(chan->ms_mtx);
+			continue;
+		}
+		if (fdata_get_dead(data))
+			break;
+
+		chan->ch_sleepers++;
+		err = msleep(chan, &chan->ms_mtx, PCATCH, "fu_msg",
+		    MS_LOSTWAKEUP_SECS * hz);
+		chan->ch_sleepers--;
+		if (err == EWOULDBLOCK && fuse_ms_count(chan) > 0)
+			errx(1, "lost wakeup: %d messages queued on a channel "
+			    "with a reader asleep", fuse_ms_count(chan));
+	}
+	fuse_lck_mtx_unlock(chan->ms_mtx);
+	bench_sync();
+}
+
+static void *
+ms_thread(void *arg)
+{
+	struct ms_thread *mt = arg;
+
+	if (mt->mt_producer)
+		ms_produce(mt);
+	else
+		ms_consume(mt);
+
+	return (NULL);
+}
+
+/* messages per second */
+static double
+ms_measure(struct ms_run *mr, int nproducers, int nconsumers, long total)
+{
+	struct fuse_chan *chan;
+	struct fuse_ms_lane *ml;
+	struct ms_thread *mt;
+	counter_u64_t *tickets;
+	u_long count;
+	uint64_t nsecs;
+	long i;
+	int nthreads;
+
+	mr->mr_data = bench_session();
+	mr->mr_mount.mnt_data = mr->mr_data;
+	FUSE_LOCK();
+	for (i = 1; i < mr->mr_nchans; i++) {
+		chan = fchan_alloc(mr->mr_data, &mr->mr_devs[i]);
+		if (fdata_attach_chan(mr->mr_data, chan) != 0)
+			panic("can't attach channel %ld", i);
+	}
+	FUSE_UNLOCK();
+
+	mr->mr_nproducers = nproducers;
+	mr->mr_msgs = howmany(total, nproducers);
+	mr->mr_total = mr->mr_msgs * nproducers;
+	mr->mr_consumed = 0;
+	mr->mr_producing = nproducers;
+	mr->mr_seen = malloc(sizeof(*mr->mr_seen) * mr->mr_total, M_TEMP,
+	    M_WAITOK | M_ZERO);
+	mr->mr_next = malloc(sizeof(*mr->mr_next) * nproducers * FUSE_NLANES,
+	    M_TEMP, M_WAITOK | M_ZERO);
+
+	nthreads = nproducers + nconsumers;
+	mt = malloc(sizeof(*mt) * nthreads, M_TEMP, M_WAITOK | M_ZERO);
+	for (i = 0; i < nthreads; i++) {
+		mt[i].mt_run = mr;
+		mt[i].mt_producer = i < nproducers;
+		mt[i].mt_id = i < nproducers ? i : i - nproducers;
+	}
+	nsecs = bench_run(nthreads, ms_thread, mt, sizeof(*mt));
+	free(mt, M_TEMP);
+
+	if (mr->mr_consumed != mr->mr_total)
+		errx(1, "%ld messages delivered out of %ld",
+		    mr->mr_consumed, mr->mr_total);
+	for (i = 0; i < mr->mr_total; i++)
+		if (mr->mr_seen[i] != 1)
+			errx(1, "message #%ld of producer %ld not delivered",
+			    i % mr->mr_msgs, i / mr->mr_msgs);
+	free(mr->mr_seen, M_TEMP);
+	free(mr->mr_next, M_TEMP);
+
+	for (i = 0, count = 0; i < mr->mr_nchans * FUSE_NLANES; i++) {
+		ml = &mr->mr_data->chans[i / FUSE_NLANES]->ms_lane[i %
+		    FUSE_NLANES];
+		if (ml->ml_depth != 0)
+			errx(1, "lane depth left at %lu", ml->ml_depth);
+		count += ml->ml_count;
+	}
+	if (count != (u_long)mr->mr_total)
+		errx(1, "lanes counted %lu messages out of %ld", count,
+		    mr->mr_total);
+
+	for (i = 1; i < mr->mr_nchans; i++) {
+		chan = mr->mr_data->chans[i];
+		if (chan->ch_dev != NULL)
+			ms_close(chan);
+	}
+	bench_session_done(mr->mr_data);
+
+	tickets = kshim_sysctl("vfs.fuse.ticket_count", NULL);
+	if (counter_u64_fetch(*tickets) != 0)
+		errx(1, "%ju tickets leaked",
+		    (uintmax_t)counter_u64_fetch(*tickets));
+
+	return (mr->mr_total * 1e9 / nsecs);
+}
+
+int
+ms_main(int argc, char **argv)
+{
+	static const int producers[] = { 1, 2, 4, 8, 16 };
+	struct ms_run mr;
+	long total = 200000;
+	int *lockless;
+	int nconsumers = 2;
+	int ch, i, n, nproducers;
+
+	memset(&mr, 0, sizeof(mr));
+	mr.mr_nchans = 1;
+	while ((ch = getopt(argc, argv, "c:m:n:x")) != -1) {
+		switch (ch) {
+		case 'c':
+			mr.mr_nchans = bench_number(optarg, "number of channels",
+			    1);
+			if (mr.mr_nchans > FUSE_MAXCHANS)
+				errx(1, "at most %d channels", FUSE_MAXCHANS);
+			break;
+		case 'm':
+			nconsumers = bench_number(optarg,
+			    "number of consumers", 1);
+			break;
+		case 'n':
+			total = bench_number(optarg, "number of messages", 1);
+			break;
+		case 'x':
+			mr.mr_close = 1;
+			break;
+		default:
+			return (1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (nconsumers < mr.mr_nchans)
+		errx(1, "fewer consumers than channels");
+	if ((lockless = kshim_sysctl("vfs.fuse.lockless_submit", NULL)) ==
+	    NULL)
+		errx(1, "no vfs.fuse.lockless_submit");
+
+	printf("%9s %16s %16s\n", "producers", "lockless msg/s",
+	    "locked msg/s");
+	n = argc > 0 ? argc : (int)nitems(producers);
+	for (i = 0; i < n; i++) {
+		nproducers = argc > 0 ?
+		    bench_number(argv[i], "number of producers", 1) :
+		    producers[i];
+
+		*lockless = 1;
+		printf("%9d %16.0f", nproducers,
+		    ms_measure(&mr, nproducers, nconsumers, total));
+		fflush(stdout);
+
+		*lockless = 0;
+		printf(" %16.0f\n",
+		    ms_measure(&mr, nproducers, nconsumers, total));
+	}
+	*lockless = 1;
+
+	return (0);
+}
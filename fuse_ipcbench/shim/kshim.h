@@ -0,0 +1,452 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * Just enough of the kernel API to build fuse_ipc.c as a userland
+ * program. The other headers in this directory stand in for the kernel
+ * headers fuse_ipc.c and its own headers include; each of them just
+ * pulls in this file.
+ *
+ * Mutexes are pthread mutexes, msleep(9) and wakeup(9) are done with a
+ * hashed sleep queue of per thread condition variables, UMA zones are
+ * locked free lists. Every thread gets a cpu of its own (see curcpu), as
+ * critical sections don't keep other threads off the per cpu data of
+ * the session in userland.
+ */
+
+#ifndef _KSHIM_H_
+#define _KSHIM_H_
+
+/* libc comes first, as malloc() and free() are redefined below */
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+struct cdev;
+struct componentname;
+struct knote;
+struct mount;
+struct proc;
+struct thread;
+struct uio;
+struct vnode;
+
+/* misc */
+
+#ifndef MAXPHYS
+#define MAXPHYS			(128 * 1024)
+#endif
+#ifndef PAGE_SIZE
+#define PAGE_SIZE		4096
+#endif
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE		64
+#endif
+#ifndef FREAD
+#define FREAD			0x0001
+#define FWRITE			0x0002
+#endif
+
+#define OID_AUTO		(-1)
+#define PZERO			22
+#define PVFS			(PZERO + 16)
+#define PCATCH			0x100
+#define PDROP			0x200
+
+/* not in fuse_param.h outside of the kernel */
+#define FUSE_DEFAULT_MAX_FREE_TICKETS	1024
+
+#define KSHIM_MAXCPU		256
+
+extern int hz;
+extern int tick;
+extern int mp_ncpus;
+extern u_int mp_maxid;
+
+#define ticks			kshim_ticks()
+#define curcpu			kshim_curcpu()
+#define curthread		kshim_curthread()
+
+int		 kshim_ticks(void);
+u_int		 kshim_curcpu(void);
+struct thread	*kshim_curthread(void);
+void		 kshim_init(void);
+
+#define critical_enter()	do { } while (0)
+#define critical_exit()		do { } while (0)
+
+void	panic(const char *fmt, ...) __attribute__((__noreturn__));
+
+#ifdef INVARIANTS
+#define KASSERT(exp, msg) do {						\
+	if (!(exp))							\
+		panic msg;						\
+} while (0)
+#else
+#define KASSERT(exp, msg)	do { } while (0)
+#endif
+#define MPASS(exp)	KASSERT((exp), ("Assertion %s failed at %s:%d",	\
+			    #exp, __FILE__, __LINE__))
+
+static __inline int imin(int a, int b) { return (a < b ? a : b); }
+static __inline int imax(int a, int b) { return (a > b ? a : b); }
+static __inline u_int min(u_int a, u_int b) { return (a < b ? a : b); }
+static __inline u_int max(u_int a, u_int b) { return (a > b ? a : b); }
+
+/* atomics */
+
+#define atomic_add_int(p, v)		((void)__sync_fetch_and_add((p), (v)))
+#define atomic_subtract_int(p, v)	((void)__sync_fetch_and_sub((p), (v)))
+#define atomic_add_long(p, v)		((void)__sync_fetch_and_add((p), (v)))
+#define atomic_subtract_long(p, v)	((void)__sync_fetch_and_sub((p), (v)))
+#define atomic_fetchadd_int(p, v)	__sync_fetch_and_add((p), (v))
+#define atomic_fetchadd_long(p, v)	__sync_fetch_and_add((p), (v))
+#define atomic_cmpset_int(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define atomic_cmpset_ptr(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define atomic_readandclear_ptr(p)	__sync_lock_test_and_set((p), 0)
+#define atomic_load_acq_int(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_load_acq_32(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define atomic_store_rel_int(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define atomic_store_rel_32(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define refcount_init(p, v)	(*(p) = (v))
+#define refcount_acquire(p)	((void)__sync_fetch_and_add((p), 1))
+#define refcount_release(p)	(__sync_fetch_and_sub((p), 1) == 1)
+
+/* memory */
+
+struct malloc_type {
+	const char	*ks_shortdesc;
+};
+
+#define MALLOC_DEFINE(type, shortdesc, longdesc)			\
+	struct malloc_type type[1] = { { shortdesc } }
+#define MALLOC_DECLARE(type)						\
+	extern struct malloc_type type[1]
+
+MALLOC_DECLARE(M_TEMP);
+
+#define M_NOWAIT	0x0001
+#define M_WAITOK	0x0002
+#define M_ZERO		0x0100
+
+void	*kshim_malloc(size_t size, int flags);
+#define malloc(size, type, flags)	kshim_malloc((size), (flags))
+#define free(addr, type)		(free)(addr)
+
+typedef struct uma_zone *uma_zone_t;
+typedef int (*uma_ctor)(void *mem, int size, void *arg, int flags);
+typedef void (*uma_dtor)(void *mem, int size, void *arg);
+typedef int (*uma_init)(void *mem, int size, int flags);
+typedef void (*uma_fini)(void *mem, int size);
+
+#define UMA_ALIGN_PTR	(sizeof(void *) - 1)
+#define UMA_ALIGN_CACHE	(CACHE_LINE_SIZE - 1)
+
+uma_zone_t	 uma_zcreate(const char *name, size_t size, uma_ctor ctor,
+		    uma_dtor dtor, uma_init uminit, uma_fini fini, int align,
+		    uint32_t flags);
+void		 uma_zdestroy(uma_zone_t zone);
+void		*uma_zalloc_arg(uma_zone_t zone, void *arg, int flags);
+void		 uma_zfree_arg(uma_zone_t zone, void *item, void *arg);
+#define uma_zalloc(zone, flags)	uma_zalloc_arg((zone), NULL, (flags))
+#define uma_zfree(zone, item)	uma_zfree_arg((zone), (item), NULL)
+
+typedef uint64_t *counter_u64_t;
+
+counter_u64_t	counter_u64_alloc(int flags);
+void		counter_u64_free(counter_u64_t c);
+#define counter_u64_add(c, v)	((void)__sync_fetch_and_add((c), (v)))
+#define counter_u64_fetch(c)	(*(volatile uint64_t *)(c))
+
+/* locks */
+
+struct mtx {
+	pthread_mutex_t	 mtx_lock;
+	struct thread	*mtx_owner;
+	const char	*mtx_name;
+};
+
+#define MTX_DEF		0x0000
+#define MA_OWNED	0x0001
+#define MA_NOTOWNED	0x0002
+
+void	mtx_init(struct mtx *m, const char *name, const char *type, int opts);
+void	mtx_destroy(struct mtx *m);
+void	mtx_lock(struct mtx *m);
+void	mtx_unlock(struct mtx *m);
+
+#define mtx_owned(m)	((m)->mtx_owner == curthread)
+#define mtx_assert(m, what) do {					\
+	KASSERT(((what) == MA_OWNED) == mtx_owned(m),			\
+	    ("mutex %s %sowned at %s:%d", (m)->mtx_name,		\
+	    (what) == MA_OWNED ? "not " : "", __FILE__, __LINE__));	\
+} while (0)
+
+struct sx {
+	pthread_rwlock_t sx_lock;
+};
+
+#define sx_init(sx, name)	pthread_rwlock_init(&(sx)->sx_lock, NULL)
+#define sx_destroy(sx)		pthread_rwlock_destroy(&(sx)->sx_lock)
+#define sx_xlock(sx)		pthread_rwlock_wrlock(&(sx)->sx_lock)
+#define sx_xunlock(sx)		pthread_rwlock_unlock(&(sx)->sx_lock)
+#define sx_slock(sx)		pthread_rwlock_rdlock(&(sx)->sx_lock)
+#define sx_sunlock(sx)		pthread_rwlock_unlock(&(sx)->sx_lock)
+
+/* sleeping */
+
+int	msleep(void *chan, struct mtx *m, int pri, const char *wmesg,
+	    int timo);
+void	wakeup(void *chan);
+void	wakeup_one(void *chan);
+
+/* processes */
+
+struct ucred {
+	uid_t	cr_uid;
+	uid_t	cr_ruid;
+	uid_t	cr_svuid;
+	gid_t	cr_rgid;
+	gid_t	cr_svgid;
+	gid_t	cr_groups[16];
+};
+
+struct proc {
+	pid_t	 p_pid;
+};
+
+struct thread {
+	struct proc	*td_proc;
+	struct ucred	*td_ucred;
+};
+
+#define crhold(cr)	(cr)
+#define crfree(cr)	do { } while (0)
+
+/* devices, mounts, vnodes */
+
+struct cdev {
+	void	*si_drv1;
+	void	*si_drv2;
+};
+
+#ifndef MNT_RDONLY
+#define MNT_RDONLY	0x00000001
+#endif
+
+struct mount {
+	uint64_t	 mnt_flag;
+	void		*mnt_data;
+	struct {
+		uint64_t	f_iosize;
+		struct {
+			int32_t	val[2];
+		}		f_fsid;
+	}		 mnt_stat;
+};
+
+enum vtype { VNON, VREG, VDIR, VBLK, VCHR, VLNK, VSOCK, VFIFO, VBAD,
+	VMARKER };
+
+#define VV_ROOT		0x0001
+
+struct vnode {
+	enum vtype	 v_type;
+	u_int		 v_vflag;
+	struct mount	*v_mount;
+	struct mount	*v_mountedhere;
+	void		*v_data;
+};
+
+struct vattr {
+	enum vtype	va_type;
+	u_short		va_mode;
+	u_short		va_nlink;
+	uid_t		va_uid;
+	gid_t		va_gid;
+	dev_t		va_fsid;
+	ino_t		va_fileid;
+	u_quad_t	va_size;
+	long		va_blocksize;
+	struct timespec	va_atime;
+	struct timespec	va_mtime;
+	struct timespec	va_ctime;
+	u_long		va_flags;
+	dev_t		va_rdev;
+	u_quad_t	va_bytes;
+};
+
+#define vattr_null(vap)	memset((vap), 0, sizeof(struct vattr))
+
+static __inline enum vtype
+kshim_iftovt(mode_t mode)
+{
+	switch (mode & S_IFMT) {
+	case S_IFREG:	return (VREG);
+	case S_IFDIR:	return (VDIR);
+	case S_IFBLK:	return (VBLK);
+	case S_IFCHR:	return (VCHR);
+	case S_IFLNK:	return (VLNK);
+	case S_IFSOCK:	return (VSOCK);
+	case S_IFIFO:	return (VFIFO);
+	default:	return (VNON);
+	}
+}
+#define IFTOVT(mode)	kshim_iftovt(mode)
+
+/* uio */
+
+struct uio {
+	struct iovec	*uio_iov;
+	int		 uio_iovcnt;
+	off_t		 uio_offset;
+	ssize_t		 uio_resid;
+	enum uio_seg	 uio_segflg;
+	enum uio_rw	 uio_rw;
+	struct thread	*uio_td;
+};
+
+int	uiomove(void *cp, int n, struct uio *uio);
+
+/* time */
+
+void	binuptime(struct bintime *bt);
+void	nanouptime(struct timespec *ts);
+
+/* vm */
+
+typedef struct vm_object *vm_object_t;
+
+/* select and kqueue, nobody polls here */
+
+struct knlist {
+	int	kl_count;
+};
+
+struct selinfo {
+	struct knlist	si_note;
+};
+
+#define SEL_WAITING(si)			0
+#define selwakeuppri(si, pri)		do { } while (0)
+#define seldrain(si)			do { } while (0)
+#define knlist_init_mtx(knl, m)		((knl)->kl_count = 0)
+#define knlist_clear(knl, islocked)	do { } while (0)
+#define knlist_destroy(knl)		do { } while (0)
+#define knlist_empty(knl)		((knl)->kl_count == 0)
+#define KNOTE_LOCKED(knl, hint)		do { } while (0)
+
+/* callouts and tasks, none of them is run */
+
+struct callout {
+	int	c_flags;
+};
+
+#define CALLOUT_MPSAFE			0x0008
+#define callout_init(c, mpsafe)		((c)->c_flags = 0)
+#define callout_init_mtx(c, m, flags)	((c)->c_flags = 0)
+#define callout_pending(c)		0
+#define callout_reset(c, t, func, arg)	do { } while (0)
+#define callout_drain(c)		do { } while (0)
+
+typedef void task_fn_t(void *context, int pending);
+
+struct task {
+	task_fn_t	*ta_func;
+	void		*ta_context;
+};
+
+#define TASK_INIT(task, priority, func, context) do {			\
+	(task)->ta_func = (func);					\
+	(task)->ta_context = (context);					\
+} while (0)
+#define taskqueue_enqueue(tq, task)	do { } while (0)
+#define taskqueue_drain(tq, task)	do { } while (0)
+
+/* DTrace probes */
+
+#define SDT_PROVIDER_DECLARE(prov)
+#define SDT_PROBE_DECLARE(prov, mod, func, name)
+#define SDT_PROBE1(prov, mod, func, name, a0)			do { } while (0)
+#define SDT_PROBE2(prov, mod, func, name, a0, a1)		do { } while (0)
+#define SDT_PROBE3(prov, mod, func, name, a0, a1, a2)		do { } while (0)
+#define SDT_PROBE4(prov, mod, func, name, a0, a1, a2, a3)	do { } while (0)
+#define SDT_PROBE5(prov, mod, func, name, a0, a1, a2, a3, a4)	do { } while (0)
+
+/*
+ * sysctls: the leaves are registered by their name, so that the knobs of
+ * fuse_ipc.c can be turned by kshim_sysctl().
+ */
+
+#define CTLFLAG_RD	0x80000000
+#define CTLFLAG_WR	0x40000000
+#define CTLFLAG_RW	(CTLFLAG_RD | CTLFLAG_WR)
+#define CTLFLAG_MPSAFE	0x00040000
+#define CTLTYPE_INT	2
+#define CTLTYPE_UINT	6
+#define CTLTYPE_LONG	7
+#define CTLTYPE_ULONG	8
+#define CTLTYPE_U64	9
+
+struct sysctl_ctx_list {
+	void	*tqh_first;
+};
+
+struct kshim_sysctl {
+	const char		*ks_parent;
+	const char		*ks_name;
+	int			 ks_type;
+	void			*ks_ptr;
+	struct kshim_sysctl	*ks_next;
+};
+
+void	 kshim_sysctl_register(struct kshim_sysctl *ks);
+void	*kshim_sysctl(const char *name, int *typep);
+
+#define SYSCTL_DECL(name)	extern int kshim_sysctl_decl_##name
+#define SYSCTL_NODE(parent, nbr, name, access, handler, descr)		\
+	SYSCTL_DECL(parent##_##name)
+
+#define KSHIM_SYSCTL(parent, name, type, ptr)				\
+static struct kshim_sysctl kshim_sysctl_##parent##_##name = {		\
+	#parent, #name, (type), (void *)(ptr), NULL			\
+};									\
+static void kshim_sysctl_reg_##parent##_##name(void)			\
+    __attribute__((__constructor__));					\
+static void								\
+kshim_sysctl_reg_##parent##_##name(void)				\
+{									\
+	kshim_sysctl_register(&kshim_sysctl_##parent##_##name);		\
+}									\
+SYSCTL_DECL(parent##_##name)
+
+#define SYSCTL_INT(parent, nbr, name, access, ptr, val, descr)		\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_INT, ptr)
+#define SYSCTL_UINT(parent, nbr, name, access, ptr, val, descr)	\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_UINT, ptr)
+#define SYSCTL_LONG(parent, nbr, name, access, ptr, val, descr)	\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_LONG, ptr)
+#define SYSCTL_ULONG(parent, nbr, name, access, ptr, val, descr)	\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_ULONG, ptr)
+/* the pointer registered is the one to the counter_u64_t */
+#define SYSCTL_COUNTER_U64(parent, nbr, name, access, ptr, descr)	\
+	KSHIM_SYSCTL(parent, name, CTLTYPE_U64, ptr)
+#define SYSCTL_STRING(parent, nbr, name, access, arg, len, descr)	\
+	SYSCTL_DECL(parent##_##name)
+
+#endif /* _KSHIM_H_ */
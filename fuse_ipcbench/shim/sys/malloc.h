@@ -0,0 +1,2 @@
+/* stand-in for the kernel header, see kshim.h */
+#include <kshim.h>
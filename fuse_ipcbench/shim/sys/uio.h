@@ -0,0 +1,3 @@
+/* the userland header, with the kernel bits of kshim.h */
+#include_next <sys/uio.h>
+#include <kshim.h>
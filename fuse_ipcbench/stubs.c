@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * The parts of the module fuse_ipc.c calls into, but which have no
+ * business in the benchmarks: channels have no rings, sessions keep no
+ * statistics and FORGETs are not batched.
+ */
+
+#include <sys/types.h>
+#include <sys/module.h>
+#include <sys/systm.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <sys/queue.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+
+#include "fuse.h"
+#include "fuse_ipc.h"
+#include "fuse_ring.h"
+#include "fuse_stats.h"
+#include "fuse_internal.h"
+
+struct mtx fuse_mtx;
+
+int
+fring_reserve(struct fuse_ring *ring, struct fuse_ticket *ftick,
+    uint32_t *posp)
+{
+	return (ENOSPC);
+}
+
+void
+fring_fill(struct fuse_ring *ring, struct fuse_ticket *ftick, uint32_t pos)
+{
+}
+
+int
+fring_publish(struct fuse_ring *ring, struct fuse_ticket *ftick, uint32_t pos)
+{
+	return (ENXIO);
+}
+
+void
+fring_teardown(struct fuse_chan *chan, struct fuse_ms_head *pending)
+{
+}
+
+void
+fuse_stats_sent(struct fuse_ticket *ftick)
+{
+}
+
+void
+fuse_stats_free(struct fuse_data *data)
+{
+}
+
+void
+fuse_internal_forget_task(void *arg, int pending)
+{
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * Benchmark of the device transport: the stand-in daemon of standin.c is
+ * mounted through mount_fusefs, served by read(2)/write(2), or with -r,
+ * by the shared memory rings, and the file system is hammered by a number
+ * of threads for a while. What they do is given by -w:
+ *
+ *   stat    fstat(2) of an open file, one GETATTR each (the default)
+ *   lookup  stat(2) by name, one LOOKUP and one GETATTR each
+ *   read    4k pread(2) at random, with O_DIRECT, one READ each
+ *
+ * With -D, the daemon just serves the mount until it's unmounted, for
+ * other tools to be run against it.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fuse_ringbench.h"
+
+#ifndef _PATH_MOUNT_FUSEFS
+#define _PATH_MOUNT_FUSEFS	"/usr/sbin/mount_fusefs"
+#endif
+
+#define RB_READSIZE		4096
+
+enum rb_work {
+	RB_STAT,
+	RB_LOOKUP,
+	RB_READ,
+};
+
+static const char *rb_works[] = {
+	[RB_STAT] = "stat",
+	[RB_LOOKUP] = "lookup",
+	[RB_READ] = "read",
+};
+
+struct rb_thread {
+	pthread_t	 rt_thread;
+	enum rb_work	 rt_work;
+	const char	*rt_path;
+	uint32_t	 rt_seed;
+	u_long		 rt_ops;
+};
+
+static volatile int rb_stop;
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-r] [-c chans] [-o option] [-s slots] "
+	    "[-t threads] [-T secs]\n"
+	    "                      [-w stat|lookup|read] mountpoint\n"
+	    "       %s -D [-r] [-c chans] [-o option] [-s slots] mountpoint\n",
+	    getprogname(), getprogname());
+	exit(1);
+}
+
+static long
+rb_number(const char *s, const char *what, long min)
+{
+	char *end;
+	long n;
+
+	errno = 0;
+	n = strtol(s, &end, 0);
+	if (errno != 0 || *s == '\0' || *end != '\0' || n < min)
+		errx(1, "bad %s: %s", what, s);
+
+	return (n);
+}
+
+static double
+rb_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/*
+ * Mount the session through mount_fusefs, which is handed the device by
+ * its file descriptor, as a library would do. The daemon must be serving
+ * already, mounting waits for INIT unless that's done in the background.
+ */
+static void
+rb_mount(int fd, char **opts, int nopts, const char *mountpoint)
+{
+	char **argv, fds[16];
+	pid_t pid;
+	int i, n = 0, status;
+
+	if ((argv = calloc(2 * nopts + 4, sizeof(*argv))) == NULL)
+		err(1, "calloc");
+	argv[n++] = "mount_fusefs";
+	for (i = 0; i < nopts; i++) {
+		argv[n++] = "-o";
+		argv[n++] = opts[i];
+	}
+	snprintf(fds, sizeof(fds), "%d", fd);
+	argv[n++] = fds;
+	argv[n++] = (char *)mountpoint;
+
+	if ((pid = fork()) == -1)
+		err(1, "fork");
+	if (pid == 0) {
+		execv(_PATH_MOUNT_FUSEFS, argv);
+		err(1, "%s", _PATH_MOUNT_FUSEFS);
+	}
+	if (waitpid(pid, &status, 0) == -1)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "mounting on %s failed", mountpoint);
+	free(argv);
+}
+
+/* xorshift32, state must not be 0 */
+static uint32_t
+rb_random(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+static void *
+rb_thread(void *arg)
+{
+	struct rb_thread *rt = arg;
+	char buf[RB_READSIZE];
+	struct stat sb;
+	off_t off;
+	int fd = -1;
+
+	if (rt->rt_work != RB_LOOKUP &&
+	    (fd = open(rt->rt_path, O_RDONLY |
+	    (rt->rt_work == RB_READ ? O_DIRECT : 0))) == -1)
+		err(1, "%s", rt->rt_path);
+
+	while (!rb_stop) {
+		switch (rt->rt_work) {
+		case RB_STAT:
+			if (fstat(fd, &sb) == -1)
+				err(1, "fstat");
+			break;
+		case RB_LOOKUP:
+			if (stat(rt->rt_path, &sb) == -1)
+				err(1, "%s", rt->rt_path);
+			break;
+		case RB_READ:
+			off = (off_t)(rb_random(&rt->rt_seed) %
+			    (STANDIN_SIZE / RB_READSIZE)) * RB_READSIZE;
+			if (pread(fd, buf, sizeof(buf), off) != sizeof(buf))
+				err(1, "pread");
+			/* see fuse_ringbench.h for what's in there */
+			if ((u_char)buf[1] != 1 ||
+			    (u_char)buf[sizeof(buf) - 1] != 0xff)
+				errx(1, "bad data read at %jd", (intmax_t)off);
+			break;
+		}
+		rt->rt_ops++;
+	}
+
+	if (fd != -1)
+		close(fd);
+
+	return (NULL);
+}
+
+static void
+rb_run(enum rb_work work, int nthreads, int secs, const char *mountpoint)
+{
+	struct rb_thread *rt;
+	struct timespec ts;
+	char *path;
+	double start, secs_taken;
+	u_long ops = 0;
+	int i, error;
+
+	if (asprintf(&path, "%s/%s", mountpoint, STANDIN_NAME) == -1)
+		err(1, "asprintf");
+	if ((rt = calloc(nthreads, sizeof(*rt))) == NULL)
+		err(1, "calloc");
+
+	start = rb_secs();
+	for (i = 0; i < nthreads; i++) {
+		rt[i].rt_work = work;
+		rt[i].rt_path = path;
+		rt[i].rt_seed = 2463534242U + i;
+		error = pthread_create(&rt[i].rt_thread, NULL, rb_thread,
+		    &rt[i]);
+		if (error != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+
+	ts.tv_sec = secs;
+	ts.tv_nsec = 0;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		;
+	rb_stop = 1;
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(rt[i].rt_thread, NULL);
+		ops += rt[i].rt_ops;
+	}
+
+	secs_taken = rb_secs() - start;
+	printf("%s: %d threads: %lu ops in %.2f s, %.0f ops/s\n",
+	    rb_works[work], nthreads, ops, secs_taken, ops / secs_taken);
+	free(rt);
+	free(path);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct standin *sd;
+	enum rb_work work = RB_STAT;
+	const char *mountpoint;
+	char **opts;
+	u_long served;
+	int nchans = 1, nslots = 256, nthreads = 1, secs = 5;
+	int ch, nopts = 0, serve = 0, ring = 0;
+	u_int i;
+
+	if ((opts = calloc(argc, sizeof(*opts))) == NULL)
+		err(1, "calloc");
+	while ((ch = getopt(argc, argv, "Dc:o:rs:t:T:w:")) != -1) {
+		switch (ch) {
+		case 'D':
+			serve = 1;
+			break;
+		case 'c':
+			nchans = rb_number(optarg, "number of channels", 1);
+			break;
+		case 'o':
+			opts[nopts++] = optarg;
+			break;
+		case 'r':
+			ring = 1;
+			break;
+		case 's':
+			nslots = rb_number(optarg, "number of slots", 1);
+			break;
+		case 't':
+			nthreads = rb_number(optarg, "number of threads", 1);
+			break;
+		case 'T':
+			secs = rb_number(optarg, "number of seconds", 1);
+			break;
+		case 'w':
+			for (i = 0; i < nitems(rb_works); i++)
+				if (strcmp(optarg, rb_works[i]) == 0)
+					break;
+			if (i == nitems(rb_works))
+				usage();
+			work = i;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	mountpoint = argv[0];
+
+	sd = standin_open(nchans, ring ? nslots : 0);
+	standin_start(sd);
+	rb_mount(standin_fd(sd), opts, nopts, mountpoint);
+	free(opts);
+
+	if (!serve) {
+		printf("%d channels, %s\n", nchans,
+		    ring ? "rings" : "read(2)/write(2)");
+		rb_run(work, nthreads, secs, mountpoint);
+		if (unmount(mountpoint, 0) == -1)
+			err(1, "unmount %s", mountpoint);
+	}
+
+	served = standin_wait(sd);
+	printf("%lu requests served\n", served);
+
+	return (0);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+#ifndef _FUSE_RINGBENCH_H_
+#define _FUSE_RINGBENCH_H_
+
+/*
+ * The file system of the stand-in daemon: the root directory holding a
+ * single read-only file, whose byte at offset off is (off & 0xff). No
+ * attributes or names may be cached, so that each stat(2) of the file is
+ * a GETATTR, and each lookup of its name a LOOKUP.
+ */
+#define STANDIN_NAME		"data"
+#define STANDIN_INO		2
+#define STANDIN_SIZE		(64 * 1024 * 1024)
+#define STANDIN_MAXWRITE	(128 * 1024)
+
+struct standin;
+
+/*
+ * Open a session with nchans channels, served by one thread each. With
+ * nslots > 0, each channel is given a ring of that many slots, else
+ * requests are read(2) and replies written back.
+ */
+struct standin	*standin_open(int nchans, int nslots);
+/* the device to hand to mount_fusefs */
+int		 standin_fd(struct standin *sd);
+void		 standin_start(struct standin *sd);
+/* wait for the session to end (on unmount) and release it */
+u_long		 standin_wait(struct standin *sd);
+
+#endif /* _FUSE_RINGBENCH_H_ */
@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2005 Csaba Henk.
+ * All Rights Reserved.
+ * See COPYRIGHT file for additional information.
+ */
+
+/*
+ * A stand-in FUSE daemon, speaking the device protocol directly: just
+ * enough of a file system (see fuse_ringbench.h) to be mounted and
+ * benchmarked, served as fast as it gets, so that what's measured is the
+ * transport. Requests are taken either by read(2) with replies written
+ * back, or off the shared memory rings of the channels (fuse_ioctl.h).
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fuse_kernel.h"
+#include "fuse_ioctl.h"
+#include "fuse_ringbench.h"
+
+/* the largest request we make sense of, that is, anything but WRITE */
+#define STANDIN_MAXREQ		4096
+
+struct standin_chan {
+	struct standin		*sc_sd;
+	int			 sc_fd;
+	pthread_t		 sc_thread;
+	u_long			 sc_served;
+
+	/* read(2) buffers, for all requests or those missing the ring */
+	char			*sc_buf;
+	size_t			 sc_bufsize;
+	char			*sc_out;
+	size_t			 sc_outsize;
+
+	/* the ring, if any */
+	struct fuse_ring_setup	 sc_setup;
+	char			*sc_map;
+	struct fuse_ring_hdr	*sc_sq;
+	struct fuse_ring_ent	*sc_sqe;
+	struct fuse_ring_hdr	*sc_cq;
+	struct fuse_ring_ent	*sc_cqe;
+	char			*sc_slots;
+};
+
+struct standin {
+	int			 sd_nchans;
+	struct standin_chan	*sd_chans;
+};
+
+static void
+standin_attr(uint64_t ino, struct fuse_attr *attr)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = ino;
+	if (ino == FUSE_ROOT_ID) {
+		attr->mode = S_IFDIR | 0755;
+		attr->nlink = 2;
+	} else {
+		attr->mode = S_IFREG | 0444;
+		attr->nlink = 1;
+		attr->size = STANDIN_SIZE;
+		attr->blocks = STANDIN_SIZE / 512;
+	}
+	attr->uid = getuid();
+	attr->gid = getgid();
+}
+
+static size_t
+standin_readdir(const struct fuse_read_in *fri, char *out, size_t outsize)
+{
+	static const struct {
+		const char	*name;
+		uint64_t	 ino;
+		uint32_t	 type;
+	} ents[] = {
+		{ ".", FUSE_ROOT_ID, DT_DIR },
+		{ "..", FUSE_ROOT_ID, DT_DIR },
+		{ STANDIN_NAME, STANDIN_INO, DT_REG },
+	};
+	struct fuse_dirent *fde;
+	size_t len = 0, reclen;
+	uint64_t i;
+
+	outsize = MIN(outsize, fri->size);
+	for (i = fri->offset; i < nitems(ents); i++) {
+		reclen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET +
+		    strlen(ents[i].name));
+		if (len + reclen > outsize)
+			break;
+		fde = (struct fuse_dirent *)(out + len);
+		memset(fde, 0, reclen);
+		fde->ino = ents[i].ino;
+		fde->off = i + 1;
+		fde->namelen = strlen(ents[i].name);
+		fde->type = ents[i].type;
+		memcpy(fde->name, ents[i].name, fde->namelen);
+		len += reclen;
+	}
+
+	return (len);
+}
+
+/*
+ * Serve the request in, of inlen bytes, replying into out, which has
+ * room for outsize bytes. Returns the length of the reply, 0 if none is
+ * due. in and out must not overlap.
+ */
+static size_t
+standin_serve(const char *in, size_t inlen, char *out, size_t outsize)
+{
+	const struct fuse_in_header *ih = (const struct fuse_in_header *)in;
+	const void *inb = ih + 1;
+	struct fuse_out_header *oh = (struct fuse_out_header *)out;
+	void *outb = oh + 1;
+	const struct fuse_read_in *fri;
+	struct fuse_init_out *fio;
+	struct fuse_entry_out *feo;
+	struct fuse_attr_out *fao;
+	struct fuse_open_out *foo;
+	struct fuse_statfs_out *fso;
+	size_t blen = 0, i;
+	int error = 0;
+
+	inlen -= sizeof(*ih);
+	outsize -= sizeof(*oh);
+
+	switch (ih->opcode) {
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+	case FUSE_INTERRUPT:
+		/* we don't keep count, and are never slow to answer */
+		return (0);
+
+	case FUSE_INIT:
+		if (((const struct fuse_init_in *)inb)->major !=
+		    FUSE_KERNEL_VERSION) {
+			error = EPROTONOSUPPORT;
+			break;
+		}
+		fio = outb;
+		memset(fio, 0, sizeof(*fio));
+		fio->major = FUSE_KERNEL_VERSION;
+		fio->minor = FUSE_KERNEL_MINOR_VERSION;
+		fio->max_readahead =
+		    ((const struct fuse_init_in *)inb)->max_readahead;
+		fio->max_write = STANDIN_MAXWRITE;
+		blen = sizeof(*fio);
+		break;
+
+	case FUSE_LOOKUP:
+		if (ih->nodeid != FUSE_ROOT_ID || inlen == 0 ||
+		    strncmp(inb, STANDIN_NAME, inlen) != 0) {
+			error = ENOENT;
+			break;
+		}
+		feo = outb;
+		memset(feo, 0, sizeof(*feo));
+		feo->nodeid = STANDIN_INO;
+		standin_attr(STANDIN_INO, &feo->attr);
+		blen = sizeof(*feo);
+		break;
+
+	case FUSE_GETATTR:
+		if (ih->nodeid != FUSE_ROOT_ID && ih->nodeid != STANDIN_INO) {
+			error = ENOENT;
+			break;
+		}
+		fao = outb;
+		memset(fao, 0, sizeof(*fao));
+		standin_attr(ih->nodeid, &fao->attr);
+		blen = sizeof(*fao);
+		break;
+
+	case FUSE_OPEN:
+	case FUSE_OPENDIR:
+		foo = outb;
+		memset(foo, 0, sizeof(*foo));
+		foo->fh = ih->nodeid;
+		blen = sizeof(*foo);
+		break;
+
+	case FUSE_READ:
+		fri = inb;
+		if (ih->nodeid != STANDIN_INO) {
+			error = EISDIR;
+			break;
+		}
+		if (fri->offset < STANDIN_SIZE)
+			blen = MIN(MIN(fri->size, outsize),
+			    STANDIN_SIZE - fri->offset);
+		/* the bytes tell their offset, see fuse_ringbench.h */
+		for (i = 0; i < blen; i++)
+			((char *)outb)[i] = (fri->offset + i) & 0xff;
+		break;
+
+	case FUSE_READDIR:
+		if (ih->nodeid != FUSE_ROOT_ID) {
+			error = ENOTDIR;
+			break;
+		}
+		blen = standin_readdir(inb, outb, outsize);
+		break;
+
+	case FUSE_STATFS:
+		fso = outb;
+		memset(fso, 0, sizeof(*fso));
+		fso->st.blocks = STANDIN_SIZE / 512;
+		fso->st.files = 2;
+		fso->st.bsize = 512;
+		fso->st.frsize = 512;
+		fso->st.namelen = MAXNAMLEN;
+		blen = sizeof(*fso);
+		break;
+
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+	case FUSE_FLUSH:
+	case FUSE_FSYNC:
+	case FUSE_FSYNCDIR:
+	case FUSE_ACCESS:
+	case FUSE_DESTROY:
+		break;
+
+	default:
+		error = ENOSYS;
+		break;
+	}
+
+	oh->len = sizeof(*oh) + blen;
+	oh->error = -error;
+	oh->unique = ih->unique;
+
+	return (oh->len);
+}
+
+/*
+ * Take what there is to read(2), until it would block, or for good
+ * without a ring. Returns non-zero once the session is gone.
+ */
+static int
+standin_read(struct standin_chan *sc)
+{
+	ssize_t n;
+	size_t len;
+
+	for (;;) {
+		if ((n = read(sc->sc_fd, sc->sc_buf, sc->sc_bufsize)) == -1) {
+			if (errno == EAGAIN)
+				return (0);
+			if (errno == EINTR)
+				continue;
+			if (errno == ENODEV)
+				return (1);
+			err(1, "read");
+		}
+		if ((size_t)n < sizeof(struct fuse_in_header))
+			errx(1, "short read of %zd bytes", n);
+		len = standin_serve(sc->sc_buf, n, sc->sc_out, sc->sc_outsize);
+		sc->sc_served++;
+		/*
+		 * Replies to requests given up on in the meantime are
+		 * refused, which doesn't hurt the session.
+		 */
+		if (len > 0 && write(sc->sc_fd, sc->sc_out, len) == -1 &&
+		    errno == ENODEV)
+			return (1);
+	}
+}
+
+/*
+ * Serve what was posted to the submission queue, replying in place and
+ * posting the slots to the completion queue; the kernel picks them up on
+ * the next ring enter. Returns the number of requests served.
+ */
+static uint32_t
+standin_ring(struct standin_chan *sc)
+{
+	char in[STANDIN_MAXREQ];
+	struct fuse_ring_ent *ent;
+	uint32_t mask = sc->sc_setup.fs_nslots - 1;
+	uint32_t head, tail, cqtail, n;
+	char *slot;
+	size_t len;
+
+	head = sc->sc_sq->fr_head;
+	tail = __atomic_load_n(&sc->sc_sq->fr_tail, __ATOMIC_ACQUIRE);
+	cqtail = sc->sc_cq->fr_tail;
+	n = tail - head;
+	for (; head != tail; head++) {
+		ent = &sc->sc_sqe[head & mask];
+		slot = sc->sc_slots + (size_t)ent->fe_slot *
+		    sc->sc_setup.fs_slotsize;
+		len = MIN(ent->fe_len, sizeof(in));
+		memcpy(in, slot, len);
+		len = standin_serve(in, len, slot, sc->sc_setup.fs_slotsize);
+		sc->sc_served++;
+
+		/* there's room, the queues are as deep as there are slots */
+		sc->sc_cqe[cqtail & mask].fe_slot = ent->fe_slot;
+		sc->sc_cqe[cqtail & mask].fe_len = len;
+		cqtail++;
+	}
+	__atomic_store_n(&sc->sc_sq->fr_head, head, __ATOMIC_RELEASE);
+	__atomic_store_n(&sc->sc_cq->fr_tail, cqtail, __ATOMIC_RELEASE);
+
+	return (n);
+}
+
+static void *
+standin_thread(void *arg)
+{
+	struct standin_chan *sc = arg;
+	struct fuse_ring_enter fn;
+	u_int rounds;
+
+	if (sc->sc_map == NULL) {
+		standin_read(sc);
+		return (NULL);
+	}
+
+	/*
+	 * Control messages, and requests which find no free slot, are
+	 * still to be read(2). That's tried when the ring turns out to be
+	 * empty, and every now and then so that they don't starve behind
+	 * a busy ring; but not each time, which would cost the ring a
+	 * syscall per round.
+	 */
+	for (rounds = 1;; rounds++) {
+		memset(&fn, 0, sizeof(fn));
+		fn.fn_flags = FUSE_RING_ENTER_GETEVENTS;
+		if (ioctl(sc->sc_fd, FUSEDEVIOCRINGENTER, &fn) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENODEV)
+				break;
+			err(1, "FUSEDEVIOCRINGENTER");
+		}
+		if ((standin_ring(sc) == 0 || rounds % 16 == 0) &&
+		    standin_read(sc))
+			break;
+	}
+
+	return (NULL);
+}
+
+static void
+standin_chan_ring(struct standin_chan *sc, int nslots)
+{
+	sc->sc_setup.fs_nslots = nslots;
+	sc->sc_setup.fs_slotsize = sizeof(struct fuse_out_header) +
+	    STANDIN_MAXWRITE;
+	if (ioctl(sc->sc_fd, FUSEDEVIOCRINGSETUP, &sc->sc_setup) == -1)
+		err(1, "FUSEDEVIOCRINGSETUP");
+	sc->sc_map = mmap(NULL, sc->sc_setup.fs_mapsize,
+	    PROT_READ | PROT_WRITE, MAP_SHARED, sc->sc_fd, 0);
+	if (sc->sc_map == MAP_FAILED)
+		err(1, "mmap");
+
+	sc->sc_sq = (struct fuse_ring_hdr *)(sc->sc_map +
+	    sc->sc_setup.fs_sq_off);
+	sc->sc_sqe = (struct fuse_ring_ent *)(sc->sc_sq + 1);
+	sc->sc_cq = (struct fuse_ring_hdr *)(sc->sc_map +
+	    sc->sc_setup.fs_cq_off);
+	sc->sc_cqe = (struct fuse_ring_ent *)(sc->sc_cq + 1);
+	sc->sc_slots = sc->sc_map + sc->sc_setup.fs_slots_off;
+}
+
+struct standin *
+standin_open(int nchans, int nslots)
+{
+	struct standin *sd;
+	struct standin_chan *sc;
+	int i;
+
+	if ((sd = calloc(1, sizeof(*sd))) == NULL ||
+	    (sd->sd_chans = calloc(nchans, sizeof(*sc))) == NULL)
+		err(1, "calloc");
+	sd->sd_nchans = nchans;
+
+	for (i = 0; i < nchans; i++) {
+		sc = &sd->sd_chans[i];
+		sc->sc_sd = sd;
+		/* with a ring, reading is only done until it would block */
+		if ((sc->sc_fd = open("/dev/fuse",
+		    O_RDWR | (nslots > 0 ? O_NONBLOCK : 0))) == -1)
+			err(1, "/dev/fuse");
+		if (i > 0 && ioctl(sc->sc_fd, FUSEDEVIOCATTACH,
+		    &sd->sd_chans[0].sc_fd) == -1)
+			err(1, "FUSEDEVIOCATTACH");
+		if (nslots > 0)
+			standin_chan_ring(sc, nslots);
+
+		sc->sc_bufsize = sizeof(struct fuse_in_header) +
+		    sizeof(struct fuse_write_in) + STANDIN_MAXWRITE;
+		sc->sc_outsize = sizeof(struct fuse_out_header) +
+		    STANDIN_MAXWRITE;
+		if ((sc->sc_buf = malloc(sc->sc_bufsize)) == NULL ||
+		    (sc->sc_out = malloc(sc->sc_outsize)) == NULL)
+			err(1, "malloc");
+	}
+
+	return (sd);
+}
+
+int
+standin_fd(struct standin *sd)
+{
+	return (sd->sd_chans[0].sc_fd);
+}
+
+void
+standin_start(struct standin *sd)
+{
+	int i, error;
+
+	for (i = 0; i < sd->sd_nchans; i++) {
+		error = pthread_create(&sd->sd_chans[i].sc_thread, NULL,
+		    standin_thread, &sd->sd_chans[i]);
+		if (error != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+}
+
+u_long
+standin_wait(struct standin *sd)
+{
+	struct standin_chan *sc;
+	u_long served = 0;
+	int i;
+
+	for (i = 0; i < sd->sd_nchans; i++) {
+		sc = &sd->sd_chans[i];
+		pthread_join(sc->sc_thread, NULL);
+		served += sc->sc_served;
+		if (sc->sc_map != NULL)
+			munmap(sc->sc_map, sc->sc_setup.fs_mapsize);
+		free(sc->sc_buf);
+		free(sc->sc_out);
+	}
+	/* the primary channel goes last, the session with it */
+	for (i = sd->sd_nchans - 1; i >= 0; i--)
+		close(sd->sd_chans[i].sc_fd);
+	free(sd->sd_chans);
+	free(sd);
+
+	return (served);
+}
@@ -68,6 +68,12 @@ struct mntopt mopts[] = {
 	{ "subtype=",            0, ALTF_SUBTYPE, 1 },
 	#define ALTF_SYNC_UNMOUNT 0x80
 	{ "sync_unmount",        0, ALTF_SYNC_UNMOUNT, 1 },
+	#define ALTF_MAXBACKGROUND 0x100
+	{ "max_background=",     0, ALTF_MAXBACKGROUND, 1 },
+	#define ALTF_CONGESTION 0x200
+	{ "congestion_threshold=", 0, ALTF_CONGESTION, 1 },
+	#define ALTF_MAXFREETICKETS 0x400
+	{ "max_free_tickets=",   0, ALTF_MAXFREETICKETS, 1 },
 	/* Linux specific options, we silently ignore them */
 	{ "fsname=",             0, 0x00, 1 },
 	{ "fd=",                 0, 0x00, 1 },
@@ -83,6 +89,7 @@ struct mntopt mopts[] = {
 	{ "no_namecache",        0, 0x00, 1 },
 	{ "no_mmap",             0, 0x00, 1 },
 	{ "brokenio",            0, 0x00, 1 },
+	{ "writeback_cache",     0, 0x00, 1 },
 
 	MOPT_STDOPTS,
 	MOPT_END
@@ -97,6 +104,9 @@ struct mntval {
 struct mntval mvals[] = {
 	{ ALTF_MAXREAD, NULL, 0 },
 	{ ALTF_SUBTYPE, NULL, 0 },
+	{ ALTF_MAXBACKGROUND, NULL, 0 },
+	{ ALTF_CONGESTION, NULL, 0 },
+	{ ALTF_MAXFREETICKETS, NULL, 0 },
 	{ 0, NULL, 0 }
 };
 
@@ -474,6 +484,9 @@ helpmsg(void)
 		 */
 	        "    -o subtype=NAME        set filesystem type\n"
 	        "    -o max_read=N          set maximum size of read requests\n"
+	        "    -o max_background=N    set number of maximum background requests\n"
+	        "    -o congestion_threshold=N  set kernel's congestion threshold\n"
+	        "    -o max_free_tickets=N  keep up to N request tickets for reuse\n"
 	        "    -o noprivate           allow secondary mounting of the filesystem\n"
 	        "    -o neglect_shares      don't report EBUSY when unmount attempted\n"
 	        "                           in presence of secondary mounts\n"